@@ -0,0 +1,252 @@
+#ifndef ADXV_SESSION_H
+#define ADXV_SESSION_H
+
+#include "Stats.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+// Long-lived control connection to ADXV. load_image requests are handed to a
+// sender thread through a single pending slot, so requests that arrive while
+// ADXV is unreachable or still within minInterval of the last load collapse
+// into the newest one. The connection is re-established with exponential
+// backoff whenever ADXV goes away.
+class AdxvSession {
+private:
+  std::string host_;
+  int port_;
+  int socket_;
+  std::chrono::milliseconds minInterval_;
+  std::chrono::milliseconds minBackoff_;
+  std::chrono::milliseconds maxBackoff_;
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::string pending_;
+  bool hasPending_;
+  bool running_;
+  std::thread sender_;
+
+  std::atomic<bool> connected_;
+  std::atomic<size_t> sent_;
+  std::atomic<size_t> coalesced_;
+  std::atomic<size_t> reconnects_;
+  LatencyHistogram sendTime_;
+  std::function<void(std::chrono::steady_clock::time_point)> firstSend_;
+
+  static int connectTo(const std::string &host, int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+      return -1;
+    }
+    int flag = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+    struct sockaddr_in serverAddr;
+    std::memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(port);
+    inet_pton(AF_INET, host.c_str(), &serverAddr.sin_addr);
+
+    if (connect(fd, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  bool openSocket() {
+    int fd = connectTo(host_, port_);
+    if (fd < 0) {
+      return false;
+    }
+    socket_ = fd;
+    connected_ = true;
+    return true;
+  }
+
+  void closeSocket() {
+    if (socket_ >= 0) {
+      close(socket_);
+      socket_ = -1;
+    }
+    connected_ = false;
+  }
+
+  bool sendAll(const std::string &message) {
+    size_t offset = 0;
+    while (offset < message.size()) {
+      ssize_t n = send(socket_, message.data() + offset,
+                       message.size() - offset, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return false;
+      }
+      offset += n;
+    }
+    return true;
+  }
+
+  // Waits until a request is pending and the rate limit allows sending it.
+  // Returns false when the session is stopped.
+  bool takePending(std::string &filename,
+                   std::chrono::steady_clock::time_point lastSend) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    wake_.wait(lock, [this] { return hasPending_ || !running_; });
+    wake_.wait_until(lock, lastSend + minInterval_,
+                     [this] { return !running_; });
+    if (!running_) {
+      return false;
+    }
+    filename = pending_;
+    hasPending_ = false;
+    return true;
+  }
+
+  // Re-queues a request that could not be sent unless a newer one arrived
+  void restorePending(const std::string &filename) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!hasPending_) {
+      pending_ = filename;
+      hasPending_ = true;
+    }
+  }
+
+  void sleepBackoff(std::chrono::milliseconds &backoff) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    wake_.wait_for(lock, backoff, [this] { return !running_; });
+    backoff = std::min(backoff * 2, maxBackoff_);
+  }
+
+  void senderLoop() {
+    std::chrono::milliseconds backoff = minBackoff_;
+    std::chrono::steady_clock::time_point lastSend;
+    std::string filename;
+    while (takePending(filename, lastSend)) {
+      if (socket_ < 0) {
+        if (!openSocket()) {
+          restorePending(filename);
+          sleepBackoff(backoff);
+          continue;
+        }
+        ++reconnects_;
+        backoff = minBackoff_;
+      }
+
+      auto sendStart = std::chrono::steady_clock::now();
+      if (!sendAll("load_image " + filename + "\n")) {
+        std::cerr << "Lost connection to ADXV: " << std::strerror(errno)
+                  << std::endl;
+        closeSocket();
+        restorePending(filename);
+        continue;
+      }
+      lastSend = std::chrono::steady_clock::now();
+      sendTime_.record(lastSend - sendStart);
+      if (sent_++ == 0 && firstSend_) {
+        firstSend_(lastSend);
+      }
+    }
+  }
+
+public:
+  AdxvSession(const std::string &host = "127.0.0.1", int port = 8100,
+              std::chrono::milliseconds minInterval =
+                  std::chrono::milliseconds(200))
+      : host_(host), port_(port), socket_(-1), minInterval_(minInterval),
+        minBackoff_(100), maxBackoff_(5000), hasPending_(false),
+        running_(false), connected_(false), sent_(0), coalesced_(0),
+        reconnects_(0) {}
+
+  ~AdxvSession() { stop(); }
+
+  // Whether ADXV accepts connections on host:port
+  static bool listening(const std::string &host, int port) {
+    int fd = connectTo(host, port);
+    if (fd < 0) {
+      return false;
+    }
+    close(fd);
+    return true;
+  }
+
+  // Connects before start(), retrying while ADXV is still starting up, so
+  // the first load_image goes out on an open socket
+  bool waitReady(std::chrono::milliseconds timeout) {
+    if (socket_ >= 0) {
+      return true;
+    }
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!openSocket()) {
+      if (std::chrono::steady_clock::now() >= deadline) {
+        return false;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    ++reconnects_;
+    return true;
+  }
+
+  // Called on the sender thread once the first load_image has gone out; set
+  // before start()
+  void onFirstSend(std::function<void(std::chrono::steady_clock::time_point)> done) {
+    firstSend_ = std::move(done);
+  }
+
+  void start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_) {
+      return;
+    }
+    running_ = true;
+    sender_ = std::thread(&AdxvSession::senderLoop, this);
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      running_ = false;
+    }
+    wake_.notify_all();
+    if (sender_.joinable()) {
+      sender_.join();
+    }
+    closeSocket();
+  }
+
+  // Never blocks; replaces any request that has not been sent yet
+  void loadImage(const std::string &filename) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (hasPending_) {
+        ++coalesced_;
+      }
+      pending_ = filename;
+      hasPending_ = true;
+    }
+    wake_.notify_all();
+  }
+
+  bool connected() const { return connected_; }
+  size_t sent() const { return sent_; }
+  const LatencyHistogram &sendTime() const { return sendTime_; }
+  size_t coalesced() const { return coalesced_; }
+  size_t reconnects() const { return reconnects_; }
+};
+
+#endif
@@ -0,0 +1,207 @@
+#ifndef BINNING_H
+#define BINNING_H
+
+#include "PixelScan.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+enum class BinMode { Sum, Max };
+
+// Downsamples frames by summing or taking the maximum of factor x factor
+// pixel blocks. Gap pixels are left out of a block; a block of only gaps
+// stays a gap, and sums of partly masked blocks are scaled up to the full
+// block so module edges do not show up dimmed. Sums saturate below the gap
+// value. Trailing rows and columns that do not fill a block are dropped.
+namespace binning {
+
+const uint32_t kSaturated = kGapPixel - 1;
+
+// Column-wise partial results of one block row, reduced in place
+struct RowScratch {
+  std::vector<uint32_t> value;
+  std::vector<uint32_t> valid;
+};
+
+#ifdef __SSE2__
+inline __m128i addSaturate(__m128i a, __m128i b) {
+  const __m128i bias = _mm_set1_epi32(static_cast<int>(0x80000000u));
+  __m128i sum = _mm_add_epi32(a, b);
+  // Unsigned a > a + b means the add wrapped
+  __m128i wrapped = _mm_cmpgt_epi32(_mm_xor_si128(a, bias), _mm_xor_si128(sum, bias));
+  return _mm_or_si128(sum, wrapped);
+}
+
+inline __m128i maxUnsigned(__m128i a, __m128i b) {
+  const __m128i bias = _mm_set1_epi32(static_cast<int>(0x80000000u));
+  __m128i greater = _mm_cmpgt_epi32(_mm_xor_si128(a, bias), _mm_xor_si128(b, bias));
+  return _mm_or_si128(_mm_and_si128(greater, a), _mm_andnot_si128(greater, b));
+}
+
+// Even and odd lanes of the eight words in a and b
+inline __m128i evenLanes(__m128i a, __m128i b) {
+  return _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b),
+                                         _MM_SHUFFLE(2, 0, 2, 0)));
+}
+
+inline __m128i oddLanes(__m128i a, __m128i b) {
+  return _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b),
+                                         _MM_SHUFFLE(3, 1, 3, 1)));
+}
+#endif
+
+inline uint32_t addSaturate(uint32_t a, uint32_t b) {
+  uint32_t sum = a + b;
+  return sum < a ? kGapPixel : sum;
+}
+
+// Folds factor source rows into one row of column values and valid counts
+inline void reduceRows(const uint32_t *src, uint32_t width, uint32_t columns,
+                       uint32_t factor, BinMode mode, RowScratch &scratch) {
+  uint32_t *value = scratch.value.data();
+  uint32_t *valid = scratch.valid.data();
+  uint32_t x = 0;
+#ifdef __SSE2__
+  const __m128i gap = _mm_set1_epi32(-1);
+  const __m128i one = _mm_set1_epi32(1);
+  for (; x + 4 <= columns; x += 4) {
+    __m128i acc = _mm_setzero_si128();
+    __m128i count = _mm_setzero_si128();
+    for (uint32_t r = 0; r < factor; ++r) {
+      __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + size_t(r) * width + x));
+      __m128i isGap = _mm_cmpeq_epi32(p, gap);
+      p = _mm_andnot_si128(isGap, p);
+      acc = mode == BinMode::Sum ? addSaturate(acc, p) : maxUnsigned(acc, p);
+      count = _mm_add_epi32(count, _mm_add_epi32(one, isGap));
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(value + x), acc);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(valid + x), count);
+  }
+#endif
+  for (; x < columns; ++x) {
+    uint32_t acc = 0, count = 0;
+    for (uint32_t r = 0; r < factor; ++r) {
+      uint32_t p = src[size_t(r) * width + x];
+      if (p != kGapPixel) {
+        acc = mode == BinMode::Sum ? addSaturate(acc, p) : std::max(acc, p);
+        ++count;
+      }
+    }
+    value[x] = acc;
+    valid[x] = count;
+  }
+}
+
+// Combines neighbouring columns pairwise, halving the row
+inline void halveColumns(uint32_t columns, BinMode mode, RowScratch &scratch) {
+  uint32_t *value = scratch.value.data();
+  uint32_t *valid = scratch.valid.data();
+  uint32_t half = columns / 2;
+  uint32_t x = 0;
+#ifdef __SSE2__
+  // Writes trail the reads, so the row can be halved in place
+  for (; x + 4 <= half; x += 4) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(value + 2 * x));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(value + 2 * x + 4));
+    __m128i even = evenLanes(a, b), odd = oddLanes(a, b);
+    __m128i combined = mode == BinMode::Sum ? addSaturate(even, odd) : maxUnsigned(even, odd);
+    a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(valid + 2 * x));
+    b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(valid + 2 * x + 4));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(value + x), combined);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(valid + x),
+                     _mm_add_epi32(evenLanes(a, b), oddLanes(a, b)));
+  }
+#endif
+  for (; x < half; ++x) {
+    uint32_t a = value[2 * x], b = value[2 * x + 1];
+    value[x] = mode == BinMode::Sum ? addSaturate(a, b) : std::max(a, b);
+    valid[x] = valid[2 * x] + valid[2 * x + 1];
+  }
+}
+
+// Output pixel of one block: a gap if every pixel was masked, the sum
+// scaled to the whole block if some were, clamped below the gap value
+inline uint32_t finishBlock(uint32_t value, uint32_t valid, uint32_t blockPixels,
+                            BinMode mode) {
+  if (valid == 0) {
+    return kGapPixel;
+  }
+  if (value == kGapPixel) {
+    return kSaturated;
+  }
+  if (mode == BinMode::Sum && valid < blockPixels) {
+    uint64_t scaled = (uint64_t(value) * blockPixels + valid / 2) / valid;
+    return static_cast<uint32_t>(std::min<uint64_t>(scaled, kSaturated));
+  }
+  return value;
+}
+
+inline void finishRow(uint32_t *dst, uint32_t columns, uint32_t blockPixels,
+                      BinMode mode, const RowScratch &scratch) {
+  const uint32_t *value = scratch.value.data();
+  const uint32_t *valid = scratch.valid.data();
+  uint32_t x = 0;
+#ifdef __SSE2__
+  // Whole blocks that did not saturate are stored as they are, the rest
+  // of a vector goes through finishBlock
+  const __m128i full = _mm_set1_epi32(static_cast<int>(blockPixels));
+  const __m128i gap = _mm_set1_epi32(-1);
+  for (; x + 4 <= columns; x += 4) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(value + x));
+    __m128i n = _mm_loadu_si128(reinterpret_cast<const __m128i *>(valid + x));
+    __m128i fixup = _mm_or_si128(_mm_xor_si128(_mm_cmpeq_epi32(n, full), gap),
+                                 _mm_cmpeq_epi32(v, gap));
+    if (_mm_movemask_epi8(fixup) == 0) {
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), v);
+    } else {
+      for (uint32_t i = x; i < x + 4; ++i) {
+        dst[i] = finishBlock(value[i], valid[i], blockPixels, mode);
+      }
+    }
+  }
+#endif
+  for (; x < columns; ++x) {
+    dst[x] = finishBlock(value[x], valid[x], blockPixels, mode);
+  }
+}
+
+// Bins a width x height frame into dst, which holds (width / factor) x
+// (height / factor) pixels. factor is a power of two. Block rows are spread
+// over the pool.
+inline void bin(const uint32_t *src, uint32_t width, uint32_t height,
+                uint32_t factor, BinMode mode, uint32_t *dst,
+                ThreadPool *pool = nullptr) {
+  if (factor == 0 || (factor & (factor - 1)) != 0) {
+    throw std::runtime_error("Binning factor must be a power of two");
+  }
+  uint32_t outWidth = width / factor;
+  uint32_t outHeight = height / factor;
+  uint32_t columns = outWidth * factor;
+  auto binRows = [&](size_t begin, size_t end) {
+    RowScratch scratch;
+    scratch.value.resize(columns);
+    scratch.valid.resize(columns);
+    for (size_t y = begin; y < end; ++y) {
+      reduceRows(src + y * factor * width, width, columns, factor, mode, scratch);
+      for (uint32_t n = columns; n > outWidth; n /= 2) {
+        halveColumns(n, mode, scratch);
+      }
+      finishRow(dst + y * outWidth, outWidth, factor * factor, mode, scratch);
+    }
+  };
+  if (pool) {
+    pool->parallelFor(outHeight, binRows, 16);
+  } else {
+    binRows(0, outHeight);
+  }
+}
+
+} // namespace binning
+
+#endif
@@ -0,0 +1,191 @@
+#ifndef BITSHUFFLE_LZ4_H
+#define BITSHUFFLE_LZ4_H
+
+#include "ThreadPool.h"
+#include <cstdint>
+#include <cstring>
+#include <lz4.h>
+#include <stdexcept>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Decoders for the payload encodings of the Eiger stream interface:
+// plain LZ4 ("lz4<") and bitshuffle followed by LZ4 ("bs16-lz4<",
+// "bs32-lz4<"), using the block layout of the bitshuffle library.
+namespace bitshuffle {
+
+inline uint64_t readUint64BE(const uint8_t *p) {
+  uint64_t value = 0;
+  for (int i = 0; i < 8; ++i) {
+    value = (value << 8) | p[i];
+  }
+  return value;
+}
+
+inline uint32_t readUint32BE(const uint8_t *p) {
+  return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+         (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+// Transposes an 8x8 bit matrix held in a 64-bit word
+inline uint64_t transpose8x8(uint64_t x) {
+  uint64_t t;
+  t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+  x = x ^ t ^ (t << 7);
+  t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+  x = x ^ t ^ (t << 14);
+  t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+  x = x ^ t ^ (t << 28);
+  return x;
+}
+
+// Reverses the bit shuffle of one block of n elements (n a multiple of 8).
+// The input holds 8 * elemSize bit planes of n / 8 bytes each; plane
+// 8 * j + k carries bit k of byte j of every element, element 8 * i + m in
+// bit m of byte i.
+inline void unshuffleBlock(const uint8_t *in, uint8_t *out, size_t n,
+                           size_t elemSize) {
+  const size_t planeBytes = n / 8;
+  for (size_t j = 0; j < elemSize; ++j) {
+    const uint8_t *planes = in + j * 8 * planeBytes;
+    size_t i = 0;
+#ifdef __SSE2__
+    // Transpose 16 groups of 8 elements at a time, then peel one element
+    // per movemask from the most significant bit down
+    for (; i + 16 <= planeBytes; i += 16) {
+      __m128i r0 = _mm_loadu_si128((const __m128i *)(planes + 0 * planeBytes + i));
+      __m128i r1 = _mm_loadu_si128((const __m128i *)(planes + 1 * planeBytes + i));
+      __m128i r2 = _mm_loadu_si128((const __m128i *)(planes + 2 * planeBytes + i));
+      __m128i r3 = _mm_loadu_si128((const __m128i *)(planes + 3 * planeBytes + i));
+      __m128i r4 = _mm_loadu_si128((const __m128i *)(planes + 4 * planeBytes + i));
+      __m128i r5 = _mm_loadu_si128((const __m128i *)(planes + 5 * planeBytes + i));
+      __m128i r6 = _mm_loadu_si128((const __m128i *)(planes + 6 * planeBytes + i));
+      __m128i r7 = _mm_loadu_si128((const __m128i *)(planes + 7 * planeBytes + i));
+
+      __m128i t0 = _mm_unpacklo_epi8(r0, r1), t1 = _mm_unpackhi_epi8(r0, r1);
+      __m128i t2 = _mm_unpacklo_epi8(r2, r3), t3 = _mm_unpackhi_epi8(r2, r3);
+      __m128i t4 = _mm_unpacklo_epi8(r4, r5), t5 = _mm_unpackhi_epi8(r4, r5);
+      __m128i t6 = _mm_unpacklo_epi8(r6, r7), t7 = _mm_unpackhi_epi8(r6, r7);
+
+      __m128i u0 = _mm_unpacklo_epi16(t0, t2), u1 = _mm_unpackhi_epi16(t0, t2);
+      __m128i u2 = _mm_unpacklo_epi16(t1, t3), u3 = _mm_unpackhi_epi16(t1, t3);
+      __m128i u4 = _mm_unpacklo_epi16(t4, t6), u5 = _mm_unpackhi_epi16(t4, t6);
+      __m128i u6 = _mm_unpacklo_epi16(t5, t7), u7 = _mm_unpackhi_epi16(t5, t7);
+
+      // Each vector now holds planes 0..7 of two consecutive groups
+      __m128i groups[8] = {
+          _mm_unpacklo_epi32(u0, u4), _mm_unpackhi_epi32(u0, u4),
+          _mm_unpacklo_epi32(u1, u5), _mm_unpackhi_epi32(u1, u5),
+          _mm_unpacklo_epi32(u2, u6), _mm_unpackhi_epi32(u2, u6),
+          _mm_unpacklo_epi32(u3, u7), _mm_unpackhi_epi32(u3, u7)};
+
+      for (size_t g = 0; g < 8; ++g) {
+        __m128i x = groups[g];
+        size_t first = (i + 2 * g) * 8;
+        for (int m = 7; m >= 0; --m) {
+          int bits = _mm_movemask_epi8(x);
+          out[(first + m) * elemSize + j] = static_cast<uint8_t>(bits);
+          out[(first + 8 + m) * elemSize + j] = static_cast<uint8_t>(bits >> 8);
+          x = _mm_add_epi8(x, x);
+        }
+      }
+    }
+#endif
+    for (; i < planeBytes; ++i) {
+      uint64_t x = 0;
+      for (size_t k = 0; k < 8; ++k) {
+        x |= uint64_t(planes[k * planeBytes + i]) << (8 * k);
+      }
+      x = transpose8x8(x);
+      for (size_t m = 0; m < 8; ++m) {
+        out[(i * 8 + m) * elemSize + j] = static_cast<uint8_t>(x >> (8 * m));
+      }
+    }
+  }
+}
+
+// Decodes a plain LZ4 block into exactly dstSize bytes
+inline void decodeLz4(const uint8_t *src, size_t srcSize, uint8_t *dst,
+                      size_t dstSize) {
+  int n = LZ4_decompress_safe(reinterpret_cast<const char *>(src),
+                              reinterpret_cast<char *>(dst),
+                              static_cast<int>(srcSize),
+                              static_cast<int>(dstSize));
+  if (n < 0 || static_cast<size_t>(n) != dstSize) {
+    throw std::runtime_error("Corrupt LZ4 payload");
+  }
+}
+
+// Decodes a bitshuffle-LZ4 payload (12 byte header, then per block a 4 byte
+// compressed size and LZ4 data) into dstSize bytes. Blocks are located in
+// one pass over the sizes and then decompressed and unshuffled in parallel.
+inline void decodeBitshuffleLz4(const uint8_t *src, size_t srcSize,
+                                uint8_t *dst, size_t dstSize, size_t elemSize,
+                                ThreadPool *pool = nullptr) {
+  if (srcSize < 12) {
+    throw std::runtime_error("Truncated bitshuffle header");
+  }
+  uint64_t totalBytes = readUint64BE(src);
+  size_t blockBytes = readUint32BE(src + 8);
+  if (totalBytes != dstSize || blockBytes == 0 || blockBytes % elemSize != 0) {
+    throw std::runtime_error("Unexpected bitshuffle header");
+  }
+  size_t blockElems = blockBytes / elemSize;
+  // Blocks hold a multiple of 8 elements; the last few are stored raw
+  blockElems -= blockElems % 8;
+  size_t totalElems = dstSize / elemSize;
+  size_t leftoverElems = totalElems % 8;
+  size_t shuffledElems = totalElems - leftoverElems;
+
+  struct Block {
+    size_t srcOffset;
+    size_t srcSize;
+    size_t elemOffset;
+    size_t elems;
+  };
+  std::vector<Block> blocks;
+  size_t offset = 12;
+  for (size_t elem = 0; elem < shuffledElems; elem += blockElems) {
+    if (offset + 4 > srcSize) {
+      throw std::runtime_error("Truncated bitshuffle block");
+    }
+    Block block;
+    block.srcSize = readUint32BE(src + offset);
+    block.srcOffset = offset + 4;
+    block.elemOffset = elem;
+    block.elems = std::min(blockElems, shuffledElems - elem);
+    if (block.srcOffset + block.srcSize > srcSize) {
+      throw std::runtime_error("Truncated bitshuffle block");
+    }
+    blocks.push_back(block);
+    offset = block.srcOffset + block.srcSize;
+  }
+  if (offset + leftoverElems * elemSize > srcSize) {
+    throw std::runtime_error("Truncated bitshuffle payload");
+  }
+  std::memcpy(dst + shuffledElems * elemSize, src + offset,
+              leftoverElems * elemSize);
+
+  auto decodeBlocks = [&](size_t begin, size_t end) {
+    std::vector<uint8_t> scratch(blockElems * elemSize);
+    for (size_t b = begin; b < end; ++b) {
+      const Block &block = blocks[b];
+      size_t bytes = block.elems * elemSize;
+      decodeLz4(src + block.srcOffset, block.srcSize, scratch.data(), bytes);
+      unshuffleBlock(scratch.data(), dst + block.elemOffset * elemSize,
+                     block.elems, elemSize);
+    }
+  };
+  if (pool) {
+    pool->parallelFor(blocks.size(), decodeBlocks, 16);
+  } else {
+    decodeBlocks(0, blocks.size());
+  }
+}
+
+} // namespace bitshuffle
+
+#endif
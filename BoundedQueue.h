@@ -0,0 +1,167 @@
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+// Bounded lock-free queue connecting two pipeline stages. Each queue has one
+// producer and one consumer, but the producer may also pop when it drops the
+// oldest entry, so the slots use per-cell sequence numbers (Vyukov) instead of
+// a plain SPSC ring.
+template <typename T> class BoundedQueue {
+private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  const size_t capacity_;
+  // A single cell cannot tell "full at pos" from "empty at pos + 1", so the
+  // ring always has at least two and tryPush enforces capacity_
+  const size_t slots_;
+  std::unique_ptr<Cell[]> cells_;
+  alignas(64) std::atomic<size_t> head_;
+  alignas(64) std::atomic<size_t> tail_;
+  alignas(64) std::atomic<size_t> pushed_;
+  std::atomic<size_t> dropped_;
+  std::atomic<size_t> maxDepth_;
+
+  void countPush() {
+    pushed_.fetch_add(1, std::memory_order_relaxed);
+    size_t depth = size();
+    size_t maxDepth = maxDepth_.load(std::memory_order_relaxed);
+    while (depth > maxDepth &&
+           !maxDepth_.compare_exchange_weak(maxDepth, depth,
+                                            std::memory_order_relaxed)) {
+    }
+  }
+
+public:
+  explicit BoundedQueue(size_t capacity)
+      : capacity_(std::max<size_t>(capacity, 1)),
+        slots_(std::max<size_t>(capacity_, 2)), cells_(new Cell[slots_]),
+        head_(0), tail_(0), pushed_(0), dropped_(0), maxDepth_(0) {
+    for (size_t i = 0; i < slots_; ++i) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  BoundedQueue(const BoundedQueue &) = delete;
+  BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+  bool tryPush(T &value) {
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell &cell = cells_[pos % slots_];
+      size_t seq = cell.sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        intptr_t depth = static_cast<intptr_t>(pos) -
+                         static_cast<intptr_t>(head_.load(std::memory_order_acquire));
+        if (depth >= static_cast<intptr_t>(capacity_)) {
+          return false;
+        }
+        if (tail_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          cell.value = std::move(value);
+          cell.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  bool tryPop(T &value) {
+    size_t pos = head_.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell &cell = cells_[pos % slots_];
+      size_t seq = cell.sequence.load(std::memory_order_acquire);
+      intptr_t diff =
+          static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          value = std::move(cell.value);
+          cell.value = T();
+          cell.sequence.store(pos + slots_, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Pushes the value, discarding the oldest entries while the queue is full
+  // so the consumer always sees the newest frames
+  void pushDropOldest(T value) {
+    while (!tryPush(value)) {
+      T oldest;
+      if (tryPop(oldest)) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+    countPush();
+  }
+
+  // Waits for room instead of dropping, for consumers that must see every
+  // entry. Returns false if running is cleared first.
+  bool pushWait(T value, const std::atomic<bool> &running) {
+    int idle = 0;
+    while (!tryPush(value)) {
+      if (!running.load(std::memory_order_relaxed)) {
+        return false;
+      }
+      if (++idle < 64) {
+        std::this_thread::yield();
+      } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+      }
+    }
+    countPush();
+    return true;
+  }
+
+  // Waits for an entry, backing off from spinning to short sleeps. Returns
+  // false once running is cleared and the queue is empty.
+  bool waitPop(T &value, const std::atomic<bool> &running) {
+    int idle = 0;
+    while (!tryPop(value)) {
+      if (!running.load(std::memory_order_relaxed)) {
+        return false;
+      }
+      if (++idle < 64) {
+        std::this_thread::yield();
+      } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+      }
+    }
+    return true;
+  }
+
+  size_t size() const {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    size_t head = head_.load(std::memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+  }
+
+  size_t capacity() const { return capacity_; }
+  size_t pushed() const { return pushed_.load(std::memory_order_relaxed); }
+  size_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+  size_t maxDepth() const { return maxDepth_.load(std::memory_order_relaxed); }
+
+  void resetMaxDepth() { maxDepth_.store(0, std::memory_order_relaxed); }
+};
+
+#endif
@@ -0,0 +1,310 @@
+#ifndef CAPTURE_FILE_H
+#define CAPTURE_FILE_H
+
+#include "FrameBufferPool.h"
+#include "MetadataSource.h"
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// Append-only capture of received frames. The capture file starts with a
+// FileHeader; each record is a RecordHeader, the frame's ETag and
+// Last-Modified strings and its raw bytes, which start and end on a
+// kAlignment boundary so they can be decoded in place from a mapping.
+// path + ".idx" holds one IndexEntry per record and is only appended once
+// the record is complete, so a capture cut short by a crash still indexes
+// only whole records. Without the index the records are walked instead.
+namespace capture {
+
+const char kMagic[8] = {'Y', 'M', 'O', 'N', 'C', 'A', 'P', '1'};
+const uint32_t kVersion = 1;
+const uint32_t kRecordMagic = 0x314D5246; // "FRM1"
+const uint64_t kAlignment = 64;
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t alignment;
+  // Wall clock time the capture was started, ns since the epoch
+  int64_t startedNs;
+  uint8_t reserved[40];
+};
+
+struct RecordHeader {
+  uint32_t magic;
+  // Offset of the frame bytes from the start of the record
+  uint32_t payloadOffset;
+  uint64_t payloadBytes;
+  // steady_clock time the frame was received; only differences matter
+  int64_t receivedNs;
+  int64_t seriesId;
+  int64_t imageId;
+  uint32_t format;
+  uint32_t width;
+  uint32_t height;
+  uint32_t etagBytes;
+  uint32_t lastModifiedBytes;
+  uint32_t reserved;
+  double pixelSizeX;
+  double pixelSizeY;
+  // Metadata snapshot the frame was written with, in detector pixels
+  double bcX;
+  double bcY;
+  double dDistance;
+  double incidentEnergy;
+  double incidentWavelength;
+  // Age of the snapshot when the frame was received
+  int64_t metadataAgeNs;
+};
+
+struct IndexEntry {
+  uint64_t offset;
+  uint64_t payloadBytes;
+  int64_t receivedNs;
+  uint64_t reserved;
+};
+
+static_assert(sizeof(FileHeader) % kAlignment == 0, "records start aligned");
+
+inline uint64_t align(uint64_t offset) {
+  return (offset + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+inline int64_t steadyNs(std::chrono::steady_clock::time_point time) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch())
+      .count();
+}
+
+// One captured frame, pointing into the mapped capture
+struct Record {
+  int64_t receivedNs = 0;
+  FrameValidators validators;
+  FrameLayout layout;
+  FrameMetadata metadata;
+  const uint8_t *payload = nullptr;
+  size_t payloadBytes = 0;
+};
+
+} // namespace capture
+
+// Appends frames to a new capture file, replacing an existing one
+class CaptureWriter {
+private:
+  std::string path_;
+  FILE *data_;
+  FILE *index_;
+  uint64_t offset_;
+  size_t records_;
+
+  static std::runtime_error error(const std::string &what, const std::string &path) {
+    return std::runtime_error(what + " " + path + ": " + std::strerror(errno));
+  }
+
+  bool put(const void *bytes, size_t n) {
+    return n == 0 || std::fwrite(bytes, 1, n, data_) == n;
+  }
+
+public:
+  explicit CaptureWriter(const std::string &path)
+      : path_(path), data_(nullptr), index_(nullptr), offset_(0), records_(0) {
+    data_ = std::fopen(path_.c_str(), "wb");
+    if (!data_) {
+      throw error("Unable to create capture", path_);
+    }
+    index_ = std::fopen((path_ + ".idx").c_str(), "wb");
+    if (!index_) {
+      std::fclose(data_);
+      throw error("Unable to create capture index", path_ + ".idx");
+    }
+    capture::FileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, capture::kMagic, sizeof(header.magic));
+    header.version = capture::kVersion;
+    header.alignment = static_cast<uint32_t>(capture::kAlignment);
+    header.startedNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::system_clock::now().time_since_epoch())
+                           .count();
+    if (!put(&header, sizeof(header)) || std::fflush(data_) != 0) {
+      throw error("Unable to write capture", path_);
+    }
+    offset_ = sizeof(header);
+  }
+
+  ~CaptureWriter() {
+    std::fclose(data_);
+    std::fclose(index_);
+  }
+
+  CaptureWriter(const CaptureWriter &) = delete;
+  CaptureWriter &operator=(const CaptureWriter &) = delete;
+
+  // Appends the raw frame with the metadata it was written with, then its
+  // index entry; both are flushed so readers see whole records
+  void append(const FrameBuffer &frame, const FrameMetadata &metadata) {
+    const FrameValidators &ids = frame.validators;
+    capture::RecordHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = capture::kRecordMagic;
+    uint64_t strings = sizeof(header) + ids.etag.size() + ids.lastModified.size();
+    header.payloadOffset = static_cast<uint32_t>(capture::align(strings));
+    header.payloadBytes = frame.size();
+    header.receivedNs = capture::steadyNs(frame.received);
+    header.seriesId = ids.seriesId;
+    header.imageId = ids.imageId;
+    header.format = static_cast<uint32_t>(frame.layout.format);
+    header.width = frame.layout.width;
+    header.height = frame.layout.height;
+    header.etagBytes = static_cast<uint32_t>(ids.etag.size());
+    header.lastModifiedBytes = static_cast<uint32_t>(ids.lastModified.size());
+    header.pixelSizeX = frame.layout.pixelSizeX;
+    header.pixelSizeY = frame.layout.pixelSizeY;
+    header.bcX = metadata.bcX;
+    header.bcY = metadata.bcY;
+    header.dDistance = metadata.dDistance;
+    header.incidentEnergy = metadata.incidentEnergy;
+    header.incidentWavelength = metadata.incidentWavelength;
+    header.metadataAgeNs = header.receivedNs - capture::steadyNs(metadata.updated);
+
+    static const uint8_t kPadding[capture::kAlignment] = {0};
+    uint64_t end = capture::align(header.payloadOffset + header.payloadBytes);
+    bool ok = put(&header, sizeof(header)) && put(ids.etag.data(), ids.etag.size()) &&
+              put(ids.lastModified.data(), ids.lastModified.size()) &&
+              put(kPadding, header.payloadOffset - strings) &&
+              put(frame.data(), frame.size()) &&
+              put(kPadding, end - header.payloadOffset - header.payloadBytes) &&
+              std::fflush(data_) == 0;
+    if (!ok) {
+      throw error("Unable to write capture", path_);
+    }
+
+    capture::IndexEntry entry = {offset_, header.payloadBytes, header.receivedNs, 0};
+    if (std::fwrite(&entry, sizeof(entry), 1, index_) != 1 || std::fflush(index_) != 0) {
+      throw error("Unable to write capture index", path_ + ".idx");
+    }
+    offset_ += end;
+    ++records_;
+  }
+
+  size_t records() const { return records_; }
+  uint64_t bytes() const { return offset_; }
+};
+
+// Maps a capture read-only and indexes its records
+class CaptureReader {
+private:
+  std::string path_;
+  const uint8_t *map_;
+  size_t size_;
+  std::vector<uint64_t> offsets_;
+
+  static std::runtime_error error(const std::string &what, const std::string &path) {
+    return std::runtime_error(what + " " + path + ": " + std::strerror(errno));
+  }
+
+  // A record lies within the file and is complete
+  bool validRecord(uint64_t offset) const {
+    if (offset % capture::kAlignment != 0 || offset + sizeof(capture::RecordHeader) > size_) {
+      return false;
+    }
+    const auto *header = reinterpret_cast<const capture::RecordHeader *>(map_ + offset);
+    return header->magic == capture::kRecordMagic &&
+           header->payloadOffset >= sizeof(capture::RecordHeader) &&
+           offset + header->payloadOffset + header->payloadBytes <= size_;
+  }
+
+  void loadIndex() {
+    FILE *index = std::fopen((path_ + ".idx").c_str(), "rb");
+    if (index) {
+      capture::IndexEntry entry;
+      while (std::fread(&entry, sizeof(entry), 1, index) == 1 && validRecord(entry.offset)) {
+        offsets_.push_back(entry.offset);
+      }
+      std::fclose(index);
+      if (!offsets_.empty()) {
+        return;
+      }
+    }
+    // No usable index: walk the records up to the first incomplete one
+    uint64_t offset = sizeof(capture::FileHeader);
+    while (validRecord(offset)) {
+      offsets_.push_back(offset);
+      const auto *header = reinterpret_cast<const capture::RecordHeader *>(map_ + offset);
+      offset += capture::align(header->payloadOffset + header->payloadBytes);
+    }
+  }
+
+public:
+  explicit CaptureReader(const std::string &path) : path_(path), map_(nullptr), size_(0) {
+    int fd = open(path_.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw error("Unable to open capture", path_);
+    }
+    struct stat status;
+    if (fstat(fd, &status) != 0 ||
+        status.st_size < static_cast<off_t>(sizeof(capture::FileHeader))) {
+      close(fd);
+      throw std::runtime_error("Capture " + path_ + " is empty");
+    }
+    size_ = static_cast<size_t>(status.st_size);
+    void *map = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+      throw error("Unable to map capture", path_);
+    }
+    map_ = static_cast<const uint8_t *>(map);
+    const auto *header = reinterpret_cast<const capture::FileHeader *>(map_);
+    if (std::memcmp(header->magic, capture::kMagic, sizeof(header->magic)) != 0 ||
+        header->version != capture::kVersion) {
+      munmap(const_cast<uint8_t *>(map_), size_);
+      throw std::runtime_error(path_ + " is not a capture file");
+    }
+    madvise(const_cast<uint8_t *>(map_), size_, MADV_SEQUENTIAL);
+    loadIndex();
+  }
+
+  ~CaptureReader() { munmap(const_cast<uint8_t *>(map_), size_); }
+
+  CaptureReader(const CaptureReader &) = delete;
+  CaptureReader &operator=(const CaptureReader &) = delete;
+
+  size_t size() const { return offsets_.size(); }
+
+  capture::Record record(size_t i) const {
+    const uint8_t *base = map_ + offsets_.at(i);
+    const auto *header = reinterpret_cast<const capture::RecordHeader *>(base);
+    const char *strings = reinterpret_cast<const char *>(base + sizeof(*header));
+    capture::Record record;
+    record.receivedNs = header->receivedNs;
+    record.validators.seriesId = header->seriesId;
+    record.validators.imageId = header->imageId;
+    record.validators.etag.assign(strings, header->etagBytes);
+    record.validators.lastModified.assign(strings + header->etagBytes,
+                                          header->lastModifiedBytes);
+    record.layout.format = static_cast<FrameFormat>(header->format);
+    record.layout.width = header->width;
+    record.layout.height = header->height;
+    record.layout.pixelSizeX = header->pixelSizeX;
+    record.layout.pixelSizeY = header->pixelSizeY;
+    record.metadata.bcX = header->bcX;
+    record.metadata.bcY = header->bcY;
+    record.metadata.dDistance = header->dDistance;
+    record.metadata.incidentEnergy = header->incidentEnergy;
+    record.metadata.incidentWavelength = header->incidentWavelength;
+    record.metadata.updated = std::chrono::steady_clock::now() -
+                              std::chrono::nanoseconds(header->metadataAgeNs);
+    record.payload = base + header->payloadOffset;
+    record.payloadBytes = header->payloadBytes;
+    return record;
+  }
+};
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef CAPTURE_REPLAYER_H
+#define CAPTURE_REPLAYER_H
+
+#include "CaptureFile.h"
+#include "FrameSink.h"
+#include "MetadataSource.h"
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+// Replayed frames carry the metadata they were captured with, so there is
+// no device to ask
+class RecordedMetadataSource : public MetadataSource {
+public:
+  FrameMetadata snapshot() override {
+    throw std::runtime_error("Replayed frame has no recorded metadata");
+  }
+};
+
+// Feeds the frames of a capture file to a sink as if they had just been
+// received, either at the pace they were captured or as fast as the sink
+// takes them. Frames are never dropped here: without a free buffer the
+// replay waits, like the monitor fetch does.
+class CaptureReplayer {
+private:
+  CaptureReader reader_;
+  FrameSink &sink_;
+  bool paced_;
+  std::atomic<bool> running_;
+
+  FrameHandle acquire() {
+    for (;;) {
+      FrameHandle frame = sink_.tryAcquireFrame();
+      if (frame || !running_) {
+        return frame;
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+  }
+
+public:
+  CaptureReplayer(const std::string &path, FrameSink &sink, bool paced)
+      : reader_(path), sink_(sink), paced_(paced), running_(false) {}
+
+  // Returns once every frame has been submitted or stop() was called
+  void run() {
+    running_ = true;
+    size_t frames = 0, bytes = 0;
+    auto start = std::chrono::steady_clock::now();
+    int64_t firstNs = reader_.size() ? reader_.record(0).receivedNs : 0;
+    for (size_t i = 0; i < reader_.size() && running_; ++i) {
+      capture::Record record = reader_.record(i);
+      if (paced_) {
+        std::this_thread::sleep_until(start + std::chrono::nanoseconds(record.receivedNs - firstNs));
+      }
+      FrameHandle frame = acquire();
+      if (!frame) {
+        break;
+      }
+      frame->resize(record.payloadBytes);
+      std::memcpy(frame->data(), record.payload, record.payloadBytes);
+      frame->validators = record.validators;
+      frame->layout = record.layout;
+      frame->metadata = record.metadata;
+      frame->hasMetadata = true;
+      sink_.submit(std::move(frame));
+      ++frames;
+      bytes += record.payloadBytes;
+    }
+    double seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Replayed " << frames << " of " << reader_.size() << " frames to "
+              << sink_.name() << " in " << seconds << " s (" << frames / seconds
+              << " frames/s, " << bytes / seconds / 1e6 << " MB/s)" << std::endl;
+  }
+
+  void stop() { running_ = false; }
+
+  size_t frames() const { return reader_.size(); }
+};
+
+#endif
@@ -0,0 +1,273 @@
+#ifndef CATCH_UP_FETCHER_H
+#define CATCH_UP_FETCHER_H
+
+#include "EigerMonitorClient.h"
+#include "FrameSink.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <curl/curl.h>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Drains the images buffered on the monitor interface instead of only the
+// latest one. The available ids are listed, then downloaded over up to
+// `connections` parallel transfers and delivered to the sink in order.
+class CatchUpFetcher {
+private:
+  typedef std::pair<int64_t, int64_t> ImageId;
+
+  struct Transfer {
+    size_t index = 0;
+    ImageId id;
+    CURL *handle = nullptr;
+    FrameHandle frame;
+  };
+
+  EigerMonitorClient &client_;
+  FrameSink &sink_;
+  size_t connections_;
+  int bufferSize_;
+  std::atomic<bool> running_;
+  CURLM *multi_;
+  std::vector<CURL *> idle_;
+  ImageId lastDelivered_;
+
+  // Throughput since the last report
+  size_t frames_;
+  size_t bytes_;
+  size_t backlog_;
+  std::chrono::steady_clock::time_point lastReport_;
+
+  static size_t writeCallback(void *contents, size_t size, size_t nmemb,
+                              FrameBuffer *frame) {
+    frame->append(contents, size * nmemb);
+    return size * nmemb;
+  }
+
+  // The image list is a JSON array of [series, image] pairs
+  static std::vector<ImageId> parseImageList(const std::string &json) {
+    std::vector<int64_t> numbers;
+    for (size_t i = 0; i < json.size();) {
+      if (std::isdigit(static_cast<unsigned char>(json[i]))) {
+        size_t end = i;
+        while (end < json.size() &&
+               std::isdigit(static_cast<unsigned char>(json[end]))) {
+          ++end;
+        }
+        numbers.push_back(std::stoll(json.substr(i, end - i)));
+        i = end;
+      } else {
+        ++i;
+      }
+    }
+    std::vector<ImageId> ids;
+    for (size_t i = 0; i + 1 < numbers.size(); i += 2) {
+      ids.emplace_back(numbers[i], numbers[i + 1]);
+    }
+    std::sort(ids.begin(), ids.end());
+    return ids;
+  }
+
+  bool startTransfer(Transfer &transfer) {
+    transfer.frame = sink_.tryAcquireFrame();
+    if (!transfer.frame) {
+      return false;
+    }
+    transfer.frame->validators.seriesId = transfer.id.first;
+    transfer.frame->validators.imageId = transfer.id.second;
+
+    transfer.handle = idle_.back();
+    idle_.pop_back();
+    std::string url = client_.monitorImagesUrl(
+        std::to_string(transfer.id.first) + "/" +
+        std::to_string(transfer.id.second));
+    curl_easy_setopt(transfer.handle, CURLOPT_URL, url.c_str());
+    // Same credentials as the client's own requests
+    const std::string &user = client_.user();
+    if (!user.empty()) {
+      curl_easy_setopt(transfer.handle, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
+      curl_easy_setopt(transfer.handle, CURLOPT_USERPWD, user.c_str());
+    }
+    curl_easy_setopt(transfer.handle, CURLOPT_WRITEFUNCTION, writeCallback);
+    curl_easy_setopt(transfer.handle, CURLOPT_WRITEDATA, transfer.frame.get());
+    curl_easy_setopt(transfer.handle, CURLOPT_PRIVATE, &transfer);
+    curl_multi_add_handle(multi_, transfer.handle);
+    return true;
+  }
+
+  // Downloads one batch of ids and hands them to the sink in order
+  void fetchBatch(const std::vector<ImageId> &ids) {
+    std::deque<Transfer> transfers(ids.size());
+    std::map<size_t, FrameHandle> completed;
+    size_t nextStart = 0;
+    size_t nextDeliver = 0;
+
+    while (running_ && nextDeliver < ids.size()) {
+      // Transfers start in id order, so the next frame to deliver always
+      // holds a buffer and the reorder buffer cannot starve it
+      while (nextStart < ids.size() && !idle_.empty()) {
+        Transfer &transfer = transfers[nextStart];
+        transfer.index = nextStart;
+        transfer.id = ids[nextStart];
+        if (!startTransfer(transfer)) {
+          break;
+        }
+        ++nextStart;
+      }
+
+      int stillRunning = 0;
+      curl_multi_perform(multi_, &stillRunning);
+      curl_multi_poll(multi_, nullptr, 0, 50, nullptr);
+      curl_multi_perform(multi_, &stillRunning);
+
+      CURLMsg *message;
+      int queued = 0;
+      while ((message = curl_multi_info_read(multi_, &queued))) {
+        if (message->msg != CURLMSG_DONE) {
+          continue;
+        }
+        Transfer *transfer = nullptr;
+        curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, &transfer);
+        long status = 0;
+        curl_easy_getinfo(message->easy_handle, CURLINFO_RESPONSE_CODE,
+                          &status);
+        curl_multi_remove_handle(multi_, transfer->handle);
+        idle_.push_back(transfer->handle);
+        transfer->handle = nullptr;
+
+        if (message->data.result != CURLE_OK || status >= 400) {
+          // The image left the monitor buffer; deliver an empty slot
+          transfer->frame.reset();
+        }
+        completed[transfer->index] = std::move(transfer->frame);
+      }
+
+      while (!completed.empty() && completed.begin()->first == nextDeliver) {
+        FrameHandle frame = std::move(completed.begin()->second);
+        completed.erase(completed.begin());
+        if (frame && !frame->empty()) {
+          ++frames_;
+          bytes_ += frame->size();
+          sink_.submit(std::move(frame));
+        }
+        lastDelivered_ = ids[nextDeliver];
+        ++nextDeliver;
+      }
+    }
+
+    // Abandon transfers still running when stopped
+    for (Transfer &transfer : transfers) {
+      if (transfer.handle) {
+        curl_multi_remove_handle(multi_, transfer.handle);
+        idle_.push_back(transfer.handle);
+        transfer.handle = nullptr;
+      }
+    }
+  }
+
+  void report() {
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - lastReport_).count();
+    if (seconds < 10.0) {
+      return;
+    }
+    std::cout << "Catch-up " << sink_.name() << ": " << frames_ / seconds
+              << " frames/s, " << bytes_ / seconds / 1e6 << " MB/s, backlog "
+              << backlog_ << " images" << std::endl;
+    frames_ = 0;
+    bytes_ = 0;
+    lastReport_ = now;
+  }
+
+public:
+  CatchUpFetcher(EigerMonitorClient &client, FrameSink &sink,
+                 size_t connections = 4, int bufferSize = 64)
+      : client_(client), sink_(sink),
+        connections_(std::max<size_t>(connections, 1)), bufferSize_(bufferSize),
+        running_(false), multi_(curl_multi_init()), lastDelivered_(-1, -1),
+        frames_(0), bytes_(0), backlog_(0) {
+    if (!multi_) {
+      throw std::runtime_error("Failed to initialize CURL multi handle");
+    }
+    curl_multi_setopt(multi_, CURLMOPT_MAX_HOST_CONNECTIONS,
+                      static_cast<long>(connections_));
+    for (size_t i = 0; i < connections_; ++i) {
+      CURL *handle = curl_easy_init();
+      if (!handle) {
+        throw std::runtime_error("Failed to initialize CURL");
+      }
+      curl_easy_setopt(handle, CURLOPT_TCP_NODELAY, 1L);
+      curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+      curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, 10000L);
+      idle_.push_back(handle);
+    }
+  }
+
+  ~CatchUpFetcher() {
+    for (CURL *handle : idle_) {
+      curl_easy_cleanup(handle);
+    }
+    curl_multi_cleanup(multi_);
+  }
+
+  void run() {
+    running_ = true;
+    lastReport_ = std::chrono::steady_clock::now();
+    // The monitor only keeps this many images for us to catch up on. Listing
+    // and fetching what it has already buffered need not wait for that.
+    std::string name = sink_.name();
+    std::string url = client_.monitorConfigUrl("buffer_size");
+    client_.requestAsync(
+        url, "PUT", "application/json; charset=utf-8",
+        "{\"value\": " + std::to_string(bufferSize_) + "}",
+        [name, url](const CommandResponse &response) {
+          try {
+            response.value(url);
+          } catch (const std::exception &e) {
+            std::cerr << "Unable to set monitor buffer size on " << name
+                      << ": " << e.what() << std::endl;
+          }
+        });
+
+    while (running_) {
+      std::vector<ImageId> ids;
+      try {
+        ids = parseImageList(client_.monitorImages());
+      } catch (const std::exception &e) {
+        std::cerr << "Monitor " << sink_.name() << " error: " << e.what()
+                  << std::endl;
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        continue;
+      }
+
+      // A restarted detector numbers its series from the beginning again
+      if (!ids.empty() && ids.back() < lastDelivered_) {
+        lastDelivered_ = ImageId(-1, -1);
+      }
+      ids.erase(std::remove_if(ids.begin(), ids.end(),
+                               [this](const ImageId &id) {
+                                 return id <= lastDelivered_;
+                               }),
+                ids.end());
+      backlog_ = ids.size();
+      if (ids.empty()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      } else {
+        fetchBatch(ids);
+      }
+      report();
+    }
+  }
+
+  void stop() { running_ = false; }
+};
+
+#endif
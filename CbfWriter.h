@@ -0,0 +1,170 @@
+#ifndef CBF_WRITER_H
+#define CBF_WRITER_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Fields of the Pilatus style miniCBF header
+struct CbfHeader {
+  uint32_t width = 0;
+  uint32_t height = 0;
+  double pixelSizeX = 0.0;
+  double pixelSizeY = 0.0;
+  double beamCenterX = 0.0;
+  double beamCenterY = 0.0;
+  double distance = 0.0;
+  double wavelength = 0.0;
+};
+
+namespace cbf {
+
+// Appends the CBF byte offset encoding of the pixels, read as signed 32-bit
+// integers so gap pixels become -1. Each value is stored as the difference
+// to the previous one in 1, 2, 4 or 8 bytes, escaped by 0x80, 0x8000 and
+// 0x80000000.
+inline void byteOffsetEncode(const uint32_t *pixels, size_t count,
+                             std::vector<uint8_t> &out) {
+  out.reserve(out.size() + count + count / 8 + 16);
+  int64_t previous = 0;
+  size_t i = 0;
+  auto put = [&out](uint64_t value, int bytes) {
+    for (int b = 0; b < bytes; ++b) {
+      out.push_back(static_cast<uint8_t>(value >> (8 * b)));
+    }
+  };
+  while (i < count) {
+#ifdef __SSE2__
+    // Runs of 16 deltas within +-127, the bulk of a monitor frame, are
+    // packed to bytes at once
+    if (i > 0 && i + 16 <= count) {
+      const __m128i *p = reinterpret_cast<const __m128i *>(pixels + i);
+      const __m128i *q = reinterpret_cast<const __m128i *>(pixels + i - 1);
+      __m128i d0 = _mm_sub_epi32(_mm_loadu_si128(p + 0), _mm_loadu_si128(q + 0));
+      __m128i d1 = _mm_sub_epi32(_mm_loadu_si128(p + 1), _mm_loadu_si128(q + 1));
+      __m128i d2 = _mm_sub_epi32(_mm_loadu_si128(p + 2), _mm_loadu_si128(q + 2));
+      __m128i d3 = _mm_sub_epi32(_mm_loadu_si128(p + 3), _mm_loadu_si128(q + 3));
+      __m128i bytes = _mm_packs_epi16(_mm_packs_epi32(d0, d1),
+                                      _mm_packs_epi32(d2, d3));
+      // Saturation turns deltas below -127 into the escape byte -128;
+      // deltas above 127 are caught on the words. Deltas wrap at 32 bits
+      // like the signed 32-bit elements they decode into.
+      __m128i limit = _mm_set1_epi32(127);
+      __m128i high = _mm_packs_epi16(
+          _mm_packs_epi32(_mm_cmpgt_epi32(d0, limit), _mm_cmpgt_epi32(d1, limit)),
+          _mm_packs_epi32(_mm_cmpgt_epi32(d2, limit), _mm_cmpgt_epi32(d3, limit)));
+      __m128i low = _mm_cmpeq_epi8(bytes, _mm_set1_epi8(-128));
+      if (_mm_movemask_epi8(_mm_or_si128(low, high)) == 0) {
+        size_t size = out.size();
+        out.resize(size + 16);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out.data() + size), bytes);
+        previous = static_cast<int32_t>(pixels[i + 15]);
+        i += 16;
+        continue;
+      }
+    }
+#endif
+    int64_t value = static_cast<int32_t>(pixels[i]);
+    int64_t delta = value - previous;
+    if (delta > -128 && delta < 128) {
+      put(static_cast<uint64_t>(delta), 1);
+    } else {
+      put(0x80, 1);
+      if (delta > -32768 && delta < 32768) {
+        put(static_cast<uint64_t>(delta), 2);
+      } else {
+        put(0x8000, 2);
+        if (delta > INT32_MIN && delta <= INT32_MAX) {
+          put(static_cast<uint64_t>(delta), 4);
+        } else {
+          put(0x80000000u, 4);
+          put(static_cast<uint64_t>(delta), 8);
+        }
+      }
+    }
+    previous = value;
+    ++i;
+  }
+}
+
+} // namespace cbf
+
+// Writes frames as miniCBF files with byte offset compression, readable by
+// CBFlib based programs such as XDS, DIALS and ADXV
+class CbfWriter {
+private:
+  std::vector<uint8_t> data_;
+
+  static std::runtime_error error(const std::string &what,
+                                  const std::string &path) {
+    return std::runtime_error(what + " " + path + ": " + std::strerror(errno));
+  }
+
+public:
+  // Writes to path + ".tmp" first, so readers never see a partial file
+  void write(const std::string &path, const CbfHeader &header,
+             const uint32_t *pixels) {
+    size_t count = static_cast<size_t>(header.width) * header.height;
+    data_.clear();
+    cbf::byteOffsetEncode(pixels, count, data_);
+
+    char contents[512];
+    std::snprintf(contents, sizeof(contents),
+                  "# Pixel_size %g m x %g m\r\n"
+                  "# Wavelength %.6f A\r\n"
+                  "# Detector_distance %.6f m\r\n"
+                  "# Beam_xy (%.2f, %.2f) pixels\r\n",
+                  header.pixelSizeX / 1000, header.pixelSizeY / 1000,
+                  header.wavelength, header.distance / 1000,
+                  header.beamCenterX, header.beamCenterY);
+    std::string text =
+        "###CBF: VERSION 1.5\r\n\r\ndata_monitor\r\n\r\n"
+        "_array_data.header_convention \"PILATUS_1.2\"\r\n"
+        "_array_data.header_contents\r\n;\r\n" +
+        std::string(contents) +
+        ";\r\n\r\n_array_data.data\r\n;\r\n--CIF-BINARY-FORMAT-SECTION--\r\n"
+        "Content-Type: application/octet-stream;\r\n"
+        "     conversions=\"x-CBF_BYTE_OFFSET\"\r\n"
+        "Content-Transfer-Encoding: BINARY\r\n"
+        "X-Binary-Size: " + std::to_string(data_.size()) + "\r\n"
+        "X-Binary-ID: 1\r\n"
+        "X-Binary-Element-Type: \"signed 32-bit integer\"\r\n"
+        "X-Binary-Element-Byte-Order: LITTLE_ENDIAN\r\n"
+        "X-Binary-Number-of-Elements: " + std::to_string(count) + "\r\n"
+        "X-Binary-Size-Fastest-Dimension: " + std::to_string(header.width) + "\r\n"
+        "X-Binary-Size-Second-Dimension: " + std::to_string(header.height) + "\r\n"
+        "X-Binary-Size-Padding: 4095\r\n\r\n"
+        "\x0c\x1a\x04\xd5";
+    static const char kTrailer[] = "\r\n--CIF-BINARY-FORMAT-SECTION----\r\n;\r\n\r\n";
+    std::vector<uint8_t> padding(4095, 0);
+
+    std::string temporary = path + ".tmp";
+    FILE *file = std::fopen(temporary.c_str(), "wb");
+    if (!file) {
+      throw error("Unable to open", temporary);
+    }
+    bool ok = std::fwrite(text.data(), 1, text.size(), file) == text.size() &&
+              std::fwrite(data_.data(), 1, data_.size(), file) == data_.size() &&
+              std::fwrite(padding.data(), 1, padding.size(), file) == padding.size() &&
+              std::fwrite(kTrailer, 1, sizeof(kTrailer) - 1, file) == sizeof(kTrailer) - 1;
+    if (std::fclose(file) != 0 || !ok) {
+      throw error("Unable to write", temporary);
+    }
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+      throw error("Unable to rename", temporary);
+    }
+  }
+
+  // Size of the compressed pixels of the last file
+  size_t compressedBytes() const { return data_.size(); }
+};
+
+#endif
@@ -0,0 +1,279 @@
+#ifndef COMMAND_CHANNEL_H
+#define COMMAND_CHANNEL_H
+
+#include <atomic>
+#include <curl/curl.h>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A control request to the detector's API, e.g. a config PUT or status GET
+struct CommandRequest {
+  std::string method = "GET";
+  std::string url;
+  // Sent as Content-Type with a body and as Accept-Encoding for a GET
+  std::string mimeType;
+  std::string body;
+  std::string user;
+};
+
+struct CommandResponse {
+  CURLcode result = CURLE_OK;
+  long status = 0;
+  std::string body;
+
+  bool ok() const { return result == CURLE_OK && status < 400; }
+
+  // Throws the error the blocking client calls used to report
+  const std::string &value(const std::string &url) const {
+    if (result != CURLE_OK) {
+      throw std::runtime_error("Failed to connect to host: " +
+                               std::string(curl_easy_strerror(result)));
+    }
+    if (status >= 400) {
+      throw std::runtime_error("HTTP " + std::to_string(status) + " for " +
+                               url);
+    }
+    return body;
+  }
+};
+
+// Runs control requests on a thread of its own through curl_multi, so they
+// never wait behind a frame transfer or make one wait. A few easy handles
+// are reused to keep their connections warm; each is reset before every
+// request, so no method or body is left over for the next one. Requests
+// beyond the pool size queue until a handle is free.
+class CommandChannel {
+public:
+  typedef std::function<void(const CommandResponse &)> Callback;
+
+private:
+  struct Command {
+    CommandRequest request;
+    Callback done;
+    CommandResponse response;
+    curl_slist *headers = nullptr;
+    CURL *handle = nullptr;
+  };
+
+  CURLM *multi_;
+  size_t maxHandles_;
+  long timeoutMs_;
+  std::vector<CURL *> idle_;
+  size_t handles_;
+  std::mutex mutex_;
+  std::deque<std::unique_ptr<Command>> pending_;
+  std::vector<std::unique_ptr<Command>> active_;
+  std::atomic<bool> running_;
+  std::thread thread_;
+
+  static size_t writeCallback(void *contents, size_t size, size_t nmemb,
+                              std::string *output) {
+    output->append(static_cast<char *>(contents), size * nmemb);
+    return size * nmemb;
+  }
+
+  CURL *takeHandle() {
+    if (!idle_.empty()) {
+      CURL *handle = idle_.back();
+      idle_.pop_back();
+      curl_easy_reset(handle);
+      return handle;
+    }
+    if (handles_ == maxHandles_) {
+      return nullptr;
+    }
+    CURL *handle = curl_easy_init();
+    if (handle) {
+      ++handles_;
+    }
+    return handle;
+  }
+
+  // Every option is set from scratch, the handle was reset
+  void configure(Command &command) {
+    CURL *handle = command.handle;
+    const CommandRequest &request = command.request;
+    curl_easy_setopt(handle, CURLOPT_PRIVATE, &command);
+    curl_easy_setopt(handle, CURLOPT_URL, request.url.c_str());
+    curl_easy_setopt(handle, CURLOPT_TCP_NODELAY, 1L);
+    curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, timeoutMs_);
+    curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+    if (!request.user.empty()) {
+      curl_easy_setopt(handle, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
+      curl_easy_setopt(handle, CURLOPT_USERPWD, request.user.c_str());
+    }
+    if (request.method == "GET") {
+      if (!request.mimeType.empty()) {
+        curl_easy_setopt(handle, CURLOPT_ACCEPT_ENCODING,
+                         request.mimeType.c_str());
+      }
+    } else {
+      curl_easy_setopt(handle, CURLOPT_CUSTOMREQUEST, request.method.c_str());
+    }
+    if (request.method == "PUT") {
+      curl_easy_setopt(handle, CURLOPT_POSTFIELDS, request.body.data());
+      curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE,
+                       static_cast<long>(request.body.size()));
+    }
+    if (!request.mimeType.empty() && request.method != "GET") {
+      std::string contentType = "Content-Type: " + request.mimeType;
+      command.headers = curl_slist_append(nullptr, contentType.c_str());
+      curl_easy_setopt(handle, CURLOPT_HTTPHEADER, command.headers);
+    }
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, writeCallback);
+    curl_easy_setopt(handle, CURLOPT_WRITEDATA, &command.response.body);
+  }
+
+  // Moves queued commands onto free handles
+  void startPending() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    while (!pending_.empty()) {
+      CURL *handle = takeHandle();
+      if (!handle) {
+        return;
+      }
+      std::unique_ptr<Command> command = std::move(pending_.front());
+      pending_.pop_front();
+      command->handle = handle;
+      configure(*command);
+      curl_multi_add_handle(multi_, handle);
+      active_.push_back(std::move(command));
+    }
+  }
+
+  void finish(Command *command, CURLcode result) {
+    command->response.result = result;
+    curl_easy_getinfo(command->handle, CURLINFO_RESPONSE_CODE,
+                      &command->response.status);
+    curl_multi_remove_handle(multi_, command->handle);
+    curl_slist_free_all(command->headers);
+    std::unique_ptr<Command> done;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      idle_.push_back(command->handle);
+      for (auto it = active_.begin(); it != active_.end(); ++it) {
+        if (it->get() == command) {
+          done = std::move(*it);
+          active_.erase(it);
+          break;
+        }
+      }
+    }
+    if (done && done->done) {
+      done->done(done->response);
+    }
+  }
+
+  void run() {
+    while (running_) {
+      startPending();
+      int stillRunning = 0;
+      curl_multi_perform(multi_, &stillRunning);
+      curl_multi_poll(multi_, nullptr, 0, 1000, nullptr);
+      curl_multi_perform(multi_, &stillRunning);
+
+      CURLMsg *message;
+      int queued = 0;
+      while ((message = curl_multi_info_read(multi_, &queued))) {
+        if (message->msg != CURLMSG_DONE) {
+          continue;
+        }
+        Command *command = nullptr;
+        curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, &command);
+        if (command) {
+          finish(command, message->data.result);
+        }
+      }
+    }
+  }
+
+  // Completes what is still queued or in flight when the channel closes
+  void abandon() {
+    std::vector<std::unique_ptr<Command>> left;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto &command : active_) {
+        curl_multi_remove_handle(multi_, command->handle);
+        curl_slist_free_all(command->headers);
+        idle_.push_back(command->handle);
+        left.push_back(std::move(command));
+      }
+      for (auto &command : pending_) {
+        left.push_back(std::move(command));
+      }
+      active_.clear();
+      pending_.clear();
+    }
+    for (auto &command : left) {
+      command->response.result = CURLE_ABORTED_BY_CALLBACK;
+      if (command->done) {
+        command->done(command->response);
+      }
+    }
+  }
+
+public:
+  explicit CommandChannel(size_t maxHandles = 2, long timeoutMs = 10000)
+      : multi_(curl_multi_init()), maxHandles_(maxHandles ? maxHandles : 1),
+        timeoutMs_(timeoutMs), handles_(0), running_(false) {
+    if (!multi_) {
+      throw std::runtime_error("Failed to initialize CURL multi handle");
+    }
+    curl_multi_setopt(multi_, CURLMOPT_MAXCONNECTS,
+                      static_cast<long>(maxHandles_));
+  }
+
+  ~CommandChannel() {
+    running_ = false;
+    curl_multi_wakeup(multi_);
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+    abandon();
+    for (CURL *handle : idle_) {
+      curl_easy_cleanup(handle);
+    }
+    curl_multi_cleanup(multi_);
+  }
+
+  CommandChannel(const CommandChannel &) = delete;
+  CommandChannel &operator=(const CommandChannel &) = delete;
+
+  // Calls done on the channel thread when the request completes, so it
+  // should only hand the response on
+  void submit(CommandRequest request, Callback done) {
+    std::unique_ptr<Command> command(new Command());
+    command->request = std::move(request);
+    command->done = std::move(done);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_.push_back(std::move(command));
+      // The thread starts with the first request
+      if (!thread_.joinable()) {
+        running_ = true;
+        thread_ = std::thread(&CommandChannel::run, this);
+      }
+    }
+    curl_multi_wakeup(multi_);
+  }
+
+  std::future<CommandResponse> submit(CommandRequest request) {
+    std::shared_ptr<std::promise<CommandResponse>> promise(
+        new std::promise<CommandResponse>());
+    std::future<CommandResponse> response = promise->get_future();
+    submit(std::move(request), [promise](const CommandResponse &done) {
+      promise->set_value(done);
+    });
+    return response;
+  }
+};
+
+#endif
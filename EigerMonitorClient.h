@@ -1,7 +1,16 @@
 #ifndef EIGER_MONITOR_CLIENT_H
 #define EIGER_MONITOR_CLIENT_H
 
+#include "CommandChannel.h"
+#include "FrameBufferPool.h"
+#include "Stats.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <curl/curl.h>
+#include <future>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
@@ -9,6 +18,12 @@
 #include <tuple>
 #include <vector>
 
+// Thrown when a request got no response within its wait timeout
+class RequestTimeout : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
+
 class EigerMonitorClient {
 private:
   std::string host_;
@@ -17,24 +32,84 @@ private:
   bool verbose_;
   std::string urlPrefix_;
   std::string user_;
+  // Only carries frame transfers; everything else goes through commands_
   CURL *connection_;
+  CommandChannel commands_;
+  LatencyHistogram *waitTime_;
+  LatencyHistogram *bodyTime_;
 
-  static size_t WriteCallback(void *contents, size_t size, size_t nmemb,
-                              std::string *output) {
-    output->append((char *)contents, size * nmemb);
+  static size_t StringWriteCallback(void *contents, size_t size, size_t nmemb,
+                                    std::string *output) {
+    output->append(static_cast<char *>(contents), size * nmemb);
     return size * nmemb;
   }
 
+  static size_t FrameWriteCallback(void *contents, size_t size, size_t nmemb,
+                                   FrameBuffer *frame) {
+    frame->append(contents, size * nmemb);
+    return size * nmemb;
+  }
+
+  // Returns the trimmed value if the header line is the named header
+  static bool headerValue(const char *buffer, size_t length, const char *name,
+                          std::string &value) {
+    size_t nameLength = std::strlen(name);
+    if (length <= nameLength || buffer[nameLength] != ':') {
+      return false;
+    }
+    for (size_t i = 0; i < nameLength; ++i) {
+      if (std::tolower(static_cast<unsigned char>(buffer[i])) != name[i]) {
+        return false;
+      }
+    }
+    size_t begin = nameLength + 1;
+    size_t end = length;
+    while (begin < end && std::isspace(static_cast<unsigned char>(buffer[begin]))) {
+      ++begin;
+    }
+    while (end > begin && std::isspace(static_cast<unsigned char>(buffer[end - 1]))) {
+      --end;
+    }
+    value.assign(buffer + begin, end - begin);
+    return true;
+  }
+
+  // Sizes the frame buffer from Content-Length before the body arrives and
+  // keeps the validators used for change detection
+  static size_t FrameHeaderCallback(char *buffer, size_t size, size_t nitems,
+                                    FrameBuffer *frame) {
+    size_t length = size * nitems;
+    std::string value;
+    if (headerValue(buffer, length, "content-length", value)) {
+      try {
+        frame->reserve(std::stoull(value));
+      } catch (const std::exception &) {
+        // Ignore malformed lengths, the buffer grows as data arrives
+      }
+    } else if (headerValue(buffer, length, "etag", value)) {
+      frame->validators.etag = value;
+    } else if (headerValue(buffer, length, "last-modified", value)) {
+      frame->validators.lastModified = value;
+    }
+    return length;
+  }
+
 public:
   EigerMonitorClient(const std::string &host = "127.0.0.1", int port = 80,
                      bool verbose = false, const std::string &urlPrefix = "",
                      const std::string &user = "")
       : host_(host), port_(port), version_("1.8.0"), verbose_(verbose),
-        urlPrefix_(urlPrefix), user_(user), connection_(nullptr) {
+        urlPrefix_(urlPrefix), user_(user), connection_(nullptr),
+        waitTime_(nullptr), bodyTime_(nullptr) {
     connection_ = curl_easy_init();
     if (!connection_) {
       throw std::runtime_error("Failed to initialize CURL");
     }
+    // The handle is reused for every poll, keep its connection warm
+    curl_easy_setopt(connection_, CURLOPT_TCP_NODELAY, 1L);
+    curl_easy_setopt(connection_, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(connection_, CURLOPT_TCP_KEEPIDLE, 10L);
+    curl_easy_setopt(connection_, CURLOPT_TCP_KEEPINTVL, 5L);
   }
 
   ~EigerMonitorClient() {
@@ -47,6 +122,31 @@ public:
 
   void setUser(const std::string &user) { user_ = user; }
 
+  // Bounds the wait for a frame transfer to start by waitMs, as a stall of
+  // at least that long (in whole seconds, curl's granularity), and the
+  // whole transfer by transferMs, so a large frame on a slow link is not
+  // cut off by the long poll timeout
+  void setTimeouts(long waitMs, long transferMs) {
+    curl_easy_setopt(connection_, CURLOPT_CONNECTTIMEOUT_MS, waitMs);
+    curl_easy_setopt(connection_, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(connection_, CURLOPT_LOW_SPEED_TIME,
+                     std::max(1L, (waitMs + 999) / 1000));
+    curl_easy_setopt(connection_, CURLOPT_TIMEOUT_MS, transferMs);
+  }
+
+  // Frame transfers record the time to the first byte and the time spent
+  // receiving the body
+  void setTransferHistograms(LatencyHistogram *waitTime,
+                             LatencyHistogram *bodyTime) {
+    waitTime_ = waitTime;
+    bodyTime_ = bodyTime;
+  }
+
+  const std::string &host() const { return host_; }
+  int port() const { return port_; }
+  // user:password for basic authentication, empty without
+  const std::string &user() const { return user_; }
+
   std::string _url(const std::string &module, const std::string &task,
                    const std::string &parameter = "") {
     std::string url =
@@ -69,17 +169,57 @@ public:
     return url.str();
   }
 
+  static std::string acceptType(const std::string &dataType) {
+    if (dataType == "native") {
+      return "application/json; charset=utf-8";
+    } else if (dataType == "tif") {
+      return "application/tiff";
+    } else if (dataType == "hdf5") {
+      return "application/hdf5";
+    }
+    return "";
+  }
+
+  // Sends a control request without waiting for it. The image fetch keeps
+  // its own handle, so commands neither delay frames nor wait for them.
+  std::future<CommandResponse> requestAsync(const std::string &url,
+                                            const std::string &method,
+                                            const std::string &mimeType,
+                                            const std::string &data = "") {
+    return commands_.submit(command(url, method, mimeType, data));
+  }
+
+  // As above, calling done on the command thread once the response is in
+  void requestAsync(const std::string &url, const std::string &method,
+                    const std::string &mimeType, const std::string &data,
+                    CommandChannel::Callback done) {
+    commands_.submit(command(url, method, mimeType, data), std::move(done));
+  }
+
+  CommandRequest command(const std::string &url, const std::string &method,
+                         const std::string &mimeType,
+                         const std::string &data) const {
+    CommandRequest request;
+    request.method = method;
+    request.url = url;
+    request.mimeType = mimeType;
+    request.body = data;
+    request.user = user_;
+    return request;
+  }
+
   std::string _getRequest(const std::string &url,
-                          const std::string &dataType = "native",
-                          FILE *fileId = nullptr) {
-    std::string response;
-    CURLcode res;
+                          const std::string &dataType = "native") {
+    return requestAsync(url, "GET", acceptType(dataType)).get().value(url);
+  }
 
+  // Sets up the handle to receive a frame without performing the transfer,
+  // so it can also be driven by a curl_multi loop
+  CURL *prepareFrameRequest(const std::string &url, const std::string &dataType,
+                            FrameBuffer &frame) {
+    frame.clear();
     curl_easy_setopt(connection_, CURLOPT_URL, url.c_str());
-    if (dataType == "native") {
-      curl_easy_setopt(connection_, CURLOPT_ACCEPT_ENCODING,
-                       "application/json; charset=utf-8");
-    } else if (dataType == "tif") {
+    if (dataType == "tif") {
       curl_easy_setopt(connection_, CURLOPT_ACCEPT_ENCODING,
                        "application/tiff");
     } else if (dataType == "hdf5") {
@@ -90,50 +230,110 @@ public:
       curl_easy_setopt(connection_, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
       curl_easy_setopt(connection_, CURLOPT_USERPWD, user_.c_str());
     }
-    curl_easy_setopt(connection_, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(connection_, CURLOPT_WRITEFUNCTION, FrameWriteCallback);
+    curl_easy_setopt(connection_, CURLOPT_WRITEDATA, &frame);
+    curl_easy_setopt(connection_, CURLOPT_HEADERFUNCTION, FrameHeaderCallback);
+    curl_easy_setopt(connection_, CURLOPT_HEADERDATA, &frame);
+    return connection_;
+  }
+
+  // Opens the frame connection before the first poll, so the first frame
+  // does not also wait for name lookup and connect, and returns the detector
+  // size in pixels from its config, 0 x 0 where it is not reported
+  std::pair<uint32_t, uint32_t> preconnect(long timeoutMs = 2000) {
+    const char *parameters[2] = {"x_pixels_in_detector", "y_pixels_in_detector"};
+    uint32_t pixels[2] = {0, 0};
+    std::string response;
+    curl_easy_setopt(connection_, CURLOPT_TIMEOUT_MS, timeoutMs);
+    if (!user_.empty()) {
+      curl_easy_setopt(connection_, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
+      curl_easy_setopt(connection_, CURLOPT_USERPWD, user_.c_str());
+    }
+    curl_easy_setopt(connection_, CURLOPT_WRITEFUNCTION, StringWriteCallback);
     curl_easy_setopt(connection_, CURLOPT_WRITEDATA, &response);
-    res = curl_easy_perform(connection_);
+    CURLcode res = CURLE_OK;
+    for (int i = 0; i < 2 && res == CURLE_OK; ++i) {
+      response.clear();
+      std::string url = getUrl("detector", "config", parameters[i]);
+      curl_easy_setopt(connection_, CURLOPT_URL, url.c_str());
+      res = curl_easy_perform(connection_);
+      long status = 0;
+      curl_easy_getinfo(connection_, CURLINFO_RESPONSE_CODE, &status);
+      if (res == CURLE_OK && status == 200) {
+        pixels[i] = static_cast<uint32_t>(_jsonNumber(response));
+      }
+    }
+    curl_easy_setopt(connection_, CURLOPT_WRITEFUNCTION, nullptr);
+    curl_easy_setopt(connection_, CURLOPT_WRITEDATA, nullptr);
     if (res != CURLE_OK) {
       throw std::runtime_error("Failed to connect to host: " +
                                std::string(curl_easy_strerror(res)));
     }
-    return response;
+    return std::make_pair(pixels[0], pixels[1]);
   }
 
-  std::string _putRequest(const std::string &url, const std::string &dataType,
-                          const std::string &data = "") {
+  // Detaches the frame buffer from the handle after a transfer
+  void finishFrameRequest() {
+    long status = 0;
+    curl_easy_getinfo(connection_, CURLINFO_RESPONSE_CODE, &status);
+    if (status == 200 && waitTime_ && bodyTime_) {
+      curl_off_t firstByteUs = 0, totalUs = 0;
+      curl_easy_getinfo(connection_, CURLINFO_STARTTRANSFER_TIME_T, &firstByteUs);
+      curl_easy_getinfo(connection_, CURLINFO_TOTAL_TIME_T, &totalUs);
+      waitTime_->record(static_cast<uint64_t>(firstByteUs) * 1000);
+      bodyTime_->record(static_cast<uint64_t>(totalUs - firstByteUs) * 1000);
+    }
+    curl_easy_setopt(connection_, CURLOPT_HEADERFUNCTION, nullptr);
+    curl_easy_setopt(connection_, CURLOPT_HEADERDATA, nullptr);
+    curl_easy_setopt(connection_, CURLOPT_WRITEFUNCTION, nullptr);
+    curl_easy_setopt(connection_, CURLOPT_WRITEDATA, nullptr);
+  }
+
+  // Receives the response body directly into a pooled frame buffer
+  void _getRequest(const std::string &url, const std::string &dataType,
+                   FrameBuffer &frame) {
+    prepareFrameRequest(url, dataType, frame);
+    CURLcode res = curl_easy_perform(connection_);
+    finishFrameRequest();
+    long status = 0;
+    curl_easy_getinfo(connection_, CURLINFO_RESPONSE_CODE, &status);
+    // A transfer that stalls once the body has started is an error
+    if ((res == CURLE_OPERATION_TIMEDOUT && frame.empty()) || status == 408) {
+      frame.clear();
+      throw RequestTimeout("Request timed out: " + url);
+    }
+    if (res != CURLE_OK) {
+      throw std::runtime_error("Failed to connect to host: " +
+                               std::string(curl_easy_strerror(res)));
+    }
+    if (status >= 400) {
+      frame.clear();
+      throw std::runtime_error("HTTP " + std::to_string(status) + " for " +
+                               url);
+    }
+  }
+
+  std::future<CommandResponse> _putRequestAsync(const std::string &url,
+                                                const std::string &dataType,
+                                                const std::string &data = "") {
     std::string preparedData;
     std::string mimeType;
 
     std::tie(preparedData, mimeType) = _prepareData(data, dataType);
     std::cout << url << std::endl;
 
-    return _request(url, "PUT", mimeType, preparedData);
+    return requestAsync(url, "PUT", mimeType, preparedData);
+  }
+
+  std::string _putRequest(const std::string &url, const std::string &dataType,
+                          const std::string &data = "") {
+    return _putRequestAsync(url, dataType, data).get().value(url);
   }
 
   std::string _request(const std::string &url, const std::string &method,
                        const std::string &mimeType,
                        const std::string &data = "") {
-    std::string response;
-    CURLcode res;
-    curl_easy_setopt(connection_, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(connection_, CURLOPT_CUSTOMREQUEST, method.c_str());
-    if (method == "GET") {
-      curl_easy_setopt(connection_, CURLOPT_ACCEPT_ENCODING, mimeType.c_str());
-    } else if (method == "PUT") {
-      curl_easy_setopt(connection_, CURLOPT_POSTFIELDS, data.c_str());
-      curl_easy_setopt(connection_, CURLOPT_POSTFIELDSIZE, data.size());
-    }
-    curl_easy_setopt(connection_, CURLOPT_WRITEFUNCTION, WriteCallback);
-    curl_easy_setopt(connection_, CURLOPT_WRITEDATA, &response);
-    curl_easy_setopt(connection_, CURLOPT_HTTPHEADER,
-                     "Content-Type: " + mimeType);
-    res = curl_easy_perform(connection_);
-    if (res != CURLE_OK) {
-      throw std::runtime_error("Failed to connect to host: " +
-                               std::string(curl_easy_strerror(res)));
-    }
-    return response;
+    return requestAsync(url, method, mimeType, data).get().value(url);
   }
 
   std::pair<std::string, std::string>
@@ -176,7 +376,7 @@ public:
     return "";
   }
 
-  std::string monitorImages(const std::string &param = "") {
+  std::string monitorImagesUrl(const std::string &param = "") {
     std::string url;
     if (param.empty()) {
       url = _url("monitor", "images");
@@ -202,36 +402,94 @@ public:
       }
     }
 
+    return "http://" + host_ + ":" + std::to_string(port_) + url;
+  }
+
+  std::string monitorImages(const std::string &param = "") {
     // Make HTTP request based on constructed URL
-    url = "http://" + host_ + ":" + std::to_string(port_) + url;
-    return _getRequest(url, "tif");
+    return _getRequest(monitorImagesUrl(param), "tif");
+  }
+
+  void monitorImages(const std::string &param, FrameBuffer &frame) {
+    _getRequest(monitorImagesUrl(param), "tif", frame);
+  }
+
+  std::string monitorConfigUrl(const std::string &param) const {
+    return "http://" + host_ + ":" + std::to_string(port_) +
+           "/monitor/api/1.8.0/config/" + param;
+  }
+
+  std::string streamConfigUrl(const std::string &param) const {
+    return "http://" + host_ + ":" + std::to_string(port_) + "/stream/api/" +
+           version_ + "/config/" + param;
+  }
+
+  std::future<CommandResponse> setMonitorConfigAsync(const std::string &param,
+                                                     const std::string &value) {
+    std::string configUrl = monitorConfigUrl(param);
+    std::cout << "Setting monitor config on " << configUrl << std::endl;
+    return _putRequestAsync(configUrl, "native", value);
   }
 
   std::string setMonitorConfig(const std::string &param,
                                const std::string &value) {
-    // Construct the full URL with parameter and value
-    std::string configUrl = "http://" + host_ + ":" + std::to_string(port_) +
-                            "/monitor/api/1.8.0/config/" + param;
+    return setMonitorConfigAsync(param, value).get().value(monitorConfigUrl(param));
+  }
 
-    std::cout << "Setting monitor config on " << configUrl << std::endl;
+  std::future<CommandResponse> setStreamConfigAsync(const std::string &param,
+                                                    const std::string &value) {
+    std::string configUrl = streamConfigUrl(param);
+    std::cout << "Setting stream config on " << configUrl << std::endl;
+    return _putRequestAsync(configUrl, "native", value);
+  }
 
-    // Make the PUT request to set the monitor configuration
-    return _putRequest(configUrl, "native", value);
+  std::string setStreamConfig(const std::string &param,
+                              const std::string &value) {
+    return setStreamConfigAsync(param, value).get().value(streamConfigUrl(param));
   }
 
-  void deleteRequest(const std::string &url) {
-    CURLcode res;
-    curl_easy_setopt(connection_, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(connection_, CURLOPT_CUSTOMREQUEST, "DELETE");
-    if (!user_.empty()) {
-      curl_easy_setopt(connection_, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
-      curl_easy_setopt(connection_, CURLOPT_USERPWD, user_.c_str());
+  // The state is the response's "value", see _jsonValue
+  std::future<CommandResponse> detectorStateAsync() {
+    return requestAsync(getUrl("detector", "status", "state"), "GET",
+                        acceptType("native"));
+  }
+
+  // Returns the detector state, e.g. "idle" or "acquire"
+  std::string detectorState() {
+    std::string url = getUrl("detector", "status", "state");
+    return _jsonValue(detectorStateAsync().get().value(url));
+  }
+
+  // Extracts the string "value" field of a simple API response
+  static std::string _jsonValue(const std::string &json) {
+    size_t key = json.find("\"value\"");
+    if (key == std::string::npos) {
+      return "";
     }
-    res = curl_easy_perform(connection_);
-    if (res != CURLE_OK) {
-      throw std::runtime_error("Failed to connect to host: " +
-                               std::string(curl_easy_strerror(res)));
+    size_t begin = json.find('"', json.find(':', key) + 1);
+    if (begin == std::string::npos) {
+      return "";
     }
+    size_t end = json.find('"', begin + 1);
+    return end == std::string::npos ? "" : json.substr(begin + 1, end - begin - 1);
+  }
+
+  // Extracts the numeric "value" field, 0 if there is none
+  static double _jsonNumber(const std::string &json) {
+    size_t key = json.find("\"value\"");
+    if (key == std::string::npos) {
+      return 0.0;
+    }
+    size_t colon = json.find(':', key);
+    return colon == std::string::npos ? 0.0 : std::atof(json.c_str() + colon + 1);
+  }
+
+  std::future<CommandResponse> deleteRequestAsync(const std::string &url) {
+    return requestAsync(url, "DELETE", "");
+  }
+
+  void deleteRequest(const std::string &url) {
+    deleteRequestAsync(url).get().value(url);
   }
 
   void _log(const std::string &message) {
@@ -0,0 +1,327 @@
+#ifndef EIGER_STREAM_RECEIVER_H
+#define EIGER_STREAM_RECEIVER_H
+
+#include "BitshuffleLz4.h"
+#include "FrameSink.h"
+#include "PixelScan.h"
+#include "Stats.h"
+#include "ThreadPool.h"
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <zmq.h>
+
+// Receives frames pushed by the detector's ZeroMQ stream interface (API
+// 1.x) and decodes them into the sink's frame buffers as raw uint32 pixels.
+// Frames arriving while every buffer is in flight are dropped.
+class EigerStreamReceiver {
+private:
+  // Image geometry and encoding from a dimage_d part
+  struct ImageDetail {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    size_t elemSize = 0;
+    std::string encoding;
+  };
+
+  std::string endpoint_;
+  FrameSink &sink_;
+  ThreadPool &pool_;
+  void *context_;
+  void *socket_;
+  std::atomic<bool> running_;
+  double pixelSizeX_;
+  double pixelSizeY_;
+  std::vector<uint8_t> scratch_;
+
+  std::atomic<size_t> frames_;
+  std::atomic<size_t> dropped_;
+  std::atomic<size_t> failed_;
+  LatencyHistogram decodeTime_;
+
+  // Finds the raw text of a top level JSON field, enough for the flat
+  // objects the stream interface sends
+  static std::string field(const std::string &json, const std::string &key) {
+    size_t pos = json.find("\"" + key + "\"");
+    if (pos == std::string::npos) {
+      return "";
+    }
+    pos = json.find(':', pos);
+    if (pos == std::string::npos) {
+      return "";
+    }
+    ++pos;
+    while (pos < json.size() && std::isspace(static_cast<unsigned char>(json[pos]))) {
+      ++pos;
+    }
+    if (pos < json.size() && json[pos] == '"') {
+      size_t end = json.find('"', pos + 1);
+      return end == std::string::npos ? "" : json.substr(pos + 1, end - pos - 1);
+    }
+    size_t end = pos;
+    int depth = 0;
+    while (end < json.size() &&
+           (depth > 0 || (json[end] != ',' && json[end] != '}'))) {
+      if (json[end] == '[') {
+        ++depth;
+      } else if (json[end] == ']') {
+        --depth;
+      }
+      ++end;
+    }
+    return json.substr(pos, end - pos);
+  }
+
+  static double number(const std::string &json, const std::string &key,
+                       double fallback) {
+    std::string value = field(json, key);
+    try {
+      return value.empty() ? fallback : std::stod(value);
+    } catch (const std::exception &) {
+      return fallback;
+    }
+  }
+
+  // Receives one message part; false on timeout or when stopping
+  bool receivePart(zmq_msg_t &part) {
+    while (running_) {
+      if (zmq_msg_recv(&part, socket_, 0) >= 0) {
+        return true;
+      }
+      if (zmq_errno() != EAGAIN && zmq_errno() != EINTR) {
+        throw std::runtime_error("Stream receive failed: " +
+                                 std::string(zmq_strerror(zmq_errno())));
+      }
+    }
+    return false;
+  }
+
+  bool morePending() {
+    int more = 0;
+    size_t size = sizeof(more);
+    zmq_getsockopt(socket_, ZMQ_RCVMORE, &more, &size);
+    return more != 0;
+  }
+
+  // Reads the next part of the current message into part, if there is one
+  bool nextPart(zmq_msg_t &part) {
+    return morePending() && receivePart(part);
+  }
+
+  static std::string text(zmq_msg_t &part) {
+    return std::string(static_cast<const char *>(zmq_msg_data(&part)),
+                       zmq_msg_size(&part));
+  }
+
+  // Discards the rest of a multipart message, e.g. the flatfield and pixel
+  // mask sent with header_detail "all"
+  void drain() {
+    zmq_msg_t part;
+    zmq_msg_init(&part);
+    while (morePending() && receivePart(part)) {
+    }
+    zmq_msg_close(&part);
+  }
+
+  void onHeader(zmq_msg_t &part) {
+    std::string header = text(part);
+    std::string detail = field(header, "header_detail");
+    if ((detail == "basic" || detail == "all") && nextPart(part)) {
+      // Detector configuration; pixel sizes are in m, SMV wants mm
+      std::string config = text(part);
+      pixelSizeX_ = number(config, "x_pixel_size", pixelSizeX_ / 1000) * 1000;
+      pixelSizeY_ = number(config, "y_pixel_size", pixelSizeY_ / 1000) * 1000;
+    }
+    std::cout << "Stream " << sink_.name() << ": series "
+              << field(header, "series") << " started" << std::endl;
+  }
+
+  static ImageDetail parseDetail(const std::string &json) {
+    ImageDetail detail;
+    std::string shape = field(json, "shape");
+    unsigned width = 0, height = 0;
+    if (std::sscanf(shape.c_str(), "[%u ,%u]", &width, &height) != 2) {
+      throw std::runtime_error("Unexpected image shape " + shape);
+    }
+    detail.width = width;
+    detail.height = height;
+    std::string type = field(json, "type");
+    if (type == "uint32") {
+      detail.elemSize = 4;
+    } else if (type == "uint16") {
+      detail.elemSize = 2;
+    } else if (type == "uint8") {
+      detail.elemSize = 1;
+    } else {
+      throw std::runtime_error("Unsupported pixel type " + type);
+    }
+    detail.encoding = field(json, "encoding");
+    if (!detail.encoding.empty() && detail.encoding.back() == '>') {
+      throw std::runtime_error("Big endian frames are not supported");
+    }
+    return detail;
+  }
+
+  // Decodes the blob into dst, which holds width * height * elemSize bytes
+  void decodeBlob(const ImageDetail &detail, const uint8_t *blob, size_t size,
+                  uint8_t *dst, size_t dstSize) {
+    const std::string &encoding = detail.encoding;
+    if (encoding.compare(0, 2, "bs") == 0 &&
+        encoding.find("-lz4") != std::string::npos) {
+      bitshuffle::decodeBitshuffleLz4(blob, size, dst, dstSize,
+                                      detail.elemSize, &pool_);
+    } else if (encoding.compare(0, 3, "lz4") == 0) {
+      bitshuffle::decodeLz4(blob, size, dst, dstSize);
+    } else if (encoding.empty() || encoding == "<") {
+      if (size != dstSize) {
+        throw std::runtime_error("Unexpected uncompressed frame size");
+      }
+      std::memcpy(dst, blob, size);
+    } else {
+      throw std::runtime_error("Unsupported encoding " + encoding);
+    }
+  }
+
+  void onImage(zmq_msg_t &part) {
+    std::string image = text(part);
+    zmq_msg_t detailPart;
+    zmq_msg_init(&detailPart);
+    zmq_msg_t blob;
+    zmq_msg_init(&blob);
+    try {
+      if (!nextPart(detailPart) || !nextPart(blob)) {
+        throw std::runtime_error("Truncated image message");
+      }
+      FrameHandle frame = sink_.tryAcquireFrame();
+      if (!frame) {
+        ++dropped_;
+      } else {
+        ImageDetail detail = parseDetail(text(detailPart));
+        size_t pixels = size_t(detail.width) * detail.height;
+        frame->resize(pixels * sizeof(uint32_t));
+        {
+          ScopedTimer timer(decodeTime_);
+          const uint8_t *data = static_cast<const uint8_t *>(zmq_msg_data(&blob));
+          if (detail.elemSize == sizeof(uint32_t)) {
+            decodeBlob(detail, data, zmq_msg_size(&blob), frame->data(),
+                       frame->size());
+          } else {
+            // Narrow pixels are widened so every frame reaches ADXV as
+            // uint32, with their gap value widened to kGapPixel
+            scratch_.resize(pixels * detail.elemSize);
+            decodeBlob(detail, data, zmq_msg_size(&blob), scratch_.data(),
+                       scratch_.size());
+            uint32_t *out = reinterpret_cast<uint32_t *>(frame->data());
+            if (detail.elemSize == 2) {
+              pixels::widen(reinterpret_cast<const uint16_t *>(scratch_.data()),
+                            out, pixels, &pool_);
+            } else {
+              pixels::widen(scratch_.data(), out, pixels, &pool_);
+            }
+          }
+        }
+        frame->validators.seriesId =
+            static_cast<int64_t>(number(image, "series", -1));
+        frame->validators.imageId =
+            static_cast<int64_t>(number(image, "frame", -1));
+        frame->layout.format = FrameFormat::RawUInt32;
+        frame->layout.width = detail.width;
+        frame->layout.height = detail.height;
+        frame->layout.pixelSizeX = pixelSizeX_;
+        frame->layout.pixelSizeY = pixelSizeY_;
+        ++frames_;
+        sink_.submit(std::move(frame));
+      }
+    } catch (const std::exception &e) {
+      std::cerr << "Stream " << sink_.name() << " error: " << e.what()
+                << std::endl;
+      ++failed_;
+    }
+    zmq_msg_close(&blob);
+    zmq_msg_close(&detailPart);
+  }
+
+public:
+  // endpoint is e.g. tcp://<detector>:9999
+  EigerStreamReceiver(const std::string &endpoint, FrameSink &sink,
+                      ThreadPool &pool)
+      : endpoint_(endpoint), sink_(sink), pool_(pool),
+        context_(zmq_ctx_new()), socket_(nullptr), running_(false),
+        pixelSizeX_(0.075), pixelSizeY_(0.075), frames_(0), dropped_(0),
+        failed_(0) {
+    if (!context_) {
+      throw std::runtime_error("Failed to create ZeroMQ context");
+    }
+    socket_ = zmq_socket(context_, ZMQ_PULL);
+    if (!socket_) {
+      zmq_ctx_term(context_);
+      throw std::runtime_error("Failed to create ZeroMQ socket");
+    }
+    // Short receive timeout so stop() is noticed
+    int timeoutMs = 200;
+    zmq_setsockopt(socket_, ZMQ_RCVTIMEO, &timeoutMs, sizeof(timeoutMs));
+    // Keep only a few frames queued; the viewer wants the newest
+    int highWaterMark = 4;
+    zmq_setsockopt(socket_, ZMQ_RCVHWM, &highWaterMark, sizeof(highWaterMark));
+    if (zmq_connect(socket_, endpoint_.c_str()) != 0) {
+      zmq_close(socket_);
+      zmq_ctx_term(context_);
+      throw std::runtime_error("Failed to connect to " + endpoint_);
+    }
+  }
+
+  EigerStreamReceiver(const EigerStreamReceiver &) = delete;
+  EigerStreamReceiver &operator=(const EigerStreamReceiver &) = delete;
+
+  ~EigerStreamReceiver() {
+    int linger = 0;
+    zmq_setsockopt(socket_, ZMQ_LINGER, &linger, sizeof(linger));
+    zmq_close(socket_);
+    zmq_ctx_term(context_);
+  }
+
+  void run() {
+    running_ = true;
+    zmq_msg_t part;
+    zmq_msg_init(&part);
+    while (running_) {
+      try {
+        if (!receivePart(part)) {
+          continue;
+        }
+        std::string htype = field(text(part), "htype");
+        if (htype.compare(0, 8, "dheader-") == 0) {
+          onHeader(part);
+        } else if (htype.compare(0, 7, "dimage-") == 0) {
+          onImage(part);
+        } else if (htype.compare(0, 12, "dseries_end-") == 0) {
+          std::cout << "Stream " << sink_.name() << ": series "
+                    << field(text(part), "series") << " ended, " << frames_
+                    << " frames, " << dropped_ << " dropped" << std::endl;
+        }
+        drain();
+      } catch (const std::exception &e) {
+        std::cerr << "Stream " << sink_.name() << " error: " << e.what()
+                  << std::endl;
+        ++failed_;
+      }
+    }
+    zmq_msg_close(&part);
+  }
+
+  void stop() { running_ = false; }
+
+  size_t frames() const { return frames_; }
+  size_t dropped() const { return dropped_; }
+  size_t failed() const { return failed_; }
+  const LatencyHistogram &decodeTime() const { return decodeTime_; }
+};
+
+#endif
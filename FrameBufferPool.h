@@ -0,0 +1,227 @@
+#ifndef FRAME_BUFFER_POOL_H
+#define FRAME_BUFFER_POOL_H
+
+#include "MetadataSource.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Identifiers the detector sent along with a frame, empty or -1 if absent
+struct FrameValidators {
+  int64_t seriesId = -1;
+  int64_t imageId = -1;
+  std::string etag;
+  std::string lastModified;
+
+  void clear() { *this = FrameValidators(); }
+};
+
+enum class FrameFormat {
+  // TIFF file as served by the monitor interface
+  Tiff,
+  // Decoded little endian uint32 pixels, e.g. from the stream interface
+  RawUInt32
+};
+
+// How the bytes of a frame are to be read. Raw frames carry their geometry
+// here since there is no file header.
+struct FrameLayout {
+  FrameFormat format = FrameFormat::Tiff;
+  uint32_t width = 0;
+  uint32_t height = 0;
+  double pixelSizeX = 0.0;
+  double pixelSizeY = 0.0;
+
+  void clear() { *this = FrameLayout(); }
+};
+
+// Reusable receive buffer. The storage is left uninitialised and only grows,
+// so a buffer that has seen one frame never allocates again for frames of
+// the same size.
+class FrameBuffer {
+private:
+  std::unique_ptr<uint8_t[]> data_;
+  size_t capacity_;
+  size_t size_;
+
+public:
+  explicit FrameBuffer(size_t capacity = 0)
+      : data_(capacity ? new uint8_t[capacity] : nullptr), capacity_(capacity),
+        size_(0) {}
+
+  FrameValidators validators;
+  FrameLayout layout;
+  // When the frame entered the pipeline, for end-to-end timing
+  std::chrono::steady_clock::time_point received;
+  // Metadata that came with the frame, e.g. recorded in a capture; the
+  // metadata stage uses it instead of asking the source
+  bool hasMetadata = false;
+  FrameMetadata metadata;
+
+  uint8_t *data() { return data_.get(); }
+  const uint8_t *data() const { return data_.get(); }
+  size_t size() const { return size_; }
+  size_t capacity() const { return capacity_; }
+  bool empty() const { return size_ == 0; }
+
+  void clear() {
+    size_ = 0;
+    validators.clear();
+    layout.clear();
+    hasMetadata = false;
+  }
+
+  // Makes room for at least capacity bytes, keeping the current contents
+  void reserve(size_t capacity) {
+    if (capacity <= capacity_) {
+      return;
+    }
+    std::unique_ptr<uint8_t[]> data(new uint8_t[capacity]);
+    if (size_) {
+      std::memcpy(data.get(), data_.get(), size_);
+    }
+    data_ = std::move(data);
+    capacity_ = capacity;
+  }
+
+  void append(const void *bytes, size_t n) {
+    if (size_ + n > capacity_) {
+      reserve(std::max(size_ + n, capacity_ * 2));
+    }
+    std::memcpy(data_.get() + size_, bytes, n);
+    size_ += n;
+  }
+
+  void resize(size_t size) {
+    reserve(size);
+    size_ = size;
+  }
+
+  // Writes to every page so the first frame does not take the page faults
+  void prefault() {
+    for (size_t offset = 0; offset < capacity_; offset += 4096) {
+      data_[offset] = 0;
+    }
+  }
+};
+
+// Fixed set of frame buffers shared by the receive pipeline. A FrameHandle
+// owns one buffer and hands it back to the pool when it is destroyed, so
+// frames move between stages without being copied.
+class FrameBufferPool {
+private:
+  struct State {
+    std::mutex mutex;
+    std::condition_variable available;
+    std::vector<std::unique_ptr<FrameBuffer>> free;
+    size_t bufferSize;
+  };
+
+  std::shared_ptr<State> state_;
+
+public:
+  class Returner {
+  private:
+    std::shared_ptr<State> state_;
+
+  public:
+    Returner() = default;
+    explicit Returner(std::shared_ptr<State> state)
+        : state_(std::move(state)) {}
+
+    void operator()(FrameBuffer *buffer) const {
+      if (!state_) {
+        delete buffer;
+        return;
+      }
+      buffer->clear();
+      {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        state_->free.emplace_back(buffer);
+      }
+      state_->available.notify_one();
+    }
+  };
+
+  using Handle = std::unique_ptr<FrameBuffer, Returner>;
+
+  FrameBufferPool(size_t bufferCount, size_t bufferSize)
+      : state_(std::make_shared<State>()) {
+    state_->bufferSize = bufferSize;
+    for (size_t i = 0; i < bufferCount; ++i) {
+      state_->free.emplace_back(new FrameBuffer(bufferSize));
+    }
+  }
+
+  // Blocks until a buffer is returned if all of them are in flight
+  Handle acquire() {
+    std::unique_lock<std::mutex> lock(state_->mutex);
+    state_->available.wait(lock, [this] { return !state_->free.empty(); });
+    std::unique_ptr<FrameBuffer> buffer = std::move(state_->free.back());
+    state_->free.pop_back();
+    size_t bufferSize = state_->bufferSize;
+    lock.unlock();
+
+    buffer->reserve(bufferSize);
+    return Handle(buffer.release(), Returner(state_));
+  }
+
+  // Returns an empty handle instead of blocking if no buffer is free
+  Handle tryAcquire() {
+    std::unique_lock<std::mutex> lock(state_->mutex);
+    if (state_->free.empty()) {
+      return Handle(nullptr, Returner(state_));
+    }
+    std::unique_ptr<FrameBuffer> buffer = std::move(state_->free.back());
+    state_->free.pop_back();
+    size_t bufferSize = state_->bufferSize;
+    lock.unlock();
+
+    buffer->reserve(bufferSize);
+    return Handle(buffer.release(), Returner(state_));
+  }
+
+  // Sets the size new acquisitions are grown to, e.g. from the last frame
+  void setBufferSize(size_t bufferSize) {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    state_->bufferSize = std::max(state_->bufferSize, bufferSize);
+  }
+
+  // Grows the free buffers to bufferSize and faults their pages in ahead of
+  // the first frame
+  void prefault(size_t bufferSize) {
+    std::vector<std::unique_ptr<FrameBuffer>> buffers;
+    {
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      state_->bufferSize = std::max(state_->bufferSize, bufferSize);
+      bufferSize = state_->bufferSize;
+      buffers.swap(state_->free);
+    }
+    for (auto &buffer : buffers) {
+      buffer->reserve(bufferSize);
+      buffer->prefault();
+    }
+    {
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      for (auto &buffer : buffers) {
+        state_->free.push_back(std::move(buffer));
+      }
+    }
+    state_->available.notify_all();
+  }
+
+  size_t bufferSize() const {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    return state_->bufferSize;
+  }
+};
+
+using FrameHandle = FrameBufferPool::Handle;
+
+#endif
@@ -0,0 +1,186 @@
+#ifndef FRAME_CHANGE_DETECTOR_H
+#define FRAME_CHANGE_DETECTOR_H
+
+#include "FrameBufferPool.h"
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+
+#if __has_include(<xxhash.h>)
+#define XXH_INLINE_ALL
+#include <xxhash.h>
+#define YAMONE_HAVE_XXHASH 1
+#endif
+
+// 64-bit content hash of a raw frame. Uses XXH3 when xxhash is installed and
+// otherwise an XXH3-style stripe accumulator written so the compiler can
+// vectorise it.
+inline uint64_t hashFrame(const uint8_t *data, size_t size) {
+#ifdef YAMONE_HAVE_XXHASH
+  return XXH3_64bits(data, size);
+#else
+  static const uint64_t kPrime32 = 0x9E3779B1ULL;
+  static const uint64_t kPrime64 = 0x9E3779B185EBCA87ULL;
+  // The first 192 bytes of XXH3's default secret. As in XXH3, stripe n of a
+  // block is keyed from word n on, so stripes in another order hash apart.
+  static const uint64_t kSecret[24] = {
+      0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL,
+      0x1f67b3b7a4a44072ULL, 0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL,
+      0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL, 0xcb00c391bb52283cULL,
+      0xa32e531b8b65d088ULL, 0x4ef90da297486471ULL, 0xd8acdea946ef1938ULL,
+      0x3f349ce33f76faa8ULL, 0x1d4f0bc7c7bbdcf9ULL, 0x3159b4cd4be0518aULL,
+      0x647378d9c97e9fc8ULL, 0xc3ebd33483acc5eaULL, 0xeb6313faffa081c5ULL,
+      0x49daf0b751dd0d17ULL, 0x9e68d429265516d3ULL, 0xfca1477d58be162bULL,
+      0xce31d07ad1b8f88fULL, 0x280416958f3acb45ULL, 0x7e404bbbcafbd7afULL};
+  const size_t stripe = 64;
+  const size_t stripesPerBlock = 16;
+
+  uint64_t acc[8] = {kPrime32, kPrime64, kPrime32 * 3, kPrime64 ^ size,
+                     kPrime32 * 5, kPrime64 * 3, kPrime32 * 7, kPrime64 * 5};
+  size_t stripes = size / stripe;
+  for (size_t s = 0; s < stripes; ++s) {
+    uint64_t lanes[8];
+    std::memcpy(lanes, data + s * stripe, stripe);
+    const uint64_t *key = kSecret + s % stripesPerBlock;
+    for (int i = 0; i < 8; ++i) {
+      uint64_t keyed = lanes[i] ^ key[i];
+      acc[i ^ 1] += lanes[i];
+      acc[i] += (keyed & 0xFFFFFFFFULL) * (keyed >> 32);
+    }
+    if ((s + 1) % stripesPerBlock == 0) {
+      for (int i = 0; i < 8; ++i) {
+        acc[i] = ((acc[i] ^ (acc[i] >> 47)) ^ kSecret[16 + i]) * kPrime32;
+      }
+    }
+  }
+
+  uint8_t tail[stripe] = {0};
+  std::memcpy(tail, data + stripes * stripe, size - stripes * stripe);
+  for (int i = 0; i < 8; ++i) {
+    uint64_t lane;
+    std::memcpy(&lane, tail + i * 8, 8);
+    acc[i] ^= lane * kPrime64;
+  }
+
+  uint64_t h = size * kPrime64;
+  for (int i = 0; i < 8; ++i) {
+    h ^= acc[i] + (h << 6) + (h >> 2);
+    h *= kPrime64;
+  }
+  h ^= h >> 37;
+  h *= 0x165667919E3779F9ULL;
+  return h ^ (h >> 32);
+#endif
+}
+
+enum class FrameChange { New, Same, Unknown };
+
+// Decides whether a received frame differs from the last accepted one without
+// keeping the previous frame around. Detector ids and strong ETags decide on
+// their own. A different Last-Modified marks the frame as new, an equal one
+// only has one second resolution and falls back to the content hash. The
+// hashed content is the raw frame unless the caller passes other bytes, such
+// as the decoded region of interest. A frame is accepted once it is handed
+// on, so copies of it still in flight count as duplicates, and rolled back
+// by a later stage that fails to save it.
+class FrameChangeDetector {
+private:
+  std::mutex mutex_;
+  uint64_t generation_;
+  FrameValidators last_;
+  uint64_t lastHash_;
+  bool haveLast_;
+  bool haveHash_;
+
+  FrameValidators pending_;
+  uint64_t pendingHash_;
+  bool pendingHashValid_;
+
+  static bool strongEtag(const std::string &etag) {
+    return !etag.empty() && etag.compare(0, 2, "W/") != 0;
+  }
+
+  FrameChange compareValidators(const FrameBuffer &frame) {
+    pending_ = frame.validators;
+    pendingHashValid_ = false;
+    if (!haveLast_) {
+      return FrameChange::New;
+    }
+
+    if (pending_.seriesId >= 0 && last_.seriesId >= 0) {
+      return pending_.seriesId != last_.seriesId || pending_.imageId != last_.imageId
+                 ? FrameChange::New
+                 : FrameChange::Same;
+    }
+    if (strongEtag(pending_.etag) && strongEtag(last_.etag)) {
+      return pending_.etag != last_.etag ? FrameChange::New : FrameChange::Same;
+    }
+    if (!pending_.lastModified.empty() && !last_.lastModified.empty() &&
+        pending_.lastModified != last_.lastModified) {
+      return FrameChange::New;
+    }
+    return FrameChange::Unknown;
+  }
+
+public:
+  FrameChangeDetector()
+      : generation_(0), lastHash_(0), haveLast_(false), haveHash_(false), pendingHash_(0),
+        pendingHashValid_(false) {}
+
+  // Decides from the detector ids and HTTP validators alone, Unknown when
+  // only the content can tell
+  FrameChange compare(const FrameBuffer &frame) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return compareValidators(frame);
+  }
+
+  // Returns true if the frame is new. Call accept() once it has been handled
+  // so a frame that failed to decode is retried.
+  bool changed(const FrameBuffer &frame, const uint8_t *content = nullptr,
+               size_t size = 0) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    FrameChange change = compareValidators(frame);
+    if (change != FrameChange::Unknown) {
+      return change == FrameChange::New;
+    }
+    pendingHash_ = content ? hashFrame(content, size) : hashFrame(frame.data(), frame.size());
+    pendingHashValid_ = true;
+    return !haveHash_ || pendingHash_ != lastHash_;
+  }
+
+  // content is the one given to changed(). Returns the value to pass to
+  // rollback() if the frame is not saved after all.
+  uint64_t accept(const FrameBuffer &frame, const uint8_t *content = nullptr, size_t size = 0) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Frames identified by id or ETag are only hashed if the hash was needed
+    bool identified = pending_.seriesId >= 0 || strongEtag(pending_.etag);
+    if (!pendingHashValid_ && !identified) {
+      pendingHash_ = content ? hashFrame(content, size) : hashFrame(frame.data(), frame.size());
+      pendingHashValid_ = true;
+    }
+    last_ = pending_;
+    lastHash_ = pendingHash_;
+    haveLast_ = true;
+    haveHash_ = pendingHashValid_;
+    return ++generation_;
+  }
+
+  // Forgets an accepted frame that failed to save, so it is taken as new
+  // when fetched again, unless a newer frame has been accepted since
+  void rollback(uint64_t accepted) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (accepted == generation_) {
+      haveLast_ = false;
+      haveHash_ = false;
+    }
+  }
+
+  void reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    haveLast_ = false;
+    haveHash_ = false;
+  }
+};
+
+#endif
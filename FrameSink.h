@@ -0,0 +1,21 @@
+#ifndef FRAME_SINK_H
+#define FRAME_SINK_H
+
+#include "FrameBufferPool.h"
+#include <string>
+
+// Entry point of a receiver pipeline for frames fetched elsewhere, e.g. by a
+// shared I/O loop
+class FrameSink {
+public:
+  virtual ~FrameSink() = default;
+
+  virtual const std::string &name() const = 0;
+
+  // Returns an empty handle if all of the sink's buffers are in flight
+  virtual FrameHandle tryAcquireFrame() = 0;
+
+  virtual void submit(FrameHandle frame) = 0;
+};
+
+#endif
@@ -0,0 +1,263 @@
+#ifndef FRAME_STATISTICS_H
+#define FRAME_STATISTICS_H
+
+#include "PixelScan.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Count histogram with one bin per value below 256 and 8 bins per power of
+// two above, so percentiles are exact for weak frames and within 12.5% for
+// strong ones
+class CountHistogram {
+public:
+  static const int kLinearBins = 256;
+  static const int kSubBuckets = 8;
+  static const int kBins = kLinearBins + (32 - 8) * kSubBuckets;
+
+  static int index(uint32_t value) {
+    if (value < kLinearBins) {
+      return static_cast<int>(value);
+    }
+    int msb = 31 - __builtin_clz(value);
+    return kLinearBins + (msb - 8) * kSubBuckets +
+           static_cast<int>((value >> (msb - 3)) & (kSubBuckets - 1));
+  }
+
+  // Smallest value that falls into a bin
+  static uint32_t lowerBound(int bin) {
+    if (bin < kLinearBins) {
+      return static_cast<uint32_t>(bin);
+    }
+    int msb = (bin - kLinearBins) / kSubBuckets + 8;
+    uint32_t sub = static_cast<uint32_t>((bin - kLinearBins) % kSubBuckets);
+    return (uint32_t(kSubBuckets) + sub) << (msb - 3);
+  }
+
+  std::array<uint64_t, kBins> counts{};
+
+  uint64_t total() const {
+    uint64_t sum = 0;
+    for (uint64_t count : counts) {
+      sum += count;
+    }
+    return sum;
+  }
+
+  // Lower bound of the bin holding the q-th quantile of the counted pixels
+  uint32_t quantile(double q) const {
+    uint64_t all = total();
+    if (all == 0) {
+      return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(q * (all - 1)) + 1;
+    uint64_t seen = 0;
+    for (int bin = 0; bin < kBins; ++bin) {
+      seen += counts[bin];
+      if (seen >= rank) {
+        return lowerBound(bin);
+      }
+    }
+    return lowerBound(kBins - 1);
+  }
+
+  void add(const CountHistogram &other) {
+    for (int bin = 0; bin < kBins; ++bin) {
+      counts[bin] += other.counts[bin];
+    }
+  }
+};
+
+// Per-frame statistics over the pixels outside the gap mask
+struct FrameStats {
+  uint64_t sum = 0;
+  uint32_t max = 0;
+  size_t pixels = 0;
+  size_t gaps = 0;
+  // Pixels above the hot level and at or above the saturation level
+  size_t hot = 0;
+  size_t saturated = 0;
+  CountHistogram histogram;
+  // Display levels from the count percentiles
+  uint32_t contrastLow = 0;
+  uint32_t contrastHigh = 0;
+
+  double mean() const { return pixels ? double(sum) / pixels : 0.0; }
+
+  void add(const FrameStats &other) {
+    sum += other.sum;
+    max = std::max(max, other.max);
+    pixels += other.pixels;
+    gaps += other.gaps;
+    hot += other.hot;
+    saturated += other.saturated;
+    histogram.add(other.histogram);
+  }
+};
+
+// Thresholds for FrameStats
+struct FrameStatsLevels {
+  uint32_t hot = 65535;
+  uint32_t saturation = kGapPixel - 1;
+  // Percentiles of the counted pixels used as display range
+  double contrastLow = 0.01;
+  double contrastHigh = 0.999;
+};
+
+namespace framestats {
+
+// Statistics of up to 2^32 pixels. Histogram bins are computed in vectors
+// from the float representation of the counts: the exponent and the top
+// three mantissa bits are the log-linear bin. Gap pixels are zeroed first,
+// land in bin 0 and are taken out of it at the end.
+inline FrameStats computeRange(const uint32_t *src, size_t count,
+                               const FrameStatsLevels &levels) {
+  FrameStats stats;
+  // Four histograms, one per vector lane, so neighbouring equal counts do
+  // not serialise on the same bin
+  std::vector<std::array<uint32_t, CountHistogram::kBins>> lanes(4);
+  for (auto &lane : lanes) {
+    lane.fill(0);
+  }
+  size_t i = 0;
+#ifdef __SSE2__
+  // Sum, max and the level counts in vectors; the sum is widened to 64-bit
+  // lanes and comparisons are biased, as SSE2 only compares signed words
+  const __m128i bias = _mm_set1_epi32(static_cast<int>(0x80000000u));
+  const __m128i gap = _mm_set1_epi32(-1);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i hotLevel = _mm_set1_epi32(static_cast<int>(levels.hot ^ 0x80000000u));
+  // value >= saturation as value > saturation - 1; a level of 0 is handled below
+  const __m128i saturationLevel =
+      _mm_set1_epi32(static_cast<int>((levels.saturation - 1) ^ 0x80000000u));
+  __m128i maxBiased = bias;
+  __m128i sum = _mm_setzero_si128();
+  __m128i gaps = _mm_setzero_si128();
+  __m128i hot = _mm_setzero_si128();
+  __m128i saturated = _mm_setzero_si128();
+  const __m128i exactLimit = _mm_set1_epi32(static_cast<int>(((1u << 24) - 1) ^ 0x80000000u));
+  const __m128i linearLimit = _mm_set1_epi32(CountHistogram::kLinearBins - 1);
+  const __m128i logOffset = _mm_set1_epi32(
+      8 * 127 + 8 * CountHistogram::kSubBuckets - CountHistogram::kLinearBins);
+  // Empty vectors, most of a sparse frame, are only counted
+  size_t zeroVectors = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(x, zero)) == 0xFFFF) {
+      ++zeroVectors;
+      continue;
+    }
+    __m128i isGap = _mm_cmpeq_epi32(x, gap);
+    __m128i masked = _mm_andnot_si128(isGap, x);
+    sum = _mm_add_epi64(sum, _mm_add_epi64(_mm_unpacklo_epi32(masked, zero),
+                                           _mm_unpackhi_epi32(masked, zero)));
+    __m128i biased = _mm_xor_si128(masked, bias);
+    __m128i greater = _mm_cmpgt_epi32(biased, maxBiased);
+    maxBiased = _mm_or_si128(_mm_and_si128(greater, biased),
+                             _mm_andnot_si128(greater, maxBiased));
+    gaps = _mm_sub_epi32(gaps, isGap);
+    hot = _mm_sub_epi32(hot, _mm_cmpgt_epi32(biased, hotLevel));
+    saturated = _mm_sub_epi32(saturated, _mm_cmpgt_epi32(biased, saturationLevel));
+
+    uint32_t bins[4];
+    if (_mm_movemask_epi8(_mm_cmpgt_epi32(biased, exactLimit)) == 0) {
+      // Counts below 2^24 convert to float exactly; the exponent and top
+      // mantissa bits, (bits >> 20), are 8 * (msb + 127) + sub-bucket
+      __m128i bits = _mm_castps_si128(_mm_cvtepi32_ps(masked));
+      __m128i logIndex = _mm_sub_epi32(_mm_srli_epi32(bits, 20), logOffset);
+      __m128i strong = _mm_cmpgt_epi32(masked, linearLimit);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(bins),
+                       _mm_or_si128(_mm_and_si128(strong, logIndex),
+                                    _mm_andnot_si128(strong, masked)));
+    } else {
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(bins), masked);
+      for (uint32_t &bin : bins) {
+        bin = static_cast<uint32_t>(CountHistogram::index(bin));
+      }
+    }
+    ++lanes[0][bins[0]];
+    ++lanes[1][bins[1]];
+    ++lanes[2][bins[2]];
+    ++lanes[3][bins[3]];
+  }
+  lanes[0][0] += static_cast<uint32_t>(4 * zeroVectors);
+  uint64_t sums[2];
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(sums), sum);
+  stats.sum += sums[0] + sums[1];
+  uint32_t words[4];
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(words), maxBiased);
+  for (uint32_t word : words) {
+    stats.max = std::max(stats.max, word ^ 0x80000000u);
+  }
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(words), gaps);
+  stats.gaps += size_t(words[0]) + words[1] + words[2] + words[3];
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(words), hot);
+  stats.hot += size_t(words[0]) + words[1] + words[2] + words[3];
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(words), saturated);
+  stats.saturated += size_t(words[0]) + words[1] + words[2] + words[3];
+#endif
+  for (; i < count; ++i) {
+    uint32_t value = src[i];
+    if (value == kGapPixel) {
+      ++stats.gaps;
+      ++lanes[0][0];
+    } else {
+      ++lanes[0][CountHistogram::index(value)];
+      stats.sum += value;
+      stats.max = std::max(stats.max, value);
+      stats.hot += value > levels.hot;
+      stats.saturated += levels.saturation > 0 && value >= levels.saturation;
+    }
+  }
+  for (const auto &lane : lanes) {
+    for (int bin = 0; bin < CountHistogram::kBins; ++bin) {
+      stats.histogram.counts[bin] += lane[bin];
+    }
+  }
+  stats.histogram.counts[0] -= stats.gaps;
+  stats.pixels = count - stats.gaps;
+  if (levels.saturation == 0) {
+    stats.saturated = stats.pixels;
+  }
+  return stats;
+}
+
+// Pixels per parallel chunk
+const size_t kChunkPixels = size_t(1) << 20;
+
+// Computes the statistics of a frame in one pass, spread over the pool
+inline FrameStats compute(const uint32_t *pixels, size_t count,
+                          const FrameStatsLevels &levels,
+                          ThreadPool *pool = nullptr) {
+  size_t chunks = (count + kChunkPixels - 1) / kChunkPixels;
+  std::vector<FrameStats> partial(std::max<size_t>(chunks, 1));
+  auto computeChunks = [&](size_t begin, size_t end) {
+    for (size_t c = begin; c < end; ++c) {
+      size_t first = c * kChunkPixels;
+      partial[c] = computeRange(pixels + first, std::min(kChunkPixels, count - first),
+                                levels);
+    }
+  };
+  if (pool) {
+    pool->parallelFor(chunks, computeChunks);
+  } else {
+    computeChunks(0, chunks);
+  }
+  FrameStats stats;
+  for (const FrameStats &chunk : partial) {
+    stats.add(chunk);
+  }
+  stats.contrastLow = stats.histogram.quantile(levels.contrastLow);
+  stats.contrastHigh = stats.histogram.quantile(levels.contrastHigh);
+  return stats;
+}
+
+} // namespace framestats
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef METADATA_SOURCE_H
+#define METADATA_SOURCE_H
+
+#include <chrono>
+
+// Metadata merged into each frame from the detector Tango device
+struct FrameMetadata {
+  double bcX = 0.0;
+  double bcY = 0.0;
+  double dDistance = 0.0;
+  double incidentEnergy = 0.0;
+  double incidentWavelength = 0.0;
+  // When the values were last read or pushed by the device
+  std::chrono::steady_clock::time_point updated;
+
+  double ageSeconds() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         updated)
+        .count();
+  }
+};
+
+// Where the metadata stage gets beam center, distance and energy from
+class MetadataSource {
+public:
+  virtual ~MetadataSource() = default;
+
+  // Current values; throws if the source cannot be read
+  virtual FrameMetadata snapshot() = 0;
+
+  // Opens the source ahead of the first snapshot, e.g. during startup
+  virtual void connect() {}
+};
+
+#endif
@@ -0,0 +1,1283 @@
+#ifndef MONITOR_RECEIVER_H
+#define MONITOR_RECEIVER_H
+
+#include "AdxvSession.h"
+#include "Binning.h"
+#include "BoundedQueue.h"
+#include "CbfWriter.h"
+#include "CaptureFile.h"
+#include "CaptureReplayer.h"
+#include "CatchUpFetcher.h"
+#include "EigerMonitorClient.h"
+#include "EigerStreamReceiver.h"
+#include "FrameBufferPool.h"
+#include "FrameChangeDetector.h"
+#include "FrameSink.h"
+#include "FrameStatistics.h"
+#include "MetadataSource.h"
+#include "PixelScan.h"
+#include "PollScheduler.h"
+#include "RadialIntegrator.h"
+#include "RollingSum.h"
+#include "SharedFramePublisher.h"
+#include "SmvWriter.h"
+#include "Stats.h"
+#include "TangoMetadataCache.h"
+#include "ThreadPool.h"
+#include "TiffMemoryReader.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <tiffio.h>
+
+// Custom TIFF error handler to suppress warnings
+inline void tiffErrorHandler(const char* module, const char* fmt, va_list ap) {
+    // Do nothing, suppress warnings
+}
+
+// Frame moving through the receive pipeline. The decoded image may point into
+// the raw buffer, so both travel together.
+struct PipelineFrame {
+    FrameHandle raw;
+    TiffImage image;
+    FrameMetadata metadata;
+    // From FrameChangeDetector::accept, rolled back if the frame is not written
+    uint64_t accepted = 0;
+};
+
+// Where a detector is polled and where its frames and metadata go
+struct DetectorConfig {
+    std::string ip;
+    int port = 80;
+    std::string name;
+    std::string imageFilename = "/tmp/eiger_monitor";
+    std::string beamCenterFile = "/tmp/.adxv_beam_center";
+    std::string tangoDevice = "<Put Tango adress of the detector interface here>";
+    std::string adxvHost = "127.0.0.1";
+    int adxvPort = 8100;
+    // Loads requested sooner than this after the previous one are coalesced
+    std::chrono::milliseconds adxvMinInterval = std::chrono::milliseconds(200);
+    // Startup waits this long for ADXV to accept connections, 0 not to wait
+    std::chrono::milliseconds adxvReadyTimeout = std::chrono::milliseconds(5000);
+    PollMode pollMode = PollMode::LongPoll;
+    // Drain the monitor buffer over several connections instead of polling
+    bool catchUp = false;
+    size_t catchUpConnections = 4;
+    int monitorBufferSize = 64;
+    // Receive frames from the ZeroMQ stream interface instead of the monitor
+    bool stream = false;
+    int streamPort = 9999;
+    // Prometheus textfile rewritten every statsInterval, empty to disable
+    std::string statsFile;
+    std::chrono::milliseconds statsInterval = std::chrono::milliseconds(5000);
+    // Write 16-bit SMV when every count fits, gaps remapped to 0xFFFF
+    bool adaptiveDepth = true;
+    // Every written frame is also archived here as byte offset CBF, empty to disable
+    std::string cbfDirectory;
+    // Binned preview SMV written next to imageFilename, 0 to disable
+    uint32_t previewBin = 0;
+    BinMode previewMode = BinMode::Sum;
+    std::string previewFilename = "/tmp/eiger_monitor_preview";
+    // Have ADXV load the preview instead of the full frame
+    bool adxvPreview = false;
+    // Counts, histogram and contrast levels of each frame, empty to disable
+    std::string frameStatsFile = "/tmp/.adxv_frame_stats";
+    FrameStatsLevels frameStatsLevels;
+    // Azimuthally integrated profile of each frame, 0 bins to disable
+    size_t radialBins = 0;
+    RadialUnit radialUnit = RadialUnit::Q;
+    std::string radialProfileFile = "/tmp/.adxv_radial_profile";
+    // Sum of the last sumFrames frames written next to imageFilename, 0 to
+    // disable; the window restarts with every series
+    size_t sumFrames = 0;
+    std::string sumFilename = "/tmp/eiger_monitor_sum";
+    // Have ADXV load the sum instead of the latest frame
+    bool adxvSum = false;
+    // Frames are also published into this POSIX shared memory ring for local
+    // readers, e.g. "/yamone", empty to disable
+    std::string sharedMemoryName;
+    uint32_t sharedMemorySlots = 4;
+    // Only this rectangle of detector pixels is decoded, written and analysed,
+    // empty for the whole frame. With roiAroundBeam only its size is used and
+    // it follows the beam center of the previous frame.
+    PixelRect roi;
+    bool roiAroundBeam = false;
+    // Every received frame is appended raw, with its metadata, to this
+    // capture file, empty to disable
+    std::string captureFile;
+    // Frames come from this capture file instead of the detector, at the
+    // captured pace or as fast as possible
+    std::string replayFile;
+    bool replayFast = false;
+};
+
+class MonitorReceiver : public FrameSink {
+private:
+    std::string ip_;
+    int port_;
+    std::string name_;
+    std::string imageFilename_;
+    FrameChangeDetector changes_;
+    std::string beamCenterFile_;
+    std::pair<double, double> imageDimensions_;
+    double bcX_;
+    double bcY_;
+    double dDistance_;
+    double incidentEnergy_;
+    double incidentWavelength_;
+    double pixX_;
+    double pixY_;
+    EigerMonitorClient client_;
+    FrameBufferPool frames_;
+    std::unique_ptr<MetadataSource> metadata_;
+    AdxvSession adxv_;
+    std::chrono::milliseconds adxvReadyTimeout_;
+    SmvWriter writer_;
+    bool adaptiveDepth_;
+    bool lastFits16_;
+    std::string cbfDirectory_;
+    CbfWriter cbf_;
+    uint32_t previewBin_;
+    BinMode previewMode_;
+    bool adxvPreview_;
+    std::unique_ptr<SmvWriter> preview_;
+    std::vector<uint32_t> previewPixels_;
+    bool previewFits16_;
+    std::string frameStatsFile_;
+    FrameStatsLevels frameStatsLevels_;
+    // Last frame's statistics for the stats export
+    std::atomic<uint64_t> lastTotalCounts_;
+    std::atomic<uint32_t> lastMaxCount_;
+    std::atomic<size_t> lastHotPixels_;
+    std::atomic<size_t> lastSaturatedPixels_;
+    std::unique_ptr<RadialIntegrator> radial_;
+    std::string radialProfileFile_;
+    RadialProfile profile_;
+    std::unique_ptr<RollingSum> rolling_;
+    std::unique_ptr<SmvWriter> sumWriter_;
+    std::vector<uint32_t> sumPixels_;
+    bool adxvSum_;
+    bool sumFits16_;
+    int64_t sumSeries_;
+    std::pair<uint32_t, uint32_t> sumOrigin_;
+    std::unique_ptr<SharedFramePublisher> shared_;
+    PixelRect roi_;
+    bool roiAroundBeam_;
+    // Beam center in detector pixels, set by the metadata stage for the decode stage
+    std::atomic<double> roiCenterX_;
+    std::atomic<double> roiCenterY_;
+    std::unique_ptr<CaptureWriter> capture_;
+    PollScheduler scheduler_;
+    // Detector status read in flight for the scheduler
+    std::future<CommandResponse> detectorState_;
+    // Shared by the per-frame kernels, e.g. stream decompression
+    ThreadPool pool_;
+
+    // Pipeline stages: fetch -> decode/dedupe -> metadata merge -> write, then
+    // the ADXV session coalesces notifications on its own thread
+    std::atomic<bool> running_;
+    // In catch-up mode every frame is processed, otherwise the oldest are dropped
+    bool lossless_;
+    std::unique_ptr<CatchUpFetcher> catchUp_;
+    std::unique_ptr<EigerStreamReceiver> stream_;
+    std::unique_ptr<CaptureReplayer> replay_;
+    BoundedQueue<FrameHandle> received_;
+    BoundedQueue<PipelineFrame> decoded_;
+    BoundedQueue<PipelineFrame> merged_;
+    std::atomic<size_t> fetched_;
+    std::atomic<size_t> duplicates_;
+    std::atomic<size_t> failed_;
+    std::atomic<size_t> bytesReceived_;
+    std::atomic<size_t> written_;
+    // Frames the write stage is done with, after every step
+    std::atomic<size_t> finished_;
+    std::atomic<size_t> narrowed_;
+    std::atomic<size_t> archived_;
+    std::atomic<size_t> captured_;
+    // Time per frame in each stage; transfer is split into waiting for the
+    // first byte and receiving the body
+    LatencyHistogram transferWait_;
+    LatencyHistogram transferBody_;
+    LatencyHistogram dedupeTime_;
+    LatencyHistogram decodeTime_;
+    LatencyHistogram metadataTime_;
+    LatencyHistogram writeTime_;
+    LatencyHistogram archiveTime_;
+    LatencyHistogram previewTime_;
+    LatencyHistogram frameStatsTime_;
+    LatencyHistogram radialTime_;
+    LatencyHistogram sumTime_;
+    LatencyHistogram shareTime_;
+    LatencyHistogram captureTime_;
+    // From submit() until the frame is published for ADXV
+    LatencyHistogram pipelineTime_;
+    std::unique_ptr<StatsTextfile> statsFile_;
+    std::chrono::steady_clock::time_point lastStats_;
+    size_t lastStatsBytes_;
+    std::clock_t lastStatsCpu_;
+    // Time to first frame is counted from construction
+    std::chrono::steady_clock::time_point created_;
+    bool warmedUp_;
+    double warmUpSeconds_;
+    std::atomic<double> firstFrameSeconds_;
+    std::vector<std::thread> stages_;
+
+    static DetectorConfig defaultConfig(const std::string &ip, int port, const std::string &name) {
+        DetectorConfig config;
+        config.ip = ip;
+        config.port = port;
+        config.name = name;
+        return config;
+    }
+
+public:
+    MonitorReceiver(const std::string &ip, int port = 80, const std::string &name = "")
+        : MonitorReceiver(defaultConfig(ip, port, name)) {}
+
+    // Metadata comes from the configured Tango device unless a source is given
+    explicit MonitorReceiver(const DetectorConfig &config,
+                             std::unique_ptr<MetadataSource> metadata = nullptr)
+        : ip_(config.ip), port_(config.port),
+          name_(config.name.empty() ? "EIGER_" + config.ip + "_" + std::to_string(config.port)
+                                    : config.name),
+          imageFilename_(config.imageFilename),
+          beamCenterFile_(config.beamCenterFile), imageDimensions_(4148, 4362),
+          client_(config.ip, config.port),
+          // One buffer per stage plus queued frames; fetch waits when all are in flight
+          frames_(4, 4148 * 4362 * sizeof(uint32_t) + 4096),
+          metadata_(metadata ? std::move(metadata)
+                    : !config.replayFile.empty()
+                        ? std::unique_ptr<MetadataSource>(new RecordedMetadataSource())
+                        : std::unique_ptr<MetadataSource>(new TangoMetadataCache(config.tangoDevice))),
+          adxv_(config.adxvHost, config.adxvPort, config.adxvMinInterval),
+          adxvReadyTimeout_(config.adxvReadyTimeout),
+          writer_(imageFilename_), adaptiveDepth_(config.adaptiveDepth),
+          lastFits16_(true),
+          cbfDirectory_(config.cbfDirectory), previewBin_(config.previewBin),
+          previewMode_(config.previewMode), adxvPreview_(config.adxvPreview && config.previewBin > 1),
+          previewFits16_(true), frameStatsFile_(config.frameStatsFile),
+          frameStatsLevels_(config.frameStatsLevels), lastTotalCounts_(0), lastMaxCount_(0),
+          lastHotPixels_(0), lastSaturatedPixels_(0),
+          radialProfileFile_(config.radialProfileFile),
+          adxvSum_(config.adxvSum && config.sumFrames > 1), sumFits16_(true), sumSeries_(-1),
+          sumOrigin_(0, 0),
+          roi_(config.roi), roiAroundBeam_(config.roiAroundBeam),
+          roiCenterX_(imageDimensions_.first / 2), roiCenterY_(imageDimensions_.second / 2),
+          scheduler_(config.pollMode),
+          running_(false), lossless_(config.catchUp || (!config.replayFile.empty() && config.replayFast)),
+          received_(2), decoded_(1), merged_(1),
+          fetched_(0), duplicates_(0), failed_(0), bytesReceived_(0), written_(0), finished_(0),
+          narrowed_(0), archived_(0), captured_(0),
+          lastStatsBytes_(0), lastStatsCpu_(0), created_(std::chrono::steady_clock::now()),
+          warmedUp_(false), warmUpSeconds_(0), firstFrameSeconds_(0) {
+        // Initialize other attributes
+        TIFFSetWarningHandler(tiffErrorHandler); // Set custom TIFF error handler
+        client_.setTransferHistograms(&transferWait_, &transferBody_);
+        adxv_.onFirstSend([this](std::chrono::steady_clock::time_point sent) {
+            firstFrameSeconds_ = std::chrono::duration<double>(sent - created_).count();
+            std::cout << "First frame of " << name_ << " displayed " << firstFrameSeconds_ * 1e3
+                      << " ms after startup (warm-up " << warmUpSeconds_ * 1e3 << " ms)"
+                      << std::endl;
+        });
+        if (!config.statsFile.empty()) {
+            statsFile_.reset(new StatsTextfile(config.statsFile, config.statsInterval,
+                                               [this](std::ostream &out) { writeStats(out); }));
+        }
+        if (previewBin_ > 1) {
+            preview_.reset(new SmvWriter(config.previewFilename));
+        }
+        if (config.sumFrames > 1) {
+            // The ring is sized for the full frame up front; other sizes
+            // reallocate it once
+            rolling_.reset(new RollingSum(config.sumFrames,
+                                          size_t(imageDimensions_.first) * imageDimensions_.second));
+            sumWriter_.reset(new SmvWriter(config.sumFilename));
+        }
+        if (!config.captureFile.empty()) {
+            capture_.reset(new CaptureWriter(config.captureFile));
+        }
+        if (!config.replayFile.empty()) {
+            replay_.reset(new CaptureReplayer(config.replayFile, *this, !config.replayFast));
+        }
+        if (!config.sharedMemoryName.empty()) {
+            shared_.reset(new SharedFramePublisher(
+                config.sharedMemoryName, config.sharedMemorySlots,
+                uint64_t(imageDimensions_.first) * imageDimensions_.second));
+        }
+        if (config.radialBins > 0) {
+            radial_.reset(new RadialIntegrator(config.radialBins, config.radialUnit));
+        }
+        if (config.catchUp) {
+            catchUp_.reset(new CatchUpFetcher(client_, *this, config.catchUpConnections,
+                                              config.monitorBufferSize));
+        }
+        if (config.stream) {
+            stream_.reset(new EigerStreamReceiver(
+                "tcp://" + config.ip + ":" + std::to_string(config.streamPort), *this, pool_));
+        }
+    }
+
+    ~MonitorReceiver() {
+        stop();
+        join();
+    }
+
+    const std::string &name() const override { return name_; }
+
+    EigerMonitorClient &client() { return client_; }
+
+    PollScheduler &scheduler() { return scheduler_; }
+
+    FrameHandle tryAcquireFrame() override { return frames_.tryAcquire(); }
+
+    // Entry point of the pipeline for frames fetched outside of run()
+    void submit(FrameHandle frame) override {
+        ++fetched_;
+        bytesReceived_ += frame->size();
+        frame->received = std::chrono::steady_clock::now();
+        forward(received_, std::move(frame));
+    }
+
+    // Region of interest of the next frame, empty for the whole frame
+    PixelRect roi() const {
+        PixelRect rect = roi_;
+        if (roiAroundBeam_ && !rect.empty()) {
+            rect.x = static_cast<uint32_t>(std::max(0.0, roiCenterX_.load() - rect.width / 2.0));
+            rect.y = static_cast<uint32_t>(std::max(0.0, roiCenterY_.load() - rect.height / 2.0));
+        }
+        return rect;
+    }
+
+    bool decodeImage(const FrameBuffer &frame, TiffImage &image) {
+        PixelRect rect = roi();
+        if (frame.layout.format == FrameFormat::RawUInt32) {
+            // Already decoded by the stream receiver, just view the pixels
+            image.width = frame.layout.width;
+            image.height = frame.layout.height;
+            image.pixelSizeX = frame.layout.pixelSizeX;
+            image.pixelSizeY = frame.layout.pixelSizeY;
+            image.originX = 0;
+            image.originY = 0;
+            image.pixels = reinterpret_cast<const uint32_t *>(frame.data());
+            image.zeroCopy = true;
+            image.storage.clear();
+            if (frame.size() < image.pixelCount() * sizeof(uint32_t)) {
+                return false;
+            }
+            rect = rect.empty() ? rect : rect.fit(image.width, image.height);
+            if (!rect.empty() && !rect.covers(image.width, image.height)) {
+                TiffMemoryReader::crop(image.pixels, image.width, rect, image);
+            }
+            return true;
+        }
+        // Decode the TIFF straight from the received buffer
+        if (!TiffMemoryReader::decode(frame.data(), frame.size(), image, rect)) {
+            return false;
+        }
+        frames_.setBufferSize(frame.size());
+        return true;
+    }
+
+    // Returns the file to show in ADXV
+    std::string writeImage(const PipelineFrame &frame) {
+        const TiffImage &image = frame.image;
+        const FrameMetadata &metadata = frame.metadata;
+        uint32_t width = image.width, height = image.height;
+        imageDimensions_ = {width, height};
+
+        double pixelSizeX = image.pixelSizeX, pixelSizeY = image.pixelSizeY;
+        pixX_ = pixelSizeX;
+        pixY_ = pixelSizeY;
+
+        // Write the beam center file
+        writeBeamCenterFile(metadata.bcX, metadata.bcY);
+
+        SmvHeader header;
+        header.width = width;
+        header.height = height;
+        header.pixelSize = pixelSizeX;
+        header.beamCenterX = metadata.bcX * pixelSizeX;
+        header.beamCenterY = metadata.bcY * pixelSizeY;
+        header.distance = metadata.dDistance * 1000;
+        header.wavelength = metadata.incidentWavelength;
+        if (!roi_.empty()) {
+            header.extra.push_back({"ROI", std::to_string(image.originX) + "," +
+                                               std::to_string(image.originY) + "," +
+                                               std::to_string(width) + "," +
+                                               std::to_string(height)});
+        }
+        if (writePixels(writer_, image.pixels, image.pixelCount(), lastFits16_, header)) {
+            ++narrowed_;
+        }
+        writer_.setHeader(header);
+
+        return writer_.publish();
+    }
+
+    // Copies the pixels straight into the writer's next mapped file,
+    // halving the bytes written when no count needs more than 16 bits. True if
+    // the pixels were written as uint16.
+    bool writePixels(SmvWriter &writer, const uint32_t *pixels, size_t count, bool &lastFits16,
+                     SmvHeader &header) {
+        bool narrowed = false;
+        if (adaptiveDepth_) {
+            // Narrowing optimistically costs one pass like the plain copy; after
+            // a frame that did not fit, the next one is scanned first instead
+            if (lastFits16 || pixels::scan(pixels, count, &pool_).fits16()) {
+                uint8_t *out = writer.beginFrame(count * sizeof(uint16_t));
+                narrowed = pixels::narrow(pixels, reinterpret_cast<uint16_t *>(out), count,
+                                          &pool_).fits16();
+            }
+            lastFits16 = narrowed;
+        }
+        if (narrowed) {
+            header.type = "unsigned_short";
+        } else {
+            size_t pixelBytes = count * sizeof(uint32_t);
+            std::memcpy(writer.beginFrame(pixelBytes), pixels, pixelBytes);
+        }
+        return narrowed;
+    }
+
+    // Writes the frame binned by previewBin_. The beam center stays put in
+    // mm while the pixels grow, so ADXV draws rings in the same place.
+    std::string writePreview(const PipelineFrame &frame) {
+        const TiffImage &image = frame.image;
+        uint32_t width = image.width / previewBin_, height = image.height / previewBin_;
+        previewPixels_.resize(size_t(width) * height);
+        binning::bin(image.pixels, image.width, image.height, previewBin_, previewMode_,
+                     previewPixels_.data(), &pool_);
+
+        SmvHeader header;
+        header.width = width;
+        header.height = height;
+        header.pixelSize = image.pixelSizeX * previewBin_;
+        header.beamCenterX = frame.metadata.bcX * image.pixelSizeX;
+        header.beamCenterY = frame.metadata.bcY * image.pixelSizeY;
+        header.distance = frame.metadata.dDistance * 1000;
+        header.wavelength = frame.metadata.incidentWavelength;
+        header.extra.push_back({"BIN", std::to_string(previewBin_) + "x" +
+                                           std::to_string(previewBin_)});
+        header.extra.push_back({"BIN_MODE", previewMode_ == BinMode::Sum ? "sum" : "max"});
+        writePixels(*preview_, previewPixels_.data(), previewPixels_.size(), previewFits16_,
+                    header);
+        preview_->setHeader(header);
+        return preview_->publish();
+    }
+
+    // Moves the rolling sum on by the frame and writes it, with the number of
+    // summed frames in the header
+    std::string writeSum(const PipelineFrame &frame) {
+        const TiffImage &image = frame.image;
+        size_t count = image.pixelCount();
+        int64_t series = frame.raw->validators.seriesId;
+        std::pair<uint32_t, uint32_t> origin(image.originX, image.originY);
+        if (count != rolling_->pixels() || (series >= 0 && series != sumSeries_) ||
+            origin != sumOrigin_) {
+            rolling_->resize(count);
+        }
+        sumSeries_ = series;
+        sumOrigin_ = origin;
+        sumPixels_.resize(count);
+        rolling_->add(image.pixels, sumPixels_.data(), &pool_);
+
+        SmvHeader header;
+        header.width = image.width;
+        header.height = image.height;
+        header.pixelSize = image.pixelSizeX;
+        header.beamCenterX = frame.metadata.bcX * image.pixelSizeX;
+        header.beamCenterY = frame.metadata.bcY * image.pixelSizeY;
+        header.distance = frame.metadata.dDistance * 1000;
+        header.wavelength = frame.metadata.incidentWavelength;
+        header.extra.push_back({"SUMMED_FRAMES", std::to_string(rolling_->frames())});
+        writePixels(*sumWriter_, sumPixels_.data(), count, sumFits16_, header);
+        sumWriter_->setHeader(header);
+        return sumWriter_->publish();
+    }
+
+    // Copies the decoded frame and its geometry into the shared memory ring
+    void shareImage(const PipelineFrame &frame) {
+        const TiffImage &image = frame.image;
+        shmframes::FrameInfo info = shmframes::FrameInfo();
+        info.seriesId = frame.raw->validators.seriesId;
+        info.imageId = frame.raw->validators.imageId;
+        info.width = image.width;
+        info.height = image.height;
+        info.pixelSizeX = image.pixelSizeX;
+        info.pixelSizeY = image.pixelSizeY;
+        info.beamCenterX = frame.metadata.bcX;
+        info.beamCenterY = frame.metadata.bcY;
+        info.distance = frame.metadata.dDistance * 1000;
+        info.wavelength = frame.metadata.incidentWavelength;
+        shared_->publish(image.pixels, info, &pool_);
+    }
+
+    // Appends the frame as received with the metadata it came with, or else
+    // the source's snapshot of the moment
+    void captureFrame(const FrameBuffer &frame) {
+        capture_->append(frame, frame.hasMetadata ? frame.metadata : metadata_->snapshot());
+        ++captured_;
+    }
+
+    // Saves the frame as <cbfDirectory>/<name>_<series>_<image>.cbf, numbered
+    // by the frames written so far when the detector sent no ids
+    void archiveImage(const PipelineFrame &frame) {
+        const FrameValidators &ids = frame.raw->validators;
+        std::string path = cbfDirectory_ + "/" + name_ + "_";
+        if (ids.seriesId >= 0 && ids.imageId >= 0) {
+            path += std::to_string(ids.seriesId) + "_" + std::to_string(ids.imageId);
+        } else {
+            path += std::to_string(written_.load());
+        }
+        path += ".cbf";
+
+        const TiffImage &image = frame.image;
+        CbfHeader header;
+        header.width = image.width;
+        header.height = image.height;
+        header.pixelSizeX = image.pixelSizeX;
+        header.pixelSizeY = image.pixelSizeY;
+        header.beamCenterX = frame.metadata.bcX;
+        header.beamCenterY = frame.metadata.bcY;
+        header.distance = frame.metadata.dDistance * 1000;
+        header.wavelength = frame.metadata.incidentWavelength;
+        cbf_.write(path, header, image.pixels);
+        ++archived_;
+    }
+
+    void writeBeamCenterFile(double beamX, double beamY) {
+        std::ofstream file(beamCenterFile_);
+        if (file.is_open()) {
+            file << beamX << " " << beamY << " " << imageDimensions_.first << " "
+                 << imageDimensions_.second;
+            file.close();
+        } else {
+            throw std::runtime_error("Unable to open beam center file for writing.");
+        }
+    }
+
+    void enableMonitor() {
+        // Logging
+        std::cout << "Enabling monitor on " << ip_ << std::endl;
+
+        try {
+            // Call the setMonitorConfig method of the client
+            client_.setMonitorConfig("mode", "enabled");
+            std::cerr << "Monitor on " << ip_ << ":" << port_ << " enabled" << std::endl;
+        } catch (const std::exception &e) {
+            // Error handling
+            std::cerr << "Error enabling monitor on " << ip_ << ": " << e.what() << std::endl;
+            // You can handle the error as needed, such as throwing an exception
+            throw;
+        }
+    }
+
+    void enableStream() {
+        std::cout << "Enabling stream on " << ip_ << std::endl;
+        try {
+            client_.setStreamConfig("mode", "{\"value\": \"enabled\"}");
+        } catch (const std::exception &e) {
+            // The stream may already be enabled from the detector control system
+            std::cerr << "Error enabling stream on " << ip_ << ": " << e.what() << std::endl;
+        }
+    }
+
+    FrameHandle receive() {
+        // Logging
+        // std::cerr << "Monitor receiver " << name_ << " polling " << ip_ << ":" << port_ << std::endl;
+
+        try {
+            // Receive the frame straight into a pooled buffer
+            FrameHandle frame = frames_.acquire();
+            client_.monitorImages(scheduler_.endpoint(), *frame);
+            return frame;
+        } catch (const RequestTimeout &) {
+            throw;
+        } catch (const std::exception &e) {
+            // Error handling
+            std::cerr << "Monitor " << name_ << " error: " << e.what() << std::endl;
+            // You can handle the error as needed, such as throwing an exception
+            throw;
+        }
+    }
+
+    FrameHandle processFrames(FrameHandle frame) {
+        return frame;
+    }
+
+    void showImageInADXV(const std::string &filename) {
+        // Hands the file to the persistent session, which never blocks
+        adxv_.loadImage(filename);
+    }
+
+    // Polls fast while the detector acquires, otherwise as the scheduler allows.
+    // The status read runs beside the image fetch and is picked up here once
+    // it has completed, so a slow answer never holds up a frame.
+    void pollDetectorState() {
+        if (detectorState_.valid()) {
+            if (detectorState_.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                return;
+            }
+            CommandResponse response = detectorState_.get();
+            scheduler_.setAcquiring(response.ok() &&
+                                    EigerMonitorClient::_jsonValue(response.body) == "acquire");
+        }
+        if (scheduler_.statusDue()) {
+            detectorState_ = client_.detectorStateAsync();
+        }
+    }
+
+    void fetchStage() {
+        while (running_) {
+            pollDetectorState();
+            std::this_thread::sleep_for(scheduler_.nextDelay());
+            client_.setTimeouts(scheduler_.waitTimeout().count(),
+                                scheduler_.transferTimeout().count());
+            try {
+                auto frame = receive();
+                scheduler_.longPollSucceeded();
+                if (!frame->empty()) {
+                    submit(std::move(frame));
+                }
+            } catch (const RequestTimeout &) {
+                // No new image within the long poll timeout
+            } catch (const std::exception &e) {
+                std::cerr << "Error in monitor " << name_ << ": " << e.what() << std::endl;
+                if (scheduler_.longPollFailed()) {
+                    std::cerr << "Monitor " << name_
+                              << " does not support long polling, using adaptive polling" << std::endl;
+                }
+            }
+        }
+    }
+
+    template <typename T>
+    void forward(BoundedQueue<T> &queue, T value) {
+        if (lossless_) {
+            queue.pushWait(std::move(value), running_);
+        } else {
+            queue.pushDropOldest(std::move(value));
+        }
+    }
+
+    // With a region of interest, frames the detector ids or HTTP validators
+    // identify are still rejected before decode. Otherwise the frame is
+    // cropped first, as that is cheap, so the content hash only covers the
+    // region.
+    void decodeRegion(FrameHandle frame) {
+        FrameChange change;
+        {
+            ScopedTimer timer(dedupeTime_);
+            change = changes_.compare(*frame);
+        }
+        if (change == FrameChange::Same) {
+            scheduler_.frameSeen(false);
+            ++duplicates_;
+            return;
+        }
+        PipelineFrame decoded;
+        decoded.raw = processFrames(std::move(frame));
+        bool ok;
+        {
+            ScopedTimer timer(decodeTime_);
+            ok = decodeImage(*decoded.raw, decoded.image);
+        }
+        if (!ok) {
+            ++failed_;
+            return;
+        }
+        const uint8_t *content = reinterpret_cast<const uint8_t *>(decoded.image.pixels);
+        size_t size = decoded.image.pixelCount() * sizeof(uint32_t);
+        bool changed = true;
+        if (change == FrameChange::Unknown) {
+            ScopedTimer timer(dedupeTime_);
+            changed = changes_.changed(*decoded.raw, content, size);
+        }
+        scheduler_.frameSeen(changed);
+        if (!changed) {
+            ++duplicates_;
+            return;
+        }
+        decoded.accepted = changes_.accept(*decoded.raw, content, size);
+        forward(decoded_, std::move(decoded));
+    }
+
+    void decodeStage() {
+        for (;;) {
+            FrameHandle frame;
+            if (!received_.waitPop(frame, running_)) {
+                return;
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            if (now - lastStats_ > std::chrono::seconds(10)) {
+                printPipelineStats();
+                lastStats_ = now;
+            }
+            // Every response is captured, duplicates and frames that fail
+            // later included, as they load the pipeline as much on replay
+            if (capture_) {
+                try {
+                    ScopedTimer timer(captureTime_);
+                    captureFrame(*frame);
+                } catch (Tango::DevFailed &e) {
+                    std::cerr << "Error capturing " << name_ << ": no metadata" << std::endl;
+                    Tango::Except::print_exception(e);
+                } catch (const std::exception &e) {
+                    std::cerr << "Error capturing " << name_ << ": " << e.what() << std::endl;
+                }
+            }
+            if (!roi_.empty()) {
+                decodeRegion(std::move(frame));
+                continue;
+            }
+            // Duplicate frames are rejected before they are decoded
+            bool changed;
+            {
+                ScopedTimer timer(dedupeTime_);
+                changed = changes_.changed(*frame);
+            }
+            scheduler_.frameSeen(changed);
+            if (!changed) {
+                ++duplicates_;
+                continue;
+            }
+            PipelineFrame decoded;
+            decoded.raw = processFrames(std::move(frame));
+            bool ok;
+            {
+                ScopedTimer timer(decodeTime_);
+                ok = decodeImage(*decoded.raw, decoded.image);
+            }
+            if (!ok) {
+                ++failed_;
+                continue;
+            }
+            decoded.accepted = changes_.accept(*decoded.raw);
+            forward(decoded_, std::move(decoded));
+        }
+    }
+
+    void metadataStage() {
+        for (;;) {
+            PipelineFrame frame;
+            if (!decoded_.waitPop(frame, running_)) {
+                return;
+            }
+            try {
+                // Only copies the snapshot unless the device has no change events
+                ScopedTimer timer(metadataTime_);
+                frame.metadata = frame.raw->hasMetadata ? frame.raw->metadata
+                                                        : metadata_->snapshot();
+                // The region follows the beam; everything written after this
+                // sees the beam center relative to the cropped image
+                roiCenterX_ = frame.metadata.bcX;
+                roiCenterY_ = frame.metadata.bcY;
+                frame.metadata.bcX -= frame.image.originX;
+                frame.metadata.bcY -= frame.image.originY;
+            } catch (Tango::DevFailed &e) {
+                Tango::Except::print_exception(e);
+                changes_.rollback(frame.accepted);
+                ++failed_;
+                continue;
+            } catch (const std::exception &e) {
+                std::cerr << "Metadata " << name_ << " error: " << e.what() << std::endl;
+                changes_.rollback(frame.accepted);
+                ++failed_;
+                continue;
+            }
+            forward(merged_, std::move(frame));
+        }
+    }
+
+    // Writes the statistics of a frame as name=value lines next to the beam
+    // center file; the histogram lists lower bound:count of non-empty bins
+    void writeFrameStats(const PipelineFrame &frame, const FrameStats &stats) {
+        const FrameValidators &ids = frame.raw->validators;
+        std::string temporary = frameStatsFile_ + ".tmp";
+        {
+            std::ofstream file(temporary);
+            if (!file.is_open()) {
+                throw std::runtime_error("Unable to open frame statistics file for writing.");
+            }
+            file << "detector=" << name_ << "\nseries=" << ids.seriesId << "\nimage="
+                 << ids.imageId << "\nwidth=" << frame.image.width << "\nheight="
+                 << frame.image.height << "\npixels=" << stats.pixels << "\ngaps=" << stats.gaps
+                 << "\ntotal=" << stats.sum << "\nmean=" << stats.mean() << "\nmax=" << stats.max
+                 << "\nhot=" << stats.hot << "\nsaturated=" << stats.saturated
+                 << "\ncontrast_low=" << stats.contrastLow
+                 << "\ncontrast_high=" << stats.contrastHigh << "\nhistogram=";
+            const char *separator = "";
+            for (int bin = 0; bin < CountHistogram::kBins; ++bin) {
+                if (stats.histogram.counts[bin]) {
+                    file << separator << CountHistogram::lowerBound(bin) << ":"
+                         << stats.histogram.counts[bin];
+                    separator = " ";
+                }
+            }
+            file << "\n";
+        }
+        if (std::rename(temporary.c_str(), frameStatsFile_.c_str()) != 0) {
+            throw std::runtime_error("Unable to replace frame statistics file.");
+        }
+    }
+
+    void analyzeImage(const PipelineFrame &frame) {
+        FrameStats stats;
+        {
+            ScopedTimer timer(frameStatsTime_);
+            stats = framestats::compute(frame.image.pixels, frame.image.pixelCount(),
+                                        frameStatsLevels_, &pool_);
+        }
+        lastTotalCounts_ = stats.sum;
+        lastMaxCount_ = stats.max;
+        lastHotPixels_ = stats.hot;
+        lastSaturatedPixels_ = stats.saturated;
+        writeFrameStats(frame, stats);
+        std::cout << "Counts " << name_ << ": total " << stats.sum << ", max " << stats.max
+                  << ", hot " << stats.hot << ", saturated " << stats.saturated << ", contrast "
+                  << stats.contrastLow << "-" << stats.contrastHigh << std::endl;
+    }
+
+    // Writes the profile as position, mean intensity and pixel count columns
+    void writeRadialProfile(const PipelineFrame &frame) {
+        const FrameValidators &ids = frame.raw->validators;
+        std::string temporary = radialProfileFile_ + ".tmp";
+        {
+            std::ofstream file(temporary);
+            if (!file.is_open()) {
+                throw std::runtime_error("Unable to open radial profile file for writing.");
+            }
+            file << "# detector=" << name_ << " series=" << ids.seriesId << " image="
+                 << ids.imageId << "\n# "
+                 << (radial_->unit() == RadialUnit::Q ? "q_A^-1" : "2theta_deg")
+                 << " intensity pixels\n";
+            for (size_t bin = 0; bin < profile_.position.size(); ++bin) {
+                file << profile_.position[bin] << " " << profile_.intensity[bin] << " "
+                     << profile_.pixels[bin] << "\n";
+            }
+        }
+        if (std::rename(temporary.c_str(), radialProfileFile_.c_str()) != 0) {
+            throw std::runtime_error("Unable to replace radial profile file.");
+        }
+    }
+
+    void integrateImage(const PipelineFrame &frame) {
+        const TiffImage &image = frame.image;
+        RadialGeometry geometry;
+        geometry.width = image.width;
+        geometry.height = image.height;
+        geometry.pixelSizeX = image.pixelSizeX;
+        geometry.pixelSizeY = image.pixelSizeY;
+        geometry.beamCenterX = frame.metadata.bcX;
+        geometry.beamCenterY = frame.metadata.bcY;
+        geometry.distance = frame.metadata.dDistance * 1000;
+        geometry.wavelength = frame.metadata.incidentWavelength;
+        {
+            ScopedTimer timer(radialTime_);
+            // The lookup table is only rebuilt when the beam center, distance
+            // or wavelength move
+            if (radial_->configure(geometry, &pool_)) {
+                std::cout << "Radial bins of " << name_ << " rebuilt for beam center "
+                          << geometry.beamCenterX << ", " << geometry.beamCenterY
+                          << " and distance " << geometry.distance << " mm" << std::endl;
+            }
+            radial_->integrate(image.pixels, profile_, &pool_);
+        }
+        writeRadialProfile(frame);
+    }
+
+    // Writes the rolling sum, leaving path empty if that failed
+    void sumImage(const PipelineFrame &frame, std::string &path) {
+        try {
+            ScopedTimer timer(sumTime_);
+            path = writeSum(frame);
+        } catch (const std::exception &e) {
+            std::cerr << "Error in rolling sum " << name_ << ": " << e.what() << std::endl;
+            path.clear();
+        }
+    }
+
+    // Writes the preview, leaving path empty if that failed
+    void previewImage(const PipelineFrame &frame, std::string &path) {
+        try {
+            ScopedTimer timer(previewTime_);
+            path = writePreview(frame);
+        } catch (const std::exception &e) {
+            std::cerr << "Error in preview " << name_ << ": " << e.what() << std::endl;
+            path.clear();
+        }
+    }
+
+    void writeStage() {
+        for (;;) {
+            PipelineFrame frame;
+            if (!merged_.waitPop(frame, running_)) {
+                return;
+            }
+            std::string filename;
+            try {
+                ScopedTimer timer(writeTime_);
+                filename = writeImage(frame);
+            } catch (const std::exception &e) {
+                std::cerr << "Error in monitor " << name_ << ": " << e.what() << std::endl;
+                changes_.rollback(frame.accepted);
+                ++failed_;
+                continue;
+            }
+            // A preview or sum shown in ADXV is written before the
+            // notification, any other one after it
+            std::string summed, preview;
+            if (adxvSum_) {
+                sumImage(frame, summed);
+            }
+            if (adxvPreview_) {
+                previewImage(frame, preview);
+            }
+            ++written_;
+            pipelineTime_.record(std::chrono::steady_clock::now() - frame.raw->received);
+            std::cout << "Image received from " << name_ << " and saved as "
+                      << filename << std::endl;
+            showImageInADXV(!preview.empty() ? preview : !summed.empty() ? summed : filename);
+            if (shared_) {
+                try {
+                    ScopedTimer timer(shareTime_);
+                    shareImage(frame);
+                } catch (const std::exception &e) {
+                    std::cerr << "Error in shared memory " << name_ << ": " << e.what()
+                              << std::endl;
+                }
+            }
+            if (rolling_ && !adxvSum_) {
+                sumImage(frame, summed);
+            }
+            if (preview_ && !adxvPreview_) {
+                previewImage(frame, preview);
+            }
+            if (!frameStatsFile_.empty()) {
+                try {
+                    analyzeImage(frame);
+                } catch (const std::exception &e) {
+                    std::cerr << "Error in statistics " << name_ << ": " << e.what() << std::endl;
+                }
+            }
+            if (radial_) {
+                try {
+                    integrateImage(frame);
+                } catch (const std::exception &e) {
+                    std::cerr << "Error in radial integration " << name_ << ": " << e.what()
+                              << std::endl;
+                }
+            }
+
+            // Archiving is off the display path; ADXV has been notified already
+            if (!cbfDirectory_.empty()) {
+                try {
+                    ScopedTimer timer(archiveTime_);
+                    archiveImage(frame);
+                } catch (const std::exception &e) {
+                    std::cerr << "Error archiving " << name_ << ": " << e.what() << std::endl;
+                }
+            }
+            ++finished_;
+        }
+    }
+
+    // Queue depth is sampled since the last report; dropped frames are totals
+    template <typename T>
+    static void printQueueStats(const char *stage, BoundedQueue<T> &queue) {
+        std::cout << " " << stage << " " << queue.size() << "/" << queue.capacity()
+                  << " (max " << queue.maxDepth() << ", dropped " << queue.dropped() << ")";
+        queue.resetMaxDepth();
+    }
+
+    void printPipelineStats() {
+        // Receive bandwidth and process CPU since the last report
+        auto now = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(now - lastStats_).count();
+        size_t bytes = bytesReceived_;
+        std::clock_t cpu = std::clock();
+        double megabytesPerSecond = (bytes - lastStatsBytes_) / seconds / 1e6;
+        double cpuPercent = 100.0 * (cpu - lastStatsCpu_) / CLOCKS_PER_SEC / seconds;
+        lastStatsBytes_ = bytes;
+        lastStatsCpu_ = cpu;
+
+        std::cout << "Pipeline " << name_ << ": " << megabytesPerSecond << " MB/s, CPU "
+                  << cpuPercent << "%, fetched " << fetched_ << ", duplicates "
+                  << duplicates_ << ", failed " << failed_ << "; ADXV sent " << adxv_.sent()
+                  << ", coalesced " << adxv_.coalesced() << ", reconnects " << adxv_.reconnects()
+                  << "; queues";
+        printQueueStats("decode", received_);
+        printQueueStats("metadata", decoded_);
+        printQueueStats("write", merged_);
+        std::cout << std::endl;
+
+        std::cout << "Stages " << name_ << " p50/p99 ms:";
+        printStageStats("wait", transferWait_);
+        printStageStats("transfer", transferBody_);
+        printStageStats("dedupe", dedupeTime_);
+        printStageStats("decode", decodeTime_);
+        printStageStats("metadata", metadataTime_);
+        printStageStats("write", writeTime_);
+        if (shared_) {
+            printStageStats("shm", shareTime_);
+        }
+        if (rolling_) {
+            printStageStats("sum", sumTime_);
+        }
+        if (preview_) {
+            printStageStats("preview", previewTime_);
+        }
+        if (!frameStatsFile_.empty()) {
+            printStageStats("statistics", frameStatsTime_);
+        }
+        if (radial_) {
+            printStageStats("radial", radialTime_);
+        }
+        if (!cbfDirectory_.empty()) {
+            printStageStats("archive", archiveTime_);
+        }
+        if (capture_) {
+            printStageStats("capture", captureTime_);
+        }
+        printStageStats("adxv", adxv_.sendTime());
+        printStageStats("pipeline", pipelineTime_);
+        std::cout << std::endl;
+    }
+
+    static void printStageStats(const char *stage, const LatencyHistogram &histogram) {
+        std::cout << " " << stage << " " << histogram.quantileNs(0.5) / 1e6 << "/"
+                  << histogram.quantileNs(0.99) / 1e6;
+    }
+
+    // All counters and stage histograms in the Prometheus text format
+    void writeStats(std::ostream &out) {
+        PrometheusWriter writer(out, "detector=\"" + name_ + "\"");
+        writer.counter("yamone_frames_fetched_total", "Frames received from the detector", fetched_);
+        writer.counter("yamone_bytes_received_total", "Bytes received from the detector",
+                       bytesReceived_);
+        writer.counter("yamone_frames_duplicate_total", "Frames skipped as unchanged", duplicates_);
+        writer.counter("yamone_frames_failed_total", "Frames that failed a pipeline stage",
+                       failed_);
+        writer.counter("yamone_frames_dropped_total", "Frames dropped by full pipeline queues",
+                       received_.dropped() + decoded_.dropped() + merged_.dropped());
+        writer.counter("yamone_frames_written_total", "Frames written for ADXV", written_);
+        writer.counter("yamone_frames_narrowed_total", "Frames written as 16-bit SMV",
+                       narrowed_);
+        writer.counter("yamone_frames_archived_total", "Frames archived as CBF", archived_);
+        writer.counter("yamone_frames_captured_total", "Frames appended to the capture file",
+                       captured_);
+        writer.counter("yamone_adxv_loads_sent_total", "load_image requests sent to ADXV",
+                       adxv_.sent());
+        writer.counter("yamone_adxv_loads_coalesced_total",
+                       "load_image requests replaced by a newer one", adxv_.coalesced());
+        writer.counter("yamone_adxv_reconnects_total", "Connections made to ADXV",
+                       adxv_.reconnects());
+        writer.gauge("yamone_startup_seconds", "Time spent warming up connections and buffers",
+                     warmUpSeconds_);
+        if (firstFrameSeconds_ > 0) {
+            writer.gauge("yamone_first_frame_seconds",
+                         "Time from startup until ADXV was sent the first frame", firstFrameSeconds_);
+        }
+        if (stream_) {
+            writer.counter("yamone_stream_frames_dropped_total",
+                           "Stream frames dropped without a free buffer", stream_->dropped());
+        }
+
+        if (!frameStatsFile_.empty()) {
+            writer.gauge("yamone_frame_total_counts", "Counts in the last frame outside gaps",
+                         lastTotalCounts_);
+            writer.gauge("yamone_frame_max_count", "Largest count in the last frame",
+                         lastMaxCount_);
+            writer.gauge("yamone_frame_hot_pixels", "Pixels above the hot level in the last frame",
+                         lastHotPixels_);
+            writer.gauge("yamone_frame_saturated_pixels",
+                         "Pixels at the saturation level in the last frame", lastSaturatedPixels_);
+        }
+        writer.gauge("yamone_decode_queue_depth", "Frames waiting to be decoded", received_.size());
+        writer.gauge("yamone_metadata_queue_depth", "Frames waiting for metadata", decoded_.size());
+        writer.gauge("yamone_write_queue_depth", "Frames waiting to be written", merged_.size());
+
+        writer.histogramHeader("yamone_stage_seconds", "Time spent per frame in each stage");
+        writer.histogram("yamone_stage_seconds", "transfer_wait", transferWait_);
+        writer.histogram("yamone_stage_seconds", "transfer_body", transferBody_);
+        if (stream_) {
+            writer.histogram("yamone_stage_seconds", "stream_decode", stream_->decodeTime());
+        }
+        writer.histogram("yamone_stage_seconds", "dedupe", dedupeTime_);
+        writer.histogram("yamone_stage_seconds", "decode", decodeTime_);
+        writer.histogram("yamone_stage_seconds", "metadata", metadataTime_);
+        writer.histogram("yamone_stage_seconds", "write", writeTime_);
+        if (shared_) {
+            writer.histogram("yamone_stage_seconds", "shared_memory", shareTime_);
+        }
+        if (rolling_) {
+            writer.histogram("yamone_stage_seconds", "sum", sumTime_);
+        }
+        if (preview_) {
+            writer.histogram("yamone_stage_seconds", "preview", previewTime_);
+        }
+        if (!frameStatsFile_.empty()) {
+            writer.histogram("yamone_stage_seconds", "statistics", frameStatsTime_);
+        }
+        if (radial_) {
+            writer.histogram("yamone_stage_seconds", "radial", radialTime_);
+        }
+        if (!cbfDirectory_.empty()) {
+            writer.histogram("yamone_stage_seconds", "archive", archiveTime_);
+        }
+        if (capture_) {
+            writer.histogram("yamone_stage_seconds", "capture", captureTime_);
+        }
+        writer.histogram("yamone_stage_seconds", "adxv_send", adxv_.sendTime());
+        writer.histogram("yamone_stage_seconds", "pipeline", pipelineTime_);
+    }
+
+    void run() {
+        // TODO: Check why it is going to the segfault.
+        // enableMonitor();
+        start();
+        if (replay_) {
+            replay_->run();
+            waitForPipeline();
+            stop();
+        } else if (stream_) {
+            enableStream();
+            stream_->run();
+        } else if (catchUp_) {
+            catchUp_->run();
+        } else {
+            fetchStage();
+        }
+        join();
+        if (replay_) {
+            // Only now has every stage finished with the last frame
+            printPipelineStats();
+        }
+    }
+
+    // Connects to ADXV, the detector and the metadata source and faults in the
+    // frame buffers, all at once, so none of it is left to the first frame.
+    // Nothing here is fatal: what fails is retried on the frame path as before.
+    void warmUp() {
+        if (warmedUp_) {
+            return;
+        }
+        warmedUp_ = true;
+        auto begin = std::chrono::steady_clock::now();
+        auto since = [begin]() {
+            return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin)
+                .count();
+        };
+        double adxvMs = -1, detectorMs = -1, metadataMs = -1;
+        std::vector<std::thread> steps;
+        if (adxvReadyTimeout_.count() > 0) {
+            steps.emplace_back([&]() {
+                if (adxv_.waitReady(adxvReadyTimeout_)) {
+                    adxvMs = since();
+                } else {
+                    std::cerr << "ADXV for " << name_ << " not ready after "
+                              << adxvReadyTimeout_.count()
+                              << " ms, images are sent once it accepts connections" << std::endl;
+                }
+            });
+        }
+        steps.emplace_back([&]() {
+            size_t bufferSize = frames_.bufferSize();
+            if (!replay_) {
+                try {
+                    auto pixels = client_.preconnect();
+                    detectorMs = since();
+                    if (pixels.first && pixels.second) {
+                        bufferSize = size_t(pixels.first) * pixels.second * sizeof(uint32_t) + 4096;
+                    }
+                } catch (const std::exception &e) {
+                    std::cerr << "Unable to reach detector " << name_ << ": " << e.what() << std::endl;
+                }
+            }
+            frames_.prefault(bufferSize);
+        });
+        steps.emplace_back([&]() {
+            try {
+                metadata_->connect();
+                metadataMs = since();
+            } catch (Tango::DevFailed &e) {
+                std::cerr << "Unable to connect to metadata source of " << name_ << std::endl;
+                Tango::Except::print_exception(e);
+            } catch (const std::exception &e) {
+                std::cerr << "Unable to connect to metadata source of " << name_ << ": "
+                          << e.what() << std::endl;
+            }
+        });
+        for (auto &step : steps) {
+            step.join();
+        }
+        warmUpSeconds_ = since() / 1e3;
+        auto ready = [](double ms) {
+            return ms < 0 ? std::string("not ready") : std::to_string(ms) + " ms";
+        };
+        std::cout << "Warm-up of " << name_ << " took " << warmUpSeconds_ * 1e3 << " ms: ADXV "
+                  << ready(adxvMs) << ", detector " << ready(detectorMs) << ", metadata "
+                  << ready(metadataMs) << ", " << frames_.bufferSize() / 1e6
+                  << " MB frame buffers" << std::endl;
+    }
+
+    // Starts every stage except fetch, for frames delivered through submit()
+    void start() {
+        warmUp();
+        running_ = true;
+        lastStats_ = std::chrono::steady_clock::now();
+        adxv_.start();
+        if (statsFile_) {
+            statsFile_->start();
+        }
+        stages_.emplace_back(&MonitorReceiver::decodeStage, this);
+        stages_.emplace_back(&MonitorReceiver::metadataStage, this);
+        stages_.emplace_back(&MonitorReceiver::writeStage, this);
+    }
+
+    // Waits until every submitted frame was through the write stage, skipped
+    // or dropped
+    void waitForPipeline() {
+        while (running_ && fetched_ > finished_ + duplicates_ + failed_ + received_.dropped() +
+                                          decoded_.dropped() + merged_.dropped()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    void stop() {
+        running_ = false;
+        if (replay_) {
+            replay_->stop();
+        }
+        if (catchUp_) {
+            catchUp_->stop();
+        }
+        if (stream_) {
+            stream_->stop();
+        }
+        if (statsFile_) {
+            statsFile_->stop();
+        }
+    }
+
+    void join() {
+        for (auto &stage : stages_) {
+            stage.join();
+        }
+        stages_.clear();
+    }
+};
+
+#endif
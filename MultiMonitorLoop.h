@@ -0,0 +1,196 @@
+#ifndef MULTI_MONITOR_LOOP_H
+#define MULTI_MONITOR_LOOP_H
+
+#include "EigerMonitorClient.h"
+#include "FrameSink.h"
+#include "PollScheduler.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <curl/curl.h>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Polls the monitor interfaces of several detectors from one thread through
+// curl_multi. Each detector keeps its own easy handle and transfer timeouts,
+// so a slow or dead detector only delays its own frames. Each detector's
+// status is read beside its frames through its client's command channel, so
+// it is polled fast while it acquires.
+class MultiMonitorLoop {
+private:
+  struct Detector {
+    EigerMonitorClient *client;
+    FrameSink *sink;
+    PollScheduler *scheduler;
+    FrameHandle frame;
+    CURL *handle = nullptr;
+    std::chrono::steady_clock::time_point nextStart;
+    std::chrono::milliseconds backoff{0};
+    std::future<CommandResponse> state;
+  };
+
+  CURLM *multi_;
+  std::vector<std::unique_ptr<Detector>> detectors_;
+  std::atomic<bool> running_;
+  long transferTimeoutMs_;
+  long connectTimeoutMs_;
+
+  void start(Detector &detector) {
+    detector.frame = detector.sink->tryAcquireFrame();
+    if (!detector.frame) {
+      // The pipeline still holds all buffers, try again shortly
+      detector.nextStart =
+          std::chrono::steady_clock::now() + std::chrono::milliseconds(5);
+      return;
+    }
+    std::string endpoint =
+        detector.scheduler ? detector.scheduler->endpoint() : "monitor";
+    long waitMs = detector.scheduler
+                      ? detector.scheduler->waitTimeout().count()
+                      : transferTimeoutMs_;
+    detector.handle = detector.client->prepareFrameRequest(
+        detector.client->monitorImagesUrl(endpoint), "tif", *detector.frame);
+    curl_easy_setopt(detector.handle, CURLOPT_PRIVATE, &detector);
+    detector.client->setTimeouts(waitMs, transferTimeoutMs_);
+    curl_easy_setopt(detector.handle, CURLOPT_CONNECTTIMEOUT_MS,
+                     connectTimeoutMs_);
+    curl_multi_add_handle(multi_, detector.handle);
+  }
+
+  // Picks up a completed status read and issues the next one when due; a
+  // detector that starts acquiring is polled again at once
+  void pollState(Detector &detector) {
+    PollScheduler *scheduler = detector.scheduler;
+    if (detector.state.valid()) {
+      if (detector.state.wait_for(std::chrono::seconds(0)) !=
+          std::future_status::ready) {
+        return;
+      }
+      CommandResponse response = detector.state.get();
+      bool acquiring = response.ok() &&
+                       EigerMonitorClient::_jsonValue(response.body) == "acquire";
+      if (acquiring && !scheduler->acquiring()) {
+        detector.nextStart = std::min(detector.nextStart,
+                                      std::chrono::steady_clock::now());
+      }
+      scheduler->setAcquiring(acquiring);
+    }
+    if (scheduler->statusDue()) {
+      detector.state = detector.client->detectorStateAsync();
+    }
+  }
+
+  void finish(Detector &detector, CURLcode result) {
+    long status = 0;
+    curl_easy_getinfo(detector.handle, CURLINFO_RESPONSE_CODE, &status);
+    curl_multi_remove_handle(multi_, detector.handle);
+    detector.client->finishFrameRequest();
+    detector.handle = nullptr;
+
+    if ((result == CURLE_OPERATION_TIMEDOUT && detector.frame->empty()) ||
+        status == 408) {
+      // No new image within the long poll timeout
+      detector.frame.reset();
+      return;
+    }
+    if (result != CURLE_OK || status >= 400) {
+      if (detector.scheduler && detector.scheduler->longPollFailed()) {
+        std::cerr << "Monitor " << detector.sink->name()
+                  << " does not support long polling, using adaptive polling"
+                  << std::endl;
+      }
+      std::cerr << "Monitor " << detector.sink->name() << " error: "
+                << (result != CURLE_OK ? curl_easy_strerror(result)
+                                       : "HTTP " + std::to_string(status))
+                << std::endl;
+      detector.frame.reset();
+      detector.backoff = std::min(
+          std::max(detector.backoff * 2, std::chrono::milliseconds(100)),
+          std::chrono::milliseconds(5000));
+      detector.nextStart = std::chrono::steady_clock::now() + detector.backoff;
+      return;
+    }
+
+    detector.backoff = std::chrono::milliseconds(0);
+    if (detector.scheduler) {
+      detector.scheduler->longPollSucceeded();
+      detector.nextStart =
+          std::chrono::steady_clock::now() + detector.scheduler->nextDelay();
+    }
+    if (!detector.frame->empty()) {
+      detector.sink->submit(std::move(detector.frame));
+    }
+    detector.frame.reset();
+  }
+
+public:
+  MultiMonitorLoop(long transferTimeoutMs = 60000, long connectTimeoutMs = 2000)
+      : multi_(curl_multi_init()), running_(false),
+        transferTimeoutMs_(transferTimeoutMs),
+        connectTimeoutMs_(connectTimeoutMs) {
+    if (!multi_) {
+      throw std::runtime_error("Failed to initialize CURL multi handle");
+    }
+  }
+
+  ~MultiMonitorLoop() {
+    for (auto &detector : detectors_) {
+      if (detector->handle) {
+        curl_multi_remove_handle(multi_, detector->handle);
+        detector->client->finishFrameRequest();
+      }
+    }
+    curl_multi_cleanup(multi_);
+  }
+
+  // Without a scheduler the detector's images/monitor is polled back to back
+  void addDetector(EigerMonitorClient &client, FrameSink &sink,
+                   PollScheduler *scheduler = nullptr) {
+    std::unique_ptr<Detector> detector(new Detector());
+    detector->client = &client;
+    detector->sink = &sink;
+    detector->scheduler = scheduler;
+    detectors_.push_back(std::move(detector));
+  }
+
+  void run() {
+    running_ = true;
+    while (running_) {
+      auto now = std::chrono::steady_clock::now();
+      for (auto &detector : detectors_) {
+        if (detector->scheduler) {
+          pollState(*detector);
+        }
+        if (!detector->handle && now >= detector->nextStart) {
+          start(*detector);
+        }
+      }
+
+      int stillRunning = 0;
+      curl_multi_perform(multi_, &stillRunning);
+      curl_multi_poll(multi_, nullptr, 0, 50, nullptr);
+      curl_multi_perform(multi_, &stillRunning);
+
+      CURLMsg *message;
+      int queued = 0;
+      while ((message = curl_multi_info_read(multi_, &queued))) {
+        if (message->msg != CURLMSG_DONE) {
+          continue;
+        }
+        Detector *detector = nullptr;
+        curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, &detector);
+        if (detector) {
+          finish(*detector, message->data.result);
+        }
+      }
+    }
+  }
+
+  void stop() { running_ = false; }
+};
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef PIXEL_SCAN_H
+#define PIXEL_SCAN_H
+
+#include "ThreadPool.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Value the detector writes into module gaps and masked pixels
+const uint32_t kGapPixel = 0xFFFFFFFF;
+// Gap value of 16-bit frames
+const uint16_t kGapPixel16 = 0xFFFF;
+
+// Largest count and number of gap pixels in a frame
+struct PixelRange {
+  uint32_t max = 0;
+  size_t gaps = 0;
+
+  // Counts stay below the 16-bit gap value, so the frame can be stored as
+  // uint16 with gaps remapped to kGapPixel16
+  bool fits16() const { return max < kGapPixel16; }
+};
+
+namespace pixels {
+
+// Scans count pixels and, if Narrow, also stores their low 16 bits in dst.
+// Truncation maps kGapPixel to kGapPixel16 and keeps every count of a frame
+// that fits16(), so scanning and narrowing share one pass over the frame.
+template <bool Narrow>
+inline PixelRange scanRange(const uint32_t *src, uint16_t *dst, size_t count) {
+  PixelRange range;
+  size_t i = 0;
+#ifdef __SSE2__
+  // SSE2 only compares signed words, so values are biased by 2^31. Gap
+  // pixels are zeroed before the max and counted from their all-ones mask.
+  const __m128i bias = _mm_set1_epi32(static_cast<int>(0x80000000u));
+  const __m128i gap = _mm_set1_epi32(-1);
+  __m128i maxBiased = bias;
+  __m128i gaps = _mm_setzero_si128();
+  for (; i + 8 <= count; i += 8) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i + 4));
+    __m128i gapA = _mm_cmpeq_epi32(a, gap);
+    __m128i gapB = _mm_cmpeq_epi32(b, gap);
+    __m128i biasedA = _mm_xor_si128(_mm_andnot_si128(gapA, a), bias);
+    __m128i biasedB = _mm_xor_si128(_mm_andnot_si128(gapB, b), bias);
+    __m128i greater = _mm_cmpgt_epi32(biasedA, maxBiased);
+    maxBiased = _mm_or_si128(_mm_and_si128(greater, biasedA),
+                             _mm_andnot_si128(greater, maxBiased));
+    greater = _mm_cmpgt_epi32(biasedB, maxBiased);
+    maxBiased = _mm_or_si128(_mm_and_si128(greater, biasedB),
+                             _mm_andnot_si128(greater, maxBiased));
+    gaps = _mm_sub_epi32(_mm_sub_epi32(gaps, gapA), gapB);
+    if (Narrow) {
+      // Sign extending the low half keeps packs_epi32 from saturating
+      a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+      b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_packs_epi32(a, b));
+    }
+  }
+  uint32_t lanes[4];
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), gaps);
+  range.gaps += size_t(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), maxBiased);
+  for (uint32_t lane : lanes) {
+    range.max = std::max(range.max, lane ^ 0x80000000u);
+  }
+#endif
+  for (; i < count; ++i) {
+    if (src[i] == kGapPixel) {
+      ++range.gaps;
+    } else {
+      range.max = std::max(range.max, src[i]);
+    }
+    if (Narrow) {
+      dst[i] = static_cast<uint16_t>(src[i]);
+    }
+  }
+  return range;
+}
+
+// Pixels per parallel chunk, large enough to amortise the hand-off
+const size_t kChunkPixels = size_t(1) << 18;
+
+template <bool Narrow>
+inline PixelRange scanChunks(const uint32_t *src, uint16_t *dst, size_t count,
+                             ThreadPool *pool) {
+  size_t chunks = (count + kChunkPixels - 1) / kChunkPixels;
+  if (!pool || chunks < 2) {
+    return scanRange<Narrow>(src, dst, count);
+  }
+  std::vector<PixelRange> ranges(chunks);
+  pool->parallelFor(chunks, [&](size_t begin, size_t end) {
+    for (size_t c = begin; c < end; ++c) {
+      size_t first = c * kChunkPixels;
+      ranges[c] = scanRange<Narrow>(src + first, Narrow ? dst + first : nullptr,
+                                    std::min(kChunkPixels, count - first));
+    }
+  });
+  PixelRange range;
+  for (const PixelRange &chunk : ranges) {
+    range.max = std::max(range.max, chunk.max);
+    range.gaps += chunk.gaps;
+  }
+  return range;
+}
+
+inline PixelRange scan(const uint32_t *pixels, size_t count,
+                       ThreadPool *pool = nullptr) {
+  return scanChunks<false>(pixels, nullptr, count, pool);
+}
+
+// Writes the frame to dst as uint16 while scanning it. dst only holds the
+// frame if the returned range fits16().
+inline PixelRange narrow(const uint32_t *src, uint16_t *dst, size_t count,
+                         ThreadPool *pool = nullptr) {
+  return scanChunks<true>(src, dst, count, pool);
+}
+
+// Widens a 16- or 8-bit frame to uint32, mapping the narrow gap value (the
+// type's max) to kGapPixel. The compare and select loop vectorises.
+template <typename T>
+inline void widen(const T *src, uint32_t *dst, size_t count,
+                  ThreadPool *pool = nullptr) {
+  const T gap = static_cast<T>(~T(0));
+  auto widenRange = [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      dst[i] = src[i] == gap ? kGapPixel : src[i];
+    }
+  };
+  size_t chunks = (count + kChunkPixels - 1) / kChunkPixels;
+  if (!pool || chunks < 2) {
+    widenRange(0, count);
+    return;
+  }
+  pool->parallelFor(chunks, [&](size_t begin, size_t end) {
+    widenRange(begin * kChunkPixels, std::min(end * kChunkPixels, count));
+  });
+}
+
+} // namespace pixels
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef POLL_SCHEDULER_H
+#define POLL_SCHEDULER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+
+enum class PollMode {
+  // Blocks on images/next until the detector has a new image
+  LongPoll,
+  // Polls images/monitor, backing off while frames are unchanged
+  Adaptive
+};
+
+// Decides which monitor endpoint the fetch stage requests and how long it
+// waits in between. The decode stage reports whether each frame was new, and
+// a periodic detector status read switches to fast polling while acquiring.
+class PollScheduler {
+private:
+  PollMode mode_;
+  std::chrono::microseconds minInterval_;
+  std::chrono::microseconds maxInterval_;
+  std::chrono::milliseconds longPollTimeout_;
+  std::chrono::milliseconds statusInterval_;
+  std::atomic<int64_t> intervalUs_;
+  std::atomic<bool> acquiring_;
+  std::chrono::steady_clock::time_point lastStatus_;
+  int longPollFailures_;
+
+public:
+  PollScheduler(PollMode mode = PollMode::LongPoll,
+                std::chrono::milliseconds minInterval =
+                    std::chrono::milliseconds(20),
+                std::chrono::milliseconds maxInterval =
+                    std::chrono::milliseconds(1000),
+                std::chrono::milliseconds longPollTimeout =
+                    std::chrono::milliseconds(2000))
+      : mode_(mode), minInterval_(minInterval), maxInterval_(maxInterval),
+        longPollTimeout_(longPollTimeout),
+        statusInterval_(std::chrono::milliseconds(1000)),
+        intervalUs_(minInterval_.count()), acquiring_(false),
+        longPollFailures_(0) {}
+
+  PollMode mode() const { return mode_; }
+
+  std::string endpoint() const {
+    return mode_ == PollMode::LongPoll ? "next" : "monitor";
+  }
+
+  // How long the next request may wait for its response to start; a long
+  // poll that runs out just means no new image arrived
+  std::chrono::milliseconds waitTimeout() const {
+    return mode_ == PollMode::LongPoll ? longPollTimeout_
+                                       : std::chrono::milliseconds(10000);
+  }
+
+  // Bound on a whole transfer, generous enough for a full frame on a slow
+  // link once it has started
+  std::chrono::milliseconds transferTimeout() const {
+    return std::chrono::milliseconds(60000);
+  }
+
+  std::chrono::microseconds nextDelay() const {
+    if (mode_ == PollMode::LongPoll || acquiring_) {
+      return std::chrono::microseconds(0);
+    }
+    return std::chrono::microseconds(intervalUs_.load());
+  }
+
+  // Called from the decode stage for every fetched frame
+  void frameSeen(bool changed) {
+    if (changed) {
+      intervalUs_ = minInterval_.count();
+      return;
+    }
+    int64_t interval = intervalUs_.load();
+    intervalUs_ = std::min<int64_t>(
+        std::max<int64_t>(interval * 2, minInterval_.count()),
+        maxInterval_.count());
+  }
+
+  bool statusDue() {
+    auto now = std::chrono::steady_clock::now();
+    if (now - lastStatus_ < statusInterval_) {
+      return false;
+    }
+    lastStatus_ = now;
+    return true;
+  }
+
+  void setAcquiring(bool acquiring) { acquiring_ = acquiring; }
+  bool acquiring() const { return acquiring_; }
+
+  // Long polling that keeps failing for reasons other than a timeout means
+  // the detector does not support it, so fall back to adaptive polling
+  void longPollSucceeded() { longPollFailures_ = 0; }
+
+  bool longPollFailed() {
+    if (mode_ != PollMode::LongPoll || ++longPollFailures_ < 3) {
+      return false;
+    }
+    mode_ = PollMode::Adaptive;
+    return true;
+  }
+};
+
+#endif
@@ -0,0 +1,185 @@
+#ifndef RADIAL_INTEGRATOR_H
+#define RADIAL_INTEGRATOR_H
+
+#include "PixelScan.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+enum class RadialUnit { Q, TwoTheta };
+
+// Detector geometry the lookup table is built for
+struct RadialGeometry {
+  uint32_t width = 0;
+  uint32_t height = 0;
+  // mm
+  double pixelSizeX = 0.0;
+  double pixelSizeY = 0.0;
+  // Pixels
+  double beamCenterX = 0.0;
+  double beamCenterY = 0.0;
+  // mm and A
+  double distance = 0.0;
+  double wavelength = 0.0;
+
+  bool operator==(const RadialGeometry &other) const {
+    return width == other.width && height == other.height &&
+           pixelSizeX == other.pixelSizeX && pixelSizeY == other.pixelSizeY &&
+           beamCenterX == other.beamCenterX &&
+           beamCenterY == other.beamCenterY && distance == other.distance &&
+           wavelength == other.wavelength;
+  }
+  bool operator!=(const RadialGeometry &other) const { return !(*this == other); }
+};
+
+// Mean intensity per bin; position is the bin center in 1/A (q) or degrees
+// (2 theta)
+struct RadialProfile {
+  std::vector<double> position;
+  std::vector<double> intensity;
+  std::vector<uint64_t> pixels;
+};
+
+// Integrates frames azimuthally into equally spaced q or 2 theta bins.
+// Every pixel is assigned to the bin of its center in a lookup table that
+// is only rebuilt when the geometry changes, so a frame costs one pass over
+// the pixels and the table. Gap pixels are skipped.
+class RadialIntegrator {
+private:
+  // Pixels per parallel chunk
+  static const size_t kChunkPixels = size_t(1) << 18;
+
+  size_t bins_;
+  RadialUnit unit_;
+  RadialGeometry geometry_;
+  bool built_;
+  double binWidth_;
+  // Bin of every pixel; bins_ for pixels outside the range
+  std::vector<uint16_t> lut_;
+
+  // q = 4 pi sin(theta) / lambda with sin(theta) = r / sqrt(2 L (L + d)),
+  // L = sqrt(r^2 + d^2), avoiding trigonometry for the default unit
+  double pixelPosition(double x, double y) const {
+    double dx = (x + 0.5 - geometry_.beamCenterX) * geometry_.pixelSizeX;
+    double dy = (y + 0.5 - geometry_.beamCenterY) * geometry_.pixelSizeY;
+    double r2 = dx * dx + dy * dy;
+    double d = geometry_.distance;
+    if (unit_ == RadialUnit::TwoTheta) {
+      return std::atan2(std::sqrt(r2), d) * 180.0 / M_PI;
+    }
+    double l = std::sqrt(r2 + d * d);
+    return 4.0 * M_PI * std::sqrt(r2 / (2 * l * (l + d))) / geometry_.wavelength;
+  }
+
+  void build(ThreadPool *pool) {
+    const RadialGeometry &g = geometry_;
+    // The range reaches the farthest corner
+    double range = 0.0;
+    for (double x : {0.0, double(g.width)}) {
+      for (double y : {0.0, double(g.height)}) {
+        range = std::max(range, pixelPosition(x - 0.5, y - 0.5));
+      }
+    }
+    binWidth_ = range / bins_;
+    lut_.resize(size_t(g.width) * g.height);
+    auto buildRows = [&](size_t begin, size_t end) {
+      for (size_t y = begin; y < end; ++y) {
+        uint16_t *row = lut_.data() + y * g.width;
+        for (uint32_t x = 0; x < g.width; ++x) {
+          double bin = pixelPosition(x, y) / binWidth_;
+          row[x] = static_cast<uint16_t>(bin < bins_ ? bin : bins_);
+        }
+      }
+    };
+    if (pool) {
+      pool->parallelFor(g.height, buildRows, 16);
+    } else {
+      buildRows(0, g.height);
+    }
+    built_ = true;
+  }
+
+public:
+  RadialIntegrator(size_t bins, RadialUnit unit)
+      : bins_(bins), unit_(unit), built_(false), binWidth_(0.0) {
+    if (bins_ == 0 || bins_ >= 0xFFFF) {
+      throw std::runtime_error("Radial bins must be between 1 and 65534");
+    }
+  }
+
+  // Rebuilds the lookup table if the geometry changed; true if it did
+  bool configure(const RadialGeometry &geometry, ThreadPool *pool = nullptr) {
+    if (built_ && geometry == geometry_) {
+      return false;
+    }
+    if (geometry.distance <= 0.0 || geometry.pixelSizeX <= 0.0 ||
+        geometry.pixelSizeY <= 0.0) {
+      throw std::runtime_error("Radial integration needs distance and pixel size");
+    }
+    if (unit_ == RadialUnit::Q && geometry.wavelength <= 0.0) {
+      throw std::runtime_error("Radial integration in q needs the wavelength");
+    }
+    geometry_ = geometry;
+    build(pool);
+    return true;
+  }
+
+  // pixels has the size of the configured geometry
+  void integrate(const uint32_t *pixels, RadialProfile &profile,
+                 ThreadPool *pool = nullptr) const {
+    if (!built_) {
+      throw std::runtime_error("Radial integrator is not configured");
+    }
+    size_t count = lut_.size();
+    size_t chunks = (count + kChunkPixels - 1) / kChunkPixels;
+    // Per chunk sums and pixel counts with one extra bin collecting gaps and
+    // pixels out of range, so the loop does not branch
+    size_t slots = bins_ + 1;
+    std::vector<uint64_t> sums(chunks * slots, 0);
+    std::vector<uint32_t> counts(chunks * slots, 0);
+    const uint16_t *lut = lut_.data();
+    const uint16_t discard = static_cast<uint16_t>(bins_);
+    auto accumulate = [&](size_t begin, size_t end) {
+      for (size_t c = begin; c < end; ++c) {
+        uint64_t *sum = sums.data() + c * slots;
+        uint32_t *n = counts.data() + c * slots;
+        size_t last = std::min(count, (c + 1) * kChunkPixels);
+        for (size_t i = c * kChunkPixels; i < last; ++i) {
+          uint32_t value = pixels[i];
+          uint16_t bin = value == kGapPixel ? discard : lut[i];
+          sum[bin] += value;
+          ++n[bin];
+        }
+      }
+    };
+    if (pool) {
+      pool->parallelFor(chunks, accumulate);
+    } else {
+      accumulate(0, chunks);
+    }
+
+    profile.position.resize(bins_);
+    profile.intensity.assign(bins_, 0.0);
+    profile.pixels.assign(bins_, 0);
+    std::vector<uint64_t> total(bins_, 0);
+    for (size_t c = 0; c < chunks; ++c) {
+      for (size_t b = 0; b < bins_; ++b) {
+        total[b] += sums[c * slots + b];
+        profile.pixels[b] += counts[c * slots + b];
+      }
+    }
+    for (size_t b = 0; b < bins_; ++b) {
+      profile.position[b] = (b + 0.5) * binWidth_;
+      profile.intensity[b] =
+          profile.pixels[b] ? double(total[b]) / profile.pixels[b] : 0.0;
+    }
+  }
+
+  size_t bins() const { return bins_; }
+  RadialUnit unit() const { return unit_; }
+};
+
+#endif
@@ -0,0 +1,167 @@
+#ifndef ROLLING_SUM_H
+#define ROLLING_SUM_H
+
+#include "PixelScan.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Sum of the last depth frames, kept up to date by adding the newest frame
+// and subtracting the one it evicts, so an update costs one pass over the
+// pixels whatever the depth. The frames are held in a ring allocated once.
+//
+// Each 64-bit accumulator holds the counts in its low 48 bits and the number
+// of frames in which the pixel was a gap in the high 16 bits, so gaps enter
+// and leave the window by plain addition. A pixel that was a gap in any frame
+// of the window is a gap of the sum; other sums saturate below the gap value.
+class RollingSum {
+private:
+  static const uint64_t kGapUnit = uint64_t(1) << 48;
+  // Pixels per parallel chunk
+  static const size_t kChunkPixels = size_t(1) << 18;
+
+  size_t depth_;
+  size_t pixels_;
+  std::vector<uint32_t> ring_;
+  std::vector<uint64_t> sum_;
+  // Slot the next frame goes into and number of frames in the window
+  size_t next_;
+  size_t frames_;
+
+  static uint32_t output(uint64_t sum) {
+    if (sum >= kGapUnit) {
+      return kGapPixel;
+    }
+    return static_cast<uint32_t>(std::min<uint64_t>(sum, kGapPixel - 1));
+  }
+
+  static uint64_t contribution(uint32_t value) {
+    return value == kGapPixel ? kGapUnit : value;
+  }
+
+#ifdef __SSE2__
+  // Accumulator increments of four pixels, two per vector
+  static void contribution(__m128i x, __m128i &low, __m128i &high) {
+    const __m128i gap = _mm_set1_epi32(-1);
+    const __m128i gapUnit = _mm_set1_epi32(static_cast<int>(kGapUnit >> 32));
+    __m128i isGap = _mm_cmpeq_epi32(x, gap);
+    // Gaps contribute 0 in the low word and the gap unit in the high one
+    __m128i value = _mm_andnot_si128(isGap, x);
+    __m128i unit = _mm_and_si128(isGap, gapUnit);
+    low = _mm_unpacklo_epi32(value, unit);
+    high = _mm_unpackhi_epi32(value, unit);
+  }
+
+  // Saturated output of the four accumulators in a and b
+  static __m128i output(__m128i a, __m128i b) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i gap = _mm_set1_epi32(-1);
+    const __m128i saturated = _mm_set1_epi32(static_cast<int>(kGapPixel - 1));
+    __m128i low = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b),
+                                                  _MM_SHUFFLE(2, 0, 2, 0)));
+    __m128i high = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b),
+                                                   _MM_SHUFFLE(3, 1, 3, 1)));
+    __m128i isGap = _mm_xor_si128(_mm_cmpeq_epi32(_mm_srli_epi32(high, 16), zero), gap);
+    // Counts of 2^32 - 1 and above become the largest count
+    __m128i over = _mm_or_si128(_mm_xor_si128(_mm_cmpeq_epi32(high, zero), gap),
+                                _mm_cmpeq_epi32(low, gap));
+    __m128i result = _mm_or_si128(_mm_and_si128(over, saturated), _mm_andnot_si128(over, low));
+    return _mm_or_si128(isGap, result);
+  }
+#endif
+
+  // Adds src to the sum over [begin, end), subtracting the evicted frame in
+  // slot if evict, stores src into slot and the saturated sum into dst
+  static void updateRange(const uint32_t *src, uint32_t *slot, uint64_t *sum, uint32_t *dst,
+                          bool evict, size_t begin, size_t end) {
+    size_t i = begin;
+#ifdef __SSE2__
+    for (; i + 4 <= end; i += 4) {
+      __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+      __m128i *acc = reinterpret_cast<__m128i *>(sum + i);
+      __m128i a = _mm_loadu_si128(acc);
+      __m128i b = _mm_loadu_si128(acc + 1);
+      __m128i low, high;
+      contribution(x, low, high);
+      a = _mm_add_epi64(a, low);
+      b = _mm_add_epi64(b, high);
+      if (evict) {
+        contribution(_mm_loadu_si128(reinterpret_cast<const __m128i *>(slot + i)), low, high);
+        a = _mm_sub_epi64(a, low);
+        b = _mm_sub_epi64(b, high);
+      }
+      _mm_storeu_si128(acc, a);
+      _mm_storeu_si128(acc + 1, b);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(slot + i), x);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), output(a, b));
+    }
+#endif
+    for (; i < end; ++i) {
+      uint64_t total = sum[i] + contribution(src[i]);
+      if (evict) {
+        total -= contribution(slot[i]);
+      }
+      sum[i] = total;
+      slot[i] = src[i];
+      dst[i] = output(total);
+    }
+  }
+
+public:
+  // Holds depth frames of the given size; depth is below 65536 so the gap
+  // count fits its 16 bits
+  RollingSum(size_t depth, size_t pixels) : depth_(depth), pixels_(0), next_(0), frames_(0) {
+    if (depth_ < 1 || depth_ >= 0xFFFF) {
+      throw std::runtime_error("Summed frames must be between 1 and 65534");
+    }
+    resize(pixels);
+  }
+
+  // Empties the window; memory is only reallocated when the frame size changes
+  void resize(size_t pixels) {
+    if (pixels != pixels_) {
+      pixels_ = pixels;
+      ring_.assign(depth_ * pixels_, 0);
+      sum_.assign(pixels_, 0);
+    } else {
+      std::fill(sum_.begin(), sum_.end(), 0);
+    }
+    next_ = 0;
+    frames_ = 0;
+  }
+
+  // Moves the window on by one frame of pixels() counts and stores the sum
+  // of the window in dst
+  void add(const uint32_t *src, uint32_t *dst, ThreadPool *pool = nullptr) {
+    uint32_t *slot = ring_.data() + next_ * pixels_;
+    uint64_t *sum = sum_.data();
+    bool evict = frames_ == depth_;
+    size_t count = pixels_;
+    size_t chunks = (count + kChunkPixels - 1) / kChunkPixels;
+    auto update = [&](size_t begin, size_t end) {
+      updateRange(src, slot, sum, dst, evict, begin * kChunkPixels,
+                  std::min(count, end * kChunkPixels));
+    };
+    if (pool) {
+      pool->parallelFor(chunks, update);
+    } else {
+      update(0, chunks);
+    }
+    next_ = (next_ + 1) % depth_;
+    frames_ = std::min(frames_ + 1, depth_);
+  }
+
+  size_t depth() const { return depth_; }
+  size_t pixels() const { return pixels_; }
+  // Frames currently summed, depth() once the window is full
+  size_t frames() const { return frames_; }
+};
+
+#endif
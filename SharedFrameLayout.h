@@ -0,0 +1,97 @@
+#ifndef SHARED_FRAME_LAYOUT_H
+#define SHARED_FRAME_LAYOUT_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Layout of the POSIX shared memory ring frames are published into. The
+// object starts with a RingHeader page, followed by the slots. Each slot is
+// a SlotHeader page and the frame's uint32 pixels, row by row, with the
+// detector's gap value 0xFFFFFFFF. Frame n, counting from 1, goes into slot
+// (n - 1) % slots.
+//
+// Each slot is guarded by a seqlock: its counter is odd while the slot is
+// written, so a reader that saw the same even value before and after
+// reading has a consistent frame.
+namespace shmframes {
+
+const uint32_t kMagic = 0x4E4F4D59; // "YMON"
+const uint32_t kVersion = 1;
+const size_t kPageBytes = 4096;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "the ring is shared between processes without locks");
+
+struct RingHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slots;
+  uint32_t reserved;
+  // Pixel capacity and size in bytes of one slot, header page included
+  uint64_t maxPixels;
+  uint64_t slotBytes;
+  // Number of the newest complete frame, 0 before the first
+  std::atomic<uint64_t> latest;
+  // Set when the publisher shut down and unlinked the ring
+  std::atomic<uint32_t> closed;
+};
+
+// Describes the frame in a slot. Geometry is taken from the Tango metadata
+// the frame was written with.
+struct FrameInfo {
+  uint64_t frame;
+  int64_t seriesId;
+  int64_t imageId;
+  uint32_t width;
+  uint32_t height;
+  // mm
+  double pixelSizeX;
+  double pixelSizeY;
+  // Pixels
+  double beamCenterX;
+  double beamCenterY;
+  // mm and A
+  double distance;
+  double wavelength;
+  // steady_clock (CLOCK_MONOTONIC) time the frame was published, comparable
+  // between processes on the host
+  int64_t publishedNs;
+};
+
+struct SlotHeader {
+  std::atomic<uint64_t> sequence;
+  FrameInfo info;
+};
+
+static_assert(sizeof(RingHeader) <= kPageBytes && sizeof(SlotHeader) <= kPageBytes,
+              "headers fit their pages");
+
+inline uint64_t slotBytes(uint64_t maxPixels) {
+  uint64_t bytes = kPageBytes + maxPixels * sizeof(uint32_t);
+  return (bytes + kPageBytes - 1) / kPageBytes * kPageBytes;
+}
+
+inline size_t ringBytes(uint32_t slots, uint64_t maxPixels) {
+  return static_cast<size_t>(kPageBytes + slots * slotBytes(maxPixels));
+}
+
+inline uint8_t *slotAddress(uint8_t *ring, const RingHeader &header, uint64_t frame) {
+  return ring + kPageBytes + ((frame - 1) % header.slots) * header.slotBytes;
+}
+
+inline const uint8_t *slotAddress(const uint8_t *ring, const RingHeader &header,
+                                  uint64_t frame) {
+  return ring + kPageBytes + ((frame - 1) % header.slots) * header.slotBytes;
+}
+
+inline int64_t nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+} // namespace shmframes
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef SHARED_FRAME_PUBLISHER_H
+#define SHARED_FRAME_PUBLISHER_H
+
+#include "SharedFrameLayout.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Publishes frames into a shared memory ring (see SharedFrameLayout.h) that
+// local processes map with SharedFrameReader, without copies through files.
+// A stale ring of the same name is replaced; readers still mapping it see
+// it closed.
+class SharedFramePublisher {
+private:
+  // Bytes per parallel copy chunk
+  static const size_t kChunkBytes = size_t(1) << 20;
+
+  std::string name_;
+  size_t size_;
+  uint8_t *map_;
+  shmframes::RingHeader *header_;
+  uint64_t published_;
+
+  static std::runtime_error error(const std::string &what, const std::string &name) {
+    return std::runtime_error(what + " " + name + ": " + std::strerror(errno));
+  }
+
+public:
+  // name is a shm_open name such as "/yamone"
+  SharedFramePublisher(const std::string &name, uint32_t slots, uint64_t maxPixels)
+      : name_(name), size_(shmframes::ringBytes(slots, maxPixels)), map_(nullptr),
+        header_(nullptr), published_(0) {
+    if (slots == 0) {
+      throw std::runtime_error("Shared memory ring needs at least one slot");
+    }
+    shm_unlink(name_.c_str());
+    int fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) {
+      throw error("Unable to create shared memory", name_);
+    }
+    if (ftruncate(fd, static_cast<off_t>(size_)) != 0) {
+      close(fd);
+      shm_unlink(name_.c_str());
+      throw error("Unable to size shared memory", name_);
+    }
+    void *map = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+      shm_unlink(name_.c_str());
+      throw error("Unable to map shared memory", name_);
+    }
+    map_ = static_cast<uint8_t *>(map);
+    // ftruncate zero fills, so every counter starts at 0
+    header_ = reinterpret_cast<shmframes::RingHeader *>(map_);
+    header_->slots = slots;
+    header_->maxPixels = maxPixels;
+    header_->slotBytes = shmframes::slotBytes(maxPixels);
+    header_->version = shmframes::kVersion;
+    // Readers check the magic last
+    std::atomic_thread_fence(std::memory_order_release);
+    header_->magic = shmframes::kMagic;
+  }
+
+  ~SharedFramePublisher() {
+    header_->closed.store(1, std::memory_order_release);
+    munmap(map_, size_);
+    shm_unlink(name_.c_str());
+  }
+
+  SharedFramePublisher(const SharedFramePublisher &) = delete;
+  SharedFramePublisher &operator=(const SharedFramePublisher &) = delete;
+
+  // Copies the frame into the next slot, spread over the pool, and makes it
+  // the latest. info.frame and info.publishedNs are filled in.
+  void publish(const uint32_t *pixels, shmframes::FrameInfo info, ThreadPool *pool = nullptr) {
+    size_t count = static_cast<size_t>(info.width) * info.height;
+    if (count > header_->maxPixels) {
+      throw std::runtime_error("Frame is larger than the shared memory slots of " + name_);
+    }
+    uint64_t frame = published_ + 1;
+    uint8_t *slot = shmframes::slotAddress(map_, *header_, frame);
+    auto *slotHeader = reinterpret_cast<shmframes::SlotHeader *>(slot);
+    uint8_t *out = slot + shmframes::kPageBytes;
+
+    uint64_t sequence = slotHeader->sequence.load(std::memory_order_relaxed);
+    slotHeader->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    size_t bytes = count * sizeof(uint32_t);
+    size_t chunks = (bytes + kChunkBytes - 1) / kChunkBytes;
+    const uint8_t *in = reinterpret_cast<const uint8_t *>(pixels);
+    auto copy = [&](size_t begin, size_t end) {
+      size_t first = begin * kChunkBytes;
+      size_t last = std::min(bytes, end * kChunkBytes);
+      std::memcpy(out + first, in + first, last - first);
+    };
+    if (pool) {
+      pool->parallelFor(chunks, copy);
+    } else {
+      copy(0, chunks);
+    }
+    info.frame = frame;
+    info.publishedNs = shmframes::nowNs();
+    slotHeader->info = info;
+    slotHeader->sequence.store(sequence + 2, std::memory_order_release);
+    header_->latest.store(frame, std::memory_order_release);
+    published_ = frame;
+  }
+
+  const std::string &name() const { return name_; }
+  uint64_t published() const { return published_; }
+};
+
+#endif
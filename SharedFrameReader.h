@@ -0,0 +1,154 @@
+#ifndef SHARED_FRAME_READER_H
+#define SHARED_FRAME_READER_H
+
+#include "SharedFrameLayout.h"
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Maps the ring of a SharedFramePublisher read-only. Only depends on
+// SharedFrameLayout.h, so other programs on the host can include it on its
+// own:
+//
+//   SharedFrameReader reader("/yamone");
+//   SharedFrameReader::View view;
+//   uint64_t seen = 0;
+//   while (reader.waitNewer(seen, std::chrono::seconds(1))) {
+//     if (reader.latest(view)) {
+//       // use view.info and view.pixels in place, then
+//       if (reader.valid(view)) { ... }
+//       seen = view.info.frame;
+//     }
+//   }
+//
+// A view points into the ring and stays intact until the publisher has
+// gone round all slots; valid() tells whether that happened while reading.
+class SharedFrameReader {
+public:
+  struct View {
+    shmframes::FrameInfo info;
+    const uint32_t *pixels = nullptr;
+    const shmframes::SlotHeader *slot = nullptr;
+    uint64_t sequence = 0;
+  };
+
+private:
+  std::string name_;
+  size_t size_;
+  const uint8_t *map_;
+  const shmframes::RingHeader *header_;
+
+  static std::runtime_error error(const std::string &what, const std::string &name) {
+    return std::runtime_error(what + " " + name + ": " + std::strerror(errno));
+  }
+
+public:
+  explicit SharedFrameReader(const std::string &name)
+      : name_(name), size_(0), map_(nullptr), header_(nullptr) {
+    int fd = shm_open(name_.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+      throw error("Unable to open shared memory", name_);
+    }
+    struct stat status;
+    if (fstat(fd, &status) != 0 || status.st_size < static_cast<off_t>(shmframes::kPageBytes)) {
+      close(fd);
+      throw std::runtime_error("Shared memory " + name_ + " is not a frame ring");
+    }
+    size_ = static_cast<size_t>(status.st_size);
+    void *map = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+      throw error("Unable to map shared memory", name_);
+    }
+    map_ = static_cast<const uint8_t *>(map);
+    header_ = reinterpret_cast<const shmframes::RingHeader *>(map_);
+    uint32_t magic = header_->magic;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (magic != shmframes::kMagic || header_->version != shmframes::kVersion ||
+        size_ < shmframes::ringBytes(header_->slots, header_->maxPixels)) {
+      munmap(const_cast<uint8_t *>(map_), size_);
+      throw std::runtime_error("Shared memory " + name_ + " is not a compatible frame ring");
+    }
+  }
+
+  ~SharedFrameReader() { munmap(const_cast<uint8_t *>(map_), size_); }
+
+  SharedFrameReader(const SharedFrameReader &) = delete;
+  SharedFrameReader &operator=(const SharedFrameReader &) = delete;
+
+  // Number of the newest frame, 0 before the first
+  uint64_t latestFrame() const { return header_->latest.load(std::memory_order_acquire); }
+
+  // The publisher has shut down; open the ring again to follow a new one
+  bool closed() const { return header_->closed.load(std::memory_order_acquire) != 0; }
+
+  uint32_t slots() const { return header_->slots; }
+
+  // Points view at the newest frame without copying it; false if there is
+  // none yet or the slot was being rewritten
+  bool latest(View &view) const {
+    uint64_t frame = latestFrame();
+    if (frame == 0) {
+      return false;
+    }
+    const uint8_t *slot = shmframes::slotAddress(map_, *header_, frame);
+    view.slot = reinterpret_cast<const shmframes::SlotHeader *>(slot);
+    view.sequence = view.slot->sequence.load(std::memory_order_acquire);
+    if (view.sequence & 1) {
+      return false;
+    }
+    view.info = view.slot->info;
+    view.pixels = reinterpret_cast<const uint32_t *>(slot + shmframes::kPageBytes);
+    return valid(view) && view.info.frame == frame;
+  }
+
+  // Whether the slot was left alone since latest() filled the view; check
+  // after reading the pixels
+  bool valid(const View &view) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return view.slot->sequence.load(std::memory_order_relaxed) == view.sequence;
+  }
+
+  // Copies the newest frame, retrying while the publisher overwrites it
+  bool copyLatest(std::vector<uint32_t> &pixels, shmframes::FrameInfo &info,
+                  int attempts = 3) const {
+    View view;
+    for (int attempt = 0; attempt < attempts; ++attempt) {
+      if (!latest(view)) {
+        continue;
+      }
+      pixels.assign(view.pixels,
+                    view.pixels + static_cast<size_t>(view.info.width) * view.info.height);
+      if (valid(view)) {
+        info = view.info;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Polls until a frame newer than frame is published; false on timeout or
+  // when the publisher closed the ring
+  bool waitNewer(uint64_t frame, std::chrono::microseconds timeout,
+                 std::chrono::microseconds interval = std::chrono::microseconds(50)) const {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (latestFrame() <= frame) {
+      if (closed() || std::chrono::steady_clock::now() >= deadline) {
+        return false;
+      }
+      std::this_thread::sleep_for(interval);
+    }
+    return true;
+  }
+};
+
+#endif
@@ -0,0 +1,210 @@
+#ifndef SMV_WRITER_H
+#define SMV_WRITER_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// Fields of the 512 byte SMV header read by ADXV
+struct SmvHeader {
+  static const size_t kBytes = 512;
+
+  uint32_t width = 0;
+  uint32_t height = 0;
+  std::string type = "unsigned_int";
+  double pixelSize = 0.0;
+  double beamCenterX = 0.0;
+  double beamCenterY = 0.0;
+  double distance = 0.0;
+  double wavelength = 0.0;
+  std::vector<std::pair<std::string, std::string>> extra;
+
+  // Always exactly kBytes long, padded with spaces
+  std::string format() const {
+    std::string header = "{\nHEADER_BYTES=512;\nDIM=2;\n"
+                         "BYTE_ORDER=little_endian;\nTYPE=" +
+                         type + ";\nSIZE1=" + std::to_string(width) +
+                         ";\nSIZE2=" + std::to_string(height) +
+                         ";\nPIXEL_SIZE=" + std::to_string(pixelSize) +
+                         ";\nBEAM_CENTER_X=" + std::to_string(beamCenterX) +
+                         ";\nBEAM_CENTER_Y=" + std::to_string(beamCenterY) +
+                         ";\nDISTANCE=" + std::to_string(distance) +
+                         ";\nWAVELENGTH=" + std::to_string(wavelength) + ";\n";
+    for (const auto &field : extra) {
+      header += field.first + "=" + field.second + ";\n";
+    }
+    header += "}";
+    if (header.size() > kBytes) {
+      throw std::runtime_error("SMV header exceeds 512 bytes");
+    }
+    header.resize(kBytes, ' ');
+    return header;
+  }
+};
+
+// Writes SMV frames into a ring of kSlots preallocated, memory mapped files,
+// path.0 to path.(kSlots-1), reused round robin. Each frame goes into the
+// file published longest ago, never the one on display or one of the kKeep
+// handed to ADXV just before it, so a late load still reads a whole frame.
+// path is a symlink swapped atomically to the last published file.
+class SmvWriter {
+public:
+  static const size_t kKeep = 4;
+  static const size_t kSlots = kKeep + 1;
+
+private:
+  struct Slot {
+    std::string path;
+    int fd = -1;
+    uint8_t *map = nullptr;
+    size_t size = 0;
+    std::string header;
+  };
+
+  std::string path_;
+  std::string link_;
+  Slot slots_[kSlots];
+  size_t next_;
+
+  static std::runtime_error error(const std::string &what,
+                                  const std::string &path) {
+    return std::runtime_error(what + " " + path + ": " + std::strerror(errno));
+  }
+
+  // Ring files, their link and temp files left by an earlier run; a longer
+  // ring or one numbered per frame may have left more than kSlots
+  void removeStale() {
+    size_t slash = path_.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : path_.substr(0, slash + 1);
+    std::string prefix =
+        (slash == std::string::npos ? path_ : path_.substr(slash + 1)) + ".";
+    DIR *listing = opendir(dir.c_str());
+    if (!listing) {
+      return;
+    }
+    while (dirent *entry = readdir(listing)) {
+      std::string name = entry->d_name;
+      if (name.compare(0, prefix.size(), prefix) != 0) {
+        continue;
+      }
+      std::string suffix = name.substr(prefix.size());
+      if (suffix == "tmp" || suffix == "link" ||
+          (!suffix.empty() &&
+           suffix.find_first_not_of("0123456789") == std::string::npos)) {
+        unlink((slash == std::string::npos ? name : dir + name).c_str());
+      }
+    }
+    closedir(listing);
+  }
+
+  void unmap(Slot &slot) {
+    if (slot.map) {
+      munmap(slot.map, slot.size);
+      slot.map = nullptr;
+      slot.size = 0;
+    }
+  }
+
+  void map(Slot &slot, size_t size) {
+    if (slot.map && slot.size == size) {
+      return;
+    }
+    unmap(slot);
+    if (slot.fd < 0) {
+      slot.fd = open(slot.path.c_str(), O_RDWR | O_CREAT, 0644);
+      if (slot.fd < 0) {
+        throw error("Unable to open", slot.path);
+      }
+    }
+    if (ftruncate(slot.fd, size) != 0) {
+      throw error("Unable to size", slot.path);
+    }
+    void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     slot.fd, 0);
+    if (map == MAP_FAILED) {
+      throw error("Unable to map", slot.path);
+    }
+    slot.map = static_cast<uint8_t *>(map);
+    slot.size = size;
+    // The header region is rewritten in full after a resize
+    slot.header.clear();
+  }
+
+public:
+  explicit SmvWriter(const std::string &path)
+      : path_(path), link_(path + ".link"), next_(0) {
+    removeStale();
+    for (size_t i = 0; i < kSlots; ++i) {
+      slots_[i].path = path + "." + std::to_string(i);
+    }
+  }
+
+  SmvWriter(const SmvWriter &) = delete;
+  SmvWriter &operator=(const SmvWriter &) = delete;
+
+  ~SmvWriter() {
+    for (Slot &slot : slots_) {
+      unmap(slot);
+      if (slot.fd >= 0) {
+        close(slot.fd);
+      }
+    }
+  }
+
+  // Returns the pixel region of the file the next frame goes into
+  uint8_t *beginFrame(size_t pixelBytes) {
+    Slot &slot = slots_[next_];
+    map(slot, SmvHeader::kBytes + pixelBytes);
+    return slot.map + SmvHeader::kBytes;
+  }
+
+  // Copies only the span of the header that differs from what the file
+  // already holds, usually just the changed numeric fields
+  void setHeader(const SmvHeader &fields) {
+    Slot &slot = slots_[next_];
+    std::string header = fields.format();
+    if (slot.header.size() != header.size()) {
+      std::memcpy(slot.map, header.data(), header.size());
+    } else {
+      size_t first = 0;
+      while (first < header.size() && header[first] == slot.header[first]) {
+        ++first;
+      }
+      size_t last = header.size();
+      while (last > first && header[last - 1] == slot.header[last - 1]) {
+        --last;
+      }
+      if (first < last) {
+        std::memcpy(slot.map + first, header.data() + first, last - first);
+      }
+    }
+    slot.header = std::move(header);
+  }
+
+  // Makes the frame written since beginFrame current and returns the path to
+  // hand to the viewer
+  const std::string &publish() {
+    const Slot &slot = slots_[next_];
+    unlink(link_.c_str());
+    if (symlink(slot.path.c_str(), link_.c_str()) != 0 ||
+        rename(link_.c_str(), path_.c_str()) != 0) {
+      throw error("Unable to publish", path_);
+    }
+    next_ = (next_ + 1) % kSlots;
+    return slot.path;
+  }
+
+  const std::string &path() const { return path_; }
+};
+
+#endif
@@ -0,0 +1,237 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+
+// Lock-free log-linear histogram of durations in nanoseconds. Every power of
+// two is split into 8 buckets, so recorded values are kept to within 12.5%.
+class LatencyHistogram {
+private:
+  static const int kSubBuckets = 8;
+  static const int kBuckets = 64 * kSubBuckets;
+
+  std::atomic<uint64_t> counts_[kBuckets];
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> sum_;
+  std::atomic<uint64_t> max_;
+
+  static int index(uint64_t ns) {
+    if (ns < kSubBuckets) {
+      return static_cast<int>(ns);
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    return (msb - 2) * kSubBuckets + static_cast<int>((ns >> (msb - 3)) & 7);
+  }
+
+  // Exclusive upper bound of a bucket
+  static uint64_t upperBound(int bucket) {
+    if (bucket < kSubBuckets) {
+      return bucket + 1;
+    }
+    int shift = bucket / kSubBuckets - 1;
+    uint64_t lower = uint64_t(kSubBuckets + bucket % kSubBuckets) << shift;
+    return lower + (uint64_t(1) << shift);
+  }
+
+public:
+  LatencyHistogram() : count_(0), sum_(0), max_(0) {
+    for (std::atomic<uint64_t> &count : counts_) {
+      count.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  void record(uint64_t ns) {
+    counts_[index(ns)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    while (ns > max &&
+           !max_.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+    }
+  }
+
+  void record(std::chrono::steady_clock::duration elapsed) {
+    record(static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+  }
+
+  uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+  uint64_t sumNs() const { return sum_.load(std::memory_order_relaxed); }
+  uint64_t maxNs() const { return max_.load(std::memory_order_relaxed); }
+
+  // Upper bound of the bucket holding the q-th quantile, 0 if empty
+  uint64_t quantileNs(double q) const {
+    uint64_t total = count();
+    if (total == 0) {
+      return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(q * (total - 1)) + 1;
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < kBuckets; ++bucket) {
+      seen += counts_[bucket].load(std::memory_order_relaxed);
+      if (seen >= rank) {
+        return std::min(upperBound(bucket), maxNs());
+      }
+    }
+    return maxNs();
+  }
+
+  // Number of values recorded below limitNs, counting only whole buckets
+  uint64_t countBelow(uint64_t limitNs) const {
+    uint64_t below = 0;
+    for (int bucket = 0; bucket < kBuckets && upperBound(bucket) <= limitNs;
+         ++bucket) {
+      below += counts_[bucket].load(std::memory_order_relaxed);
+    }
+    return below;
+  }
+};
+
+// Records the time from construction to destruction
+class ScopedTimer {
+private:
+  LatencyHistogram &histogram_;
+  std::chrono::steady_clock::time_point start_;
+
+public:
+  explicit ScopedTimer(LatencyHistogram &histogram)
+      : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+
+  ~ScopedTimer() {
+    histogram_.record(std::chrono::steady_clock::now() - start_);
+  }
+};
+
+// Writes metrics in the Prometheus text format
+class PrometheusWriter {
+private:
+  std::ostream &out_;
+  std::string labels_;
+
+public:
+  // labels are added to every sample, e.g. detector="EIGER_1"
+  PrometheusWriter(std::ostream &out, const std::string &labels)
+      : out_(out), labels_(labels) {
+    out_ << std::setprecision(9);
+  }
+
+  void counter(const std::string &name, const std::string &help,
+               uint64_t value) {
+    out_ << "# HELP " << name << " " << help << "\n# TYPE " << name
+         << " counter\n"
+         << name << "{" << labels_ << "} " << value << "\n";
+  }
+
+  void gauge(const std::string &name, const std::string &help, double value) {
+    out_ << "# HELP " << name << " " << help << "\n# TYPE " << name
+         << " gauge\n"
+         << name << "{" << labels_ << "} " << value << "\n";
+  }
+
+  void histogramHeader(const std::string &name, const std::string &help) {
+    out_ << "# HELP " << name << " " << help << "\n# TYPE " << name
+         << " histogram\n";
+  }
+
+  // One series of a histogram in seconds, told apart by the stage label
+  void histogram(const std::string &name, const std::string &stage,
+                 const LatencyHistogram &histogram) {
+    static const double kLimits[] = {0.0001, 0.00025, 0.0005, 0.001, 0.0025,
+                                     0.005,  0.01,    0.025,  0.05,  0.1,
+                                     0.25,   0.5,     1.0,    2.5,   5.0,
+                                     10.0};
+    std::string labels = labels_ + ",stage=\"" + stage + "\"";
+    for (double limit : kLimits) {
+      out_ << name << "_bucket{" << labels << ",le=\"" << limit << "\"} "
+           << histogram.countBelow(static_cast<uint64_t>(limit * 1e9)) << "\n";
+    }
+    out_ << name << "_bucket{" << labels << ",le=\"+Inf\"} "
+         << histogram.count() << "\n"
+         << name << "_sum{" << labels << "} " << histogram.sumNs() / 1e9
+         << "\n"
+         << name << "_count{" << labels << "} " << histogram.count() << "\n";
+  }
+};
+
+// Periodically rewrites a Prometheus textfile, e.g. for the node exporter's
+// textfile collector. The file is replaced atomically so it is never read
+// half written.
+class StatsTextfile {
+private:
+  std::string path_;
+  std::chrono::milliseconds interval_;
+  std::function<void(std::ostream &)> write_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool running_;
+  std::thread thread_;
+
+  void writeFile() {
+    std::ostringstream text;
+    write_(text);
+    std::string temporary = path_ + ".tmp";
+    {
+      std::ofstream file(temporary);
+      if (!file.is_open()) {
+        return;
+      }
+      file << text.str();
+    }
+    std::rename(temporary.c_str(), path_.c_str());
+  }
+
+  void loop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (running_) {
+      wake_.wait_for(lock, interval_);
+      lock.unlock();
+      writeFile();
+      lock.lock();
+    }
+  }
+
+public:
+  StatsTextfile(const std::string &path, std::chrono::milliseconds interval,
+                std::function<void(std::ostream &)> write)
+      : path_(path), interval_(interval), write_(std::move(write)),
+        running_(false) {}
+
+  ~StatsTextfile() { stop(); }
+
+  void start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_) {
+      return;
+    }
+    running_ = true;
+    thread_ = std::thread(&StatsTextfile::loop, this);
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!running_) {
+        return;
+      }
+      running_ = false;
+    }
+    wake_.notify_all();
+    thread_.join();
+  }
+};
+
+#endif
@@ -0,0 +1,166 @@
+#ifndef TANGO_METADATA_CACHE_H
+#define TANGO_METADATA_CACHE_H
+
+#include "MetadataSource.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tango.h>
+#include <vector>
+
+// Keeps one long-lived proxy to the detector device. Attributes are pushed
+// through change events where the device has them configured; otherwise they
+// are read in one batched call whenever the snapshot is older than maxAge.
+class TangoMetadataCache : public Tango::CallBack, public MetadataSource {
+private:
+  std::string deviceName_;
+  std::chrono::milliseconds maxAge_;
+  std::unique_ptr<Tango::DeviceProxy> device_;
+  std::vector<std::string> attributes_;
+  std::vector<int> eventIds_;
+  bool subscribed_;
+  bool eventError_;
+  bool valid_;
+  mutable std::mutex mutex_;
+  FrameMetadata snapshot_;
+
+  static std::string lower(std::string name) {
+    std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) {
+      return static_cast<char>(std::tolower(c));
+    });
+    return name;
+  }
+
+  // Event attribute names are fully qualified, so match on the last part
+  void apply(Tango::DeviceAttribute &attribute) {
+    std::string name = lower(attribute.get_name());
+    size_t slash = name.rfind('/');
+    if (slash != std::string::npos) {
+      name = name.substr(slash + 1);
+    }
+    double value = 0.0;
+    if (attribute.is_empty() || !(attribute >> value)) {
+      return;
+    }
+
+    if (name == "beamcenterx") {
+      snapshot_.bcX = value;
+    } else if (name == "beamcentery") {
+      snapshot_.bcY = value;
+    } else if (name == "detectordistance") {
+      snapshot_.dDistance = value;
+    } else if (name == "incidentenergy") {
+      snapshot_.incidentEnergy = value;
+      // Convert energy to wavelength (assuming energy is in eV)
+      snapshot_.incidentWavelength = value > 0.0 ? 12400.0 / value : 0.0;
+    }
+    snapshot_.updated = std::chrono::steady_clock::now();
+  }
+
+  // Called without mutex_ held, Tango waits for callbacks in flight
+  void unsubscribe(const std::vector<int> &ids) {
+    for (int id : ids) {
+      try {
+        device_->unsubscribe_event(id);
+      } catch (Tango::DevFailed &) {
+        // The device may already be gone
+      }
+    }
+  }
+
+  // Called without mutex_ held, Tango pushes the first event synchronously
+  void subscribe() {
+    std::vector<int> ids;
+    try {
+      for (const std::string &attribute : attributes_) {
+        ids.push_back(
+            device_->subscribe_event(attribute, Tango::CHANGE_EVENT, this));
+      }
+    } catch (Tango::DevFailed &) {
+      std::cerr << "Change events not available on " << deviceName_
+                << ", polling attributes instead" << std::endl;
+      unsubscribe(ids);
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    eventIds_ = ids;
+    subscribed_ = true;
+  }
+
+  // Caller holds mutex_
+  void refreshLocked() {
+    std::unique_ptr<std::vector<Tango::DeviceAttribute>> values(
+        device_->read_attributes(attributes_));
+    if (values) {
+      for (Tango::DeviceAttribute &attribute : *values) {
+        apply(attribute);
+      }
+      valid_ = true;
+    }
+  }
+
+public:
+  explicit TangoMetadataCache(
+      const std::string &deviceName,
+      std::chrono::milliseconds maxAge = std::chrono::milliseconds(1000))
+      : deviceName_(deviceName), maxAge_(maxAge),
+        attributes_({"BeamCenterX", "BeamCenterY", "DetectorDistance",
+                     "IncidentEnergy"}),
+        subscribed_(false), eventError_(false), valid_(false) {}
+
+  ~TangoMetadataCache() override {
+    if (device_) {
+      unsubscribe(eventIds_);
+    }
+  }
+
+  // Creates the proxy, reads all attributes once and subscribes to changes
+  void connect() override {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (device_) {
+        return;
+      }
+      device_.reset(new Tango::DeviceProxy(deviceName_));
+      try {
+        refreshLocked();
+      } catch (Tango::DevFailed &) {
+        // Retry with a fresh proxy on the next snapshot
+        device_.reset();
+        throw;
+      }
+    }
+    subscribe();
+  }
+
+  // Returns the cached values, re-reading them if they were not pushed and
+  // have become stale. Throws Tango::DevFailed if the device cannot be read.
+  FrameMetadata snapshot() override {
+    connect();
+    std::lock_guard<std::mutex> lock(mutex_);
+    bool polling = !subscribed_ || eventError_;
+    if (!valid_ ||
+        (polling && std::chrono::steady_clock::now() - snapshot_.updated >
+                        maxAge_)) {
+      refreshLocked();
+    }
+    return snapshot_;
+  }
+
+  void push_event(Tango::EventData *event) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (event->err || !event->attr_value) {
+      // Poll until Tango has re-established the subscription
+      eventError_ = true;
+      return;
+    }
+    eventError_ = false;
+    apply(*event->attr_value);
+  }
+};
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads for splitting one frame's work into ranges.
+// parallelFor blocks until every range has been processed; the calling
+// thread works on ranges too. The first exception a range throws is
+// rethrown to the caller once the ranges already started have finished;
+// ranges not started yet are skipped.
+class ThreadPool {
+private:
+  std::vector<std::thread> workers_;
+  std::mutex callMutex_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+  const std::function<void(size_t, size_t)> *task_;
+  size_t count_;
+  size_t chunk_;
+  size_t next_;
+  size_t remaining_;
+  uint64_t generation_;
+  std::exception_ptr error_;
+  bool stopping_;
+
+  // Claims and runs chunks of the current task until none are left
+  void work(std::unique_lock<std::mutex> &lock) {
+    while (next_ < count_) {
+      size_t begin = next_;
+      size_t end = std::min(begin + chunk_, count_);
+      next_ = end;
+      const std::function<void(size_t, size_t)> &task = *task_;
+      lock.unlock();
+      std::exception_ptr error;
+      try {
+        task(begin, end);
+      } catch (...) {
+        error = std::current_exception();
+      }
+      lock.lock();
+      remaining_ -= end - begin;
+      if (error) {
+        if (!error_) {
+          error_ = error;
+        }
+        remaining_ -= count_ - next_;
+        next_ = count_;
+      }
+      if (remaining_ == 0) {
+        done_.notify_all();
+      }
+    }
+  }
+
+  void workerLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    uint64_t seen = 0;
+    for (;;) {
+      wake_.wait(lock, [&] { return stopping_ || generation_ != seen; });
+      if (stopping_) {
+        return;
+      }
+      seen = generation_;
+      work(lock);
+    }
+  }
+
+public:
+  explicit ThreadPool(size_t threads = std::thread::hardware_concurrency())
+      : task_(nullptr), count_(0), chunk_(1), next_(0), remaining_(0),
+        generation_(0), stopping_(false) {
+    // The caller takes part in parallelFor, so start one thread fewer
+    size_t workers = threads > 1 ? threads - 1 : 0;
+    for (size_t i = 0; i < workers; ++i) {
+      workers_.emplace_back(&ThreadPool::workerLoop, this);
+    }
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread &worker : workers_) {
+      worker.join();
+    }
+  }
+
+  size_t size() const { return workers_.size() + 1; }
+
+  // Calls task(begin, end) over [0, count) in chunks of at least minChunk.
+  // Concurrent callers are served one after the other.
+  void parallelFor(size_t count, const std::function<void(size_t, size_t)> &task,
+                   size_t minChunk = 1) {
+    if (count == 0) {
+      return;
+    }
+    size_t chunk = std::max(minChunk, (count + size() * 4 - 1) / (size() * 4));
+    if (workers_.empty() || chunk >= count) {
+      task(0, count);
+      return;
+    }
+
+    std::lock_guard<std::mutex> call(callMutex_);
+    std::unique_lock<std::mutex> lock(mutex_);
+    task_ = &task;
+    count_ = count;
+    chunk_ = chunk;
+    next_ = 0;
+    remaining_ = count;
+    ++generation_;
+    wake_.notify_all();
+    work(lock);
+    done_.wait(lock, [this] { return remaining_ == 0; });
+    task_ = nullptr;
+    if (error_) {
+      std::exception_ptr error = error_;
+      error_ = nullptr;
+      std::rethrow_exception(error);
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,276 @@
+#ifndef TIFF_MEMORY_READER_H
+#define TIFF_MEMORY_READER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <tiffio.h>
+#include <vector>
+
+// Rectangle of detector pixels; an empty one stands for the whole frame
+struct PixelRect {
+  uint32_t x = 0;
+  uint32_t y = 0;
+  uint32_t width = 0;
+  uint32_t height = 0;
+
+  bool empty() const { return width == 0 || height == 0; }
+
+  // Shrinks the rectangle to at most the frame and moves it inside, keeping
+  // its size where possible
+  PixelRect fit(uint32_t frameWidth, uint32_t frameHeight) const {
+    PixelRect rect = *this;
+    rect.width = std::min(rect.width, frameWidth);
+    rect.height = std::min(rect.height, frameHeight);
+    rect.x = std::min(rect.x, frameWidth - rect.width);
+    rect.y = std::min(rect.y, frameHeight - rect.height);
+    return rect;
+  }
+
+  bool covers(uint32_t frameWidth, uint32_t frameHeight) const {
+    return x == 0 && y == 0 && width == frameWidth && height == frameHeight;
+  }
+};
+
+// Decoded monitor image. For uncompressed little-endian uint32 TIFFs the
+// pixels point straight into the received buffer, otherwise they point into
+// storage. The source buffer must outlive a zero-copy image.
+struct TiffImage {
+  uint32_t width = 0;
+  uint32_t height = 0;
+  double pixelSizeX = 0.0;
+  double pixelSizeY = 0.0;
+  // Detector pixel of the first image pixel when the image is cropped
+  uint32_t originX = 0;
+  uint32_t originY = 0;
+  const uint32_t *pixels = nullptr;
+  bool zeroCopy = false;
+  std::vector<uint32_t> storage;
+
+  size_t pixelCount() const { return static_cast<size_t>(width) * height; }
+};
+
+// Reads TIFF images from memory through TIFFClientOpen instead of a
+// temporary file.
+class TiffMemoryReader {
+private:
+  struct Source {
+    const uint8_t *data;
+    toff_t size;
+    toff_t position;
+  };
+
+  static tmsize_t readProc(thandle_t handle, void *buf, tmsize_t size) {
+    Source *src = static_cast<Source *>(handle);
+    if (src->position >= src->size) {
+      return 0;
+    }
+    toff_t remaining = src->size - src->position;
+    toff_t n = static_cast<toff_t>(size) < remaining ? size : remaining;
+    std::memcpy(buf, src->data + src->position, n);
+    src->position += n;
+    return static_cast<tmsize_t>(n);
+  }
+
+  static tmsize_t writeProc(thandle_t, void *, tmsize_t) { return 0; }
+
+  static toff_t seekProc(thandle_t handle, toff_t offset, int whence) {
+    Source *src = static_cast<Source *>(handle);
+    switch (whence) {
+    case SEEK_SET:
+      src->position = offset;
+      break;
+    case SEEK_CUR:
+      src->position += offset;
+      break;
+    case SEEK_END:
+      src->position = src->size + offset;
+      break;
+    }
+    return src->position;
+  }
+
+  static int closeProc(thandle_t) { return 0; }
+
+  static toff_t sizeProc(thandle_t handle) {
+    return static_cast<Source *>(handle)->size;
+  }
+
+  // Lets libtiff read strips straight from the buffer
+  static int mapProc(thandle_t handle, void **base, toff_t *size) {
+    Source *src = static_cast<Source *>(handle);
+    *base = const_cast<uint8_t *>(src->data);
+    *size = src->size;
+    return 1;
+  }
+
+  static void unmapProc(thandle_t, void *, toff_t) {}
+
+  // Returns the offset of the pixel data if the strips are stored raw and
+  // back to back, so they can be used in place.
+  static bool contiguousPixels(TIFF *tif, const Source &src, uint32_t width,
+                               uint32_t height, toff_t &pixelOffset) {
+    uint16_t compression = 0, bitsPerSample = 0, samplesPerPixel = 0,
+             planarConfig = 0;
+    TIFFGetFieldDefaulted(tif, TIFFTAG_COMPRESSION, &compression);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &bitsPerSample);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &samplesPerPixel);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planarConfig);
+    if (compression != COMPRESSION_NONE || bitsPerSample != 32 ||
+        samplesPerPixel != 1 || planarConfig != PLANARCONFIG_CONTIG ||
+        TIFFIsByteSwapped(tif)) {
+      return false;
+    }
+
+    toff_t *offsets = nullptr;
+    toff_t *byteCounts = nullptr;
+    if (!TIFFGetField(tif, TIFFTAG_STRIPOFFSETS, &offsets) ||
+        !TIFFGetField(tif, TIFFTAG_STRIPBYTECOUNTS, &byteCounts)) {
+      return false;
+    }
+
+    uint32_t numStrips = TIFFNumberOfStrips(tif);
+    for (uint32_t strip = 1; strip < numStrips; ++strip) {
+      if (offsets[strip] != offsets[strip - 1] + byteCounts[strip - 1]) {
+        return false;
+      }
+    }
+
+    toff_t pixelBytes = static_cast<toff_t>(width) * height * sizeof(uint32_t);
+    pixelOffset = offsets[0];
+    if (pixelOffset % alignof(uint32_t) != 0 ||
+        reinterpret_cast<uintptr_t>(src.data) % alignof(uint32_t) != 0 ||
+        pixelOffset > src.size || src.size - pixelOffset < pixelBytes) {
+      return false;
+    }
+    return true;
+  }
+
+  // Decodes only the strips that hold rows of rect and keeps its columns
+  static bool decodeStrips(TIFF *tif, uint32_t width, const PixelRect &rect,
+                           TiffImage &image) {
+    uint32_t rowsPerStrip = 0;
+    TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &rowsPerStrip);
+    rowsPerStrip = std::max<uint32_t>(1, std::min(rowsPerStrip, image.height));
+    std::vector<uint32_t> strip(static_cast<size_t>(rowsPerStrip) * width);
+    uint32_t lastRow = rect.y + rect.height;
+    for (uint32_t first = rect.y / rowsPerStrip * rowsPerStrip; first < lastRow;
+         first += rowsPerStrip) {
+      tmsize_t n = TIFFReadEncodedStrip(tif, first / rowsPerStrip, strip.data(),
+                                        strip.size() * sizeof(uint32_t));
+      if (n == -1) {
+        std::cerr << "Error: Failed to read strip " << first / rowsPerStrip << std::endl;
+        return false;
+      }
+      uint32_t rows = static_cast<uint32_t>(n / (width * sizeof(uint32_t)));
+      for (uint32_t row = std::max(first, rect.y); row < std::min(first + rows, lastRow);
+           ++row) {
+        std::memcpy(image.storage.data() + static_cast<size_t>(row - rect.y) * rect.width,
+                    strip.data() + static_cast<size_t>(row - first) * width + rect.x,
+                    rect.width * sizeof(uint32_t));
+      }
+    }
+    return true;
+  }
+
+public:
+  // Copies rect out of a width pixels wide frame into the image's storage
+  static void crop(const uint32_t *pixels, uint32_t width, const PixelRect &rect,
+                   TiffImage &image) {
+    image.storage.resize(static_cast<size_t>(rect.width) * rect.height);
+    for (uint32_t row = 0; row < rect.height; ++row) {
+      std::memcpy(image.storage.data() + static_cast<size_t>(row) * rect.width,
+                  pixels + static_cast<size_t>(rect.y + row) * width + rect.x,
+                  rect.width * sizeof(uint32_t));
+    }
+    image.width = rect.width;
+    image.height = rect.height;
+    image.originX = rect.x;
+    image.originY = rect.y;
+    image.pixels = image.storage.data();
+    image.zeroCopy = false;
+  }
+
+  // With a region of interest only its pixels are kept, decoding only the
+  // strips it crosses; memory and decode time follow its size
+  static bool decode(const uint8_t *data, size_t size, TiffImage &image,
+                     const PixelRect &roi = PixelRect()) {
+    Source src{data, static_cast<toff_t>(size), 0};
+    TIFF *tif = TIFFClientOpen("monitor", "r", &src, readProc, writeProc,
+                               seekProc, closeProc, sizeProc, mapProc,
+                               unmapProc);
+    if (!tif) {
+      std::cerr << "Error: Unable to open TIFF data" << std::endl;
+      return false;
+    }
+
+    uint32_t width = 0, height = 0;
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+    image.width = width;
+    image.height = height;
+    image.originX = 0;
+    image.originY = 0;
+
+    // libtiff returns the resolution tags as float
+    float pixelSizeX = 0.0f, pixelSizeY = 0.0f;
+    TIFFGetField(tif, TIFFTAG_XRESOLUTION, &pixelSizeX);
+    TIFFGetField(tif, TIFFTAG_YRESOLUTION, &pixelSizeY);
+    image.pixelSizeX = pixelSizeX;
+    image.pixelSizeY = pixelSizeY;
+
+    PixelRect rect = roi.empty() ? roi : roi.fit(width, height);
+    bool cropped = !rect.empty() && !rect.covers(width, height);
+
+    toff_t pixelOffset = 0;
+    if (contiguousPixels(tif, src, width, height, pixelOffset)) {
+      if (cropped) {
+        crop(reinterpret_cast<const uint32_t *>(data + pixelOffset), width, rect, image);
+        TIFFClose(tif);
+        return true;
+      }
+      image.pixels = reinterpret_cast<const uint32_t *>(data + pixelOffset);
+      image.zeroCopy = true;
+      image.storage.clear();
+      TIFFClose(tif);
+      return true;
+    }
+
+    // Compressed or scattered strips are decoded into owned storage
+    if (cropped) {
+      image.storage.resize(static_cast<size_t>(rect.width) * rect.height);
+      bool ok = decodeStrips(tif, width, rect, image);
+      TIFFClose(tif);
+      image.width = rect.width;
+      image.height = rect.height;
+      image.originX = rect.x;
+      image.originY = rect.y;
+      image.pixels = image.storage.data();
+      image.zeroCopy = false;
+      return ok;
+    }
+    image.storage.resize(image.pixelCount());
+    uint8_t *dst = reinterpret_cast<uint8_t *>(image.storage.data());
+    tmsize_t remaining = image.storage.size() * sizeof(uint32_t);
+    uint32_t numStrips = TIFFNumberOfStrips(tif);
+    for (uint32_t strip = 0; strip < numStrips && remaining > 0; ++strip) {
+      tmsize_t n = TIFFReadEncodedStrip(tif, strip, dst, remaining);
+      if (n == -1) {
+        std::cerr << "Error: Failed to read strip " << strip << std::endl;
+        TIFFClose(tif);
+        return false;
+      }
+      dst += n;
+      remaining -= n;
+    }
+    TIFFClose(tif);
+
+    image.pixels = image.storage.data();
+    image.zeroCopy = false;
+    return true;
+  }
+};
+
+#endif
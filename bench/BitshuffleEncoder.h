@@ -0,0 +1,121 @@
+#ifndef BITSHUFFLE_ENCODER_H
+#define BITSHUFFLE_ENCODER_H
+
+#include "../BitshuffleLz4.h"
+#include <algorithm>
+#include <cstdint>
+#include <lz4.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Encoders for the stream payloads, the inverse of the decoders in
+// BitshuffleLz4.h
+namespace bitshuffle {
+
+// Default block size of the bitshuffle library
+const size_t kEncodeBlockBytes = 8192;
+
+inline void putUint64BE(std::string &out, uint64_t value) {
+  for (int i = 7; i >= 0; --i) {
+    out.push_back(static_cast<char>(value >> (8 * i)));
+  }
+}
+
+inline void putUint32BE(std::string &out, uint32_t value) {
+  for (int i = 3; i >= 0; --i) {
+    out.push_back(static_cast<char>(value >> (8 * i)));
+  }
+}
+
+inline std::string encodeLz4(const uint8_t *src, size_t size) {
+  std::string out(LZ4_compressBound(static_cast<int>(size)), '\0');
+  int n = LZ4_compress_default(reinterpret_cast<const char *>(src), &out[0],
+                               static_cast<int>(size),
+                               static_cast<int>(out.size()));
+  if (n <= 0) {
+    throw std::runtime_error("LZ4 compression failed");
+  }
+  out.resize(n);
+  return out;
+}
+
+// Bit shuffles one block of n elements (n a multiple of 8); the 8x8
+// transpose is its own inverse, see unshuffleBlock
+inline void shuffleBlock(const uint8_t *in, uint8_t *out, size_t n,
+                         size_t elemSize) {
+  const size_t planeBytes = n / 8;
+  for (size_t j = 0; j < elemSize; ++j) {
+    uint8_t *planes = out + j * 8 * planeBytes;
+    for (size_t i = 0; i < planeBytes; ++i) {
+      uint64_t x = 0;
+      for (size_t m = 0; m < 8; ++m) {
+        x |= uint64_t(in[(i * 8 + m) * elemSize + j]) << (8 * m);
+      }
+      x = transpose8x8(x);
+      for (size_t k = 0; k < 8; ++k) {
+        planes[k * planeBytes + i] = static_cast<uint8_t>(x >> (8 * k));
+      }
+    }
+  }
+}
+
+// Compressed blocks of a bitshuffle-LZ4 payload, kept apart so a frame that
+// differs in a few pixels only needs those blocks encoded again
+struct EncodedFrame {
+  size_t bytes = 0;
+  size_t elemSize = 0;
+  size_t blockElems = 0;
+  std::vector<std::string> blocks;
+  std::string leftover;
+
+  void encodeBlock(const uint8_t *src, size_t block) {
+    size_t totalElems = bytes / elemSize;
+    size_t shuffledElems = totalElems - totalElems % 8;
+    size_t first = block * blockElems;
+    size_t elems = std::min(blockElems, shuffledElems - first);
+    std::vector<uint8_t> shuffled(elems * elemSize);
+    shuffleBlock(src + first * elemSize, shuffled.data(), elems, elemSize);
+    blocks[block] = encodeLz4(shuffled.data(), shuffled.size());
+  }
+
+  // Block holding the given element, or blocks.size() if it is stored raw
+  size_t blockOf(size_t elem) const {
+    size_t totalElems = bytes / elemSize;
+    return elem < totalElems - totalElems % 8 ? elem / blockElems
+                                              : blocks.size();
+  }
+
+  std::string payload() const {
+    std::string out;
+    putUint64BE(out, bytes);
+    putUint32BE(out, static_cast<uint32_t>(blockElems * elemSize));
+    for (const std::string &block : blocks) {
+      putUint32BE(out, static_cast<uint32_t>(block.size()));
+      out += block;
+    }
+    return out + leftover;
+  }
+};
+
+inline EncodedFrame encodeBitshuffleLz4(const uint8_t *src, size_t size,
+                                        size_t elemSize) {
+  EncodedFrame frame;
+  frame.bytes = size;
+  frame.elemSize = elemSize;
+  frame.blockElems = kEncodeBlockBytes / elemSize;
+  frame.blockElems -= frame.blockElems % 8;
+  size_t totalElems = size / elemSize;
+  size_t shuffledElems = totalElems - totalElems % 8;
+  frame.blocks.resize((shuffledElems + frame.blockElems - 1) / frame.blockElems);
+  for (size_t b = 0; b < frame.blocks.size(); ++b) {
+    frame.encodeBlock(src, b);
+  }
+  frame.leftover.assign(reinterpret_cast<const char *>(src) + shuffledElems * elemSize,
+                        (totalElems - shuffledElems) * elemSize);
+  return frame;
+}
+
+} // namespace bitshuffle
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef FAKE_ADXV_H
+#define FAKE_ADXV_H
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <netinet/in.h>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Listens where ADXV would and records every load_image it is sent. The
+// frame number stamped into the first pixel is read back from the SMV file
+// right away, before the writer can reuse it.
+class FakeAdxv {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Load {
+    uint32_t frameNumber;
+    Clock::time_point received;
+  };
+
+private:
+  int port_;
+  int listener_;
+  int connection_;
+  std::atomic<bool> running_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::vector<Load> loads_;
+  size_t unreadable_;
+
+  void record(const std::string &line) {
+    const std::string command = "load_image ";
+    if (line.compare(0, command.size(), command) != 0) {
+      return;
+    }
+    Clock::time_point received = Clock::now();
+    std::string path = line.substr(command.size());
+    uint32_t frameNumber = 0;
+    int fd = open(path.c_str(), O_RDONLY);
+    char header[512];
+    bool ok = fd >= 0 && pread(fd, header, sizeof(header), 0) ==
+                             static_cast<ssize_t>(sizeof(header));
+    if (ok) {
+      // Frames that fit are written as 16-bit pixels
+      bool narrow = std::string(header, sizeof(header))
+                        .find("TYPE=unsigned_short;") != std::string::npos;
+      size_t size = narrow ? sizeof(uint16_t) : sizeof(uint32_t);
+      ok = pread(fd, &frameNumber, size, 512) == static_cast<ssize_t>(size);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (ok) {
+      loads_.push_back(Load{frameNumber, received});
+    } else {
+      ++unreadable_;
+    }
+  }
+
+  void serve() {
+    while (running_) {
+      int fd = accept(listener_, nullptr, nullptr);
+      if (fd < 0) {
+        continue;
+      }
+      connection_ = fd;
+      std::string input;
+      char chunk[1024];
+      ssize_t n;
+      while ((n = recv(fd, chunk, sizeof(chunk), 0)) > 0) {
+        input.append(chunk, n);
+        size_t end;
+        while ((end = input.find('\n')) != std::string::npos) {
+          record(input.substr(0, end));
+          input.erase(0, end + 1);
+        }
+      }
+      connection_ = -1;
+      close(fd);
+    }
+  }
+
+public:
+  explicit FakeAdxv(int port)
+      : port_(port), listener_(-1), connection_(-1), running_(false),
+        unreadable_(0) {}
+
+  ~FakeAdxv() { stop(); }
+
+  void start() {
+    listener_ = socket(AF_INET, SOCK_STREAM, 0);
+    int flag = 1;
+    setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+    struct sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port_);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener_, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(listener_, 4) != 0) {
+      close(listener_);
+      throw std::runtime_error("Unable to listen on port " +
+                               std::to_string(port_));
+    }
+    running_ = true;
+    thread_ = std::thread(&FakeAdxv::serve, this);
+  }
+
+  void stop() {
+    if (!running_) {
+      return;
+    }
+    running_ = false;
+    shutdown(listener_, SHUT_RDWR);
+    close(listener_);
+    int connection = connection_;
+    if (connection >= 0) {
+      shutdown(connection, SHUT_RDWR);
+    }
+    thread_.join();
+  }
+
+  std::vector<Load> loads() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return loads_;
+  }
+
+  size_t unreadable() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return unreadable_;
+  }
+};
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef FAKE_METADATA_SOURCE_H
+#define FAKE_METADATA_SOURCE_H
+
+#include "../MetadataSource.h"
+#include <chrono>
+#include <thread>
+
+// Fixed detector geometry in place of the Tango device. An optional delay
+// stands in for the cost of a device read.
+class FakeMetadataSource : public MetadataSource {
+private:
+  FrameMetadata values_;
+  std::chrono::microseconds delay_;
+
+public:
+  explicit FakeMetadataSource(
+      std::chrono::microseconds delay = std::chrono::microseconds(0))
+      : delay_(delay) {
+    values_.bcX = 2074.0;
+    values_.bcY = 2181.0;
+    values_.dDistance = 0.2;
+    values_.incidentEnergy = 12400.0;
+    values_.incidentWavelength = 1.0;
+  }
+
+  FrameMetadata snapshot() override {
+    if (delay_.count() > 0) {
+      std::this_thread::sleep_for(delay_);
+    }
+    // Called from the decode stage too when capturing, values_ stays as is
+    FrameMetadata values = values_;
+    values.updated = std::chrono::steady_clock::now();
+    return values;
+  }
+};
+
+#endif
@@ -0,0 +1,500 @@
+#ifndef MOCK_EIGER_SERVER_H
+#define MOCK_EIGER_SERVER_H
+
+#include "../TiffMemoryReader.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+// Uncompressed single strip uint32 TIFF like the ones the monitor serves.
+// The first pixel holds the frame number so the receiving end can tell
+// which frame it got.
+class TiffEncoder {
+private:
+  static void put16(std::string &out, uint16_t value) {
+    out.append(reinterpret_cast<const char *>(&value), 2);
+  }
+
+  static void put32(std::string &out, uint32_t value) {
+    out.append(reinterpret_cast<const char *>(&value), 4);
+  }
+
+  static void entry(std::string &out, uint16_t tag, uint16_t type,
+                    uint32_t count, uint32_t value) {
+    put16(out, tag);
+    put16(out, type);
+    put32(out, count);
+    put32(out, value);
+  }
+
+public:
+  static const size_t kPixelOffset = 256;
+
+  static std::string encode(uint32_t width, uint32_t height,
+                            const uint32_t *pixels) {
+    const uint16_t kShort = 3, kLong = 4, kRational = 5;
+    const uint16_t entries = 12;
+    const uint32_t resolutionOffset = 8 + 2 + entries * 12 + 4;
+    uint32_t pixelBytes = width * height * sizeof(uint32_t);
+
+    std::string out("II\x2a\x00", 4);
+    put32(out, 8);
+    put16(out, entries);
+    entry(out, 256, kLong, 1, width);
+    entry(out, 257, kLong, 1, height);
+    entry(out, 258, kShort, 1, 32);
+    entry(out, 259, kShort, 1, 1);
+    entry(out, 262, kShort, 1, 1);
+    entry(out, 273, kLong, 1, kPixelOffset);
+    entry(out, 277, kShort, 1, 1);
+    entry(out, 278, kLong, 1, height);
+    entry(out, 279, kLong, 1, pixelBytes);
+    entry(out, 282, kRational, 1, resolutionOffset);
+    entry(out, 283, kRational, 1, resolutionOffset + 8);
+    entry(out, 339, kShort, 1, 1);
+    put32(out, 0);
+    // 0.075 mm pixels, as on the Eiger
+    for (int i = 0; i < 2; ++i) {
+      put32(out, 75);
+      put32(out, 1000);
+    }
+    out.resize(kPixelOffset, '\0');
+    out.append(reinterpret_cast<const char *>(pixels), pixelBytes);
+    return out;
+  }
+
+  static void stamp(std::string &tiff, uint32_t frameNumber) {
+    std::memcpy(&tiff[kPixelOffset], &frameNumber, sizeof(frameNumber));
+  }
+};
+
+// Local stand-in for the detector's HTTP API. Publishes frames at a fixed
+// rate into a monitor buffer and serves them from monitor/api/1.8.0/images
+// (monitor, next, the buffered list and series/image), accepts any config
+// PUT, reports the frame size as x/y_pixels_in_detector and the detector
+// state as "acquire" while publishing.
+class MockEigerServer {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  // Sparse counts on an empty background, roughly like a diffraction image
+  static std::vector<uint32_t> syntheticPixels(uint32_t width,
+                                               uint32_t height) {
+    std::vector<uint32_t> pixels(size_t(width) * height, 0);
+    std::mt19937 random(42);
+    for (size_t i = 0; i < pixels.size() / 50; ++i) {
+      pixels[random() % pixels.size()] = random() % 1000;
+    }
+    return pixels;
+  }
+
+private:
+  struct Frame {
+    int64_t series = 0;
+    int64_t image = 0;
+    std::shared_ptr<const std::string> tiff;
+  };
+
+  int port_;
+  double rate_;
+  uint32_t width_;
+  uint32_t height_;
+  std::string templateTiff_;
+  std::vector<std::string> recorded_;
+
+  int listener_;
+  std::atomic<bool> running_;
+  std::atomic<bool> publishing_;
+  std::thread acceptor_;
+  std::thread publisher_;
+  std::mutex connectionsMutex_;
+  std::vector<int> connections_;
+  std::vector<std::thread> handlers_;
+
+  std::mutex mutex_;
+  std::condition_variable published_;
+  std::deque<Frame> buffer_;
+  size_t bufferSize_;
+  int64_t nextCursor_;
+  std::map<int64_t, Clock::time_point> firstServed_;
+  size_t publishedCount_;
+  size_t bytesServed_;
+  // CPU time the handlers spent answering requests
+  std::atomic<int64_t> serveCpuNs_;
+
+  static int64_t threadCpuNs() {
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return int64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+  }
+
+  static std::string readFile(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+      throw std::runtime_error("Unable to read " + path);
+    }
+    return std::string(std::istreambuf_iterator<char>(file),
+                       std::istreambuf_iterator<char>());
+  }
+
+  void publishLoop() {
+    auto period = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(1.0 / rate_));
+    auto next = Clock::now();
+    uint32_t frameNumber = 1;
+    while (running_) {
+      std::this_thread::sleep_until(next);
+      next += period;
+      if (!publishing_) {
+        continue;
+      }
+      const std::string &source =
+          recorded_.empty() ? templateTiff_
+                            : recorded_[(frameNumber - 1) % recorded_.size()];
+      std::shared_ptr<std::string> tiff(new std::string(source));
+      TiffEncoder::stamp(*tiff, frameNumber);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        buffer_.push_back(Frame{1, frameNumber, tiff});
+        while (buffer_.size() > bufferSize_) {
+          buffer_.pop_front();
+        }
+        ++publishedCount_;
+      }
+      published_.notify_all();
+      ++frameNumber;
+    }
+  }
+
+  static bool sendAll(int fd, const char *data, size_t size) {
+    while (size > 0) {
+      ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+      if (n <= 0) {
+        return false;
+      }
+      data += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  static bool respond(int fd, int status, const std::string &contentType,
+                      const char *body, size_t size,
+                      const std::string &extraHeaders = "") {
+    std::string reason = status == 200 ? "OK" : status == 404 ? "Not Found"
+                                             : status == 408   ? "Request Timeout"
+                                                               : "Error";
+    std::string head = "HTTP/1.1 " + std::to_string(status) + " " + reason +
+                       "\r\nContent-Type: " + contentType +
+                       "\r\nContent-Length: " + std::to_string(size) + "\r\n" +
+                       extraHeaders + "\r\n";
+    return sendAll(fd, head.data(), head.size()) && sendAll(fd, body, size);
+  }
+
+  static bool respond(int fd, int status, const std::string &contentType,
+                      const std::string &body) {
+    return respond(fd, status, contentType, body.data(), body.size());
+  }
+
+  bool sendFrame(int fd, const Frame &frame) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      firstServed_.emplace(frame.image, Clock::now());
+      bytesServed_ += frame.tiff->size();
+    }
+    std::string etag = "ETag: \"" + std::to_string(frame.series) + "-" +
+                       std::to_string(frame.image) + "\"\r\n";
+    return respond(fd, 200, "application/tiff", frame.tiff->data(),
+                   frame.tiff->size(), etag);
+  }
+
+  // images/next hands out each buffered frame once, oldest first, and
+  // blocks while there is none
+  bool serveNext(int fd) {
+    Frame frame;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      auto newer = [this] {
+        return !buffer_.empty() && buffer_.back().image > nextCursor_;
+      };
+      if (!published_.wait_for(lock, std::chrono::seconds(5),
+                               [&] { return !running_ || newer(); }) ||
+          !running_) {
+        lock.unlock();
+        return respond(fd, 408, "text/plain", "");
+      }
+      for (const Frame &buffered : buffer_) {
+        if (buffered.image > nextCursor_) {
+          frame = buffered;
+          break;
+        }
+      }
+      nextCursor_ = frame.image;
+    }
+    return sendFrame(fd, frame);
+  }
+
+  bool serveImages(int fd, const std::string &path) {
+    const std::string prefix = "/monitor/api/1.8.0/images";
+    std::string rest = path.substr(prefix.size());
+    if (rest == "/next" || rest == "/next/") {
+      return serveNext(fd);
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (rest.empty() || rest == "/") {
+      std::string list = "[";
+      for (const Frame &frame : buffer_) {
+        list += (list.size() > 1 ? "," : "") + std::string("[") +
+                std::to_string(frame.series) + "," +
+                std::to_string(frame.image) + "]";
+      }
+      list += "]";
+      lock.unlock();
+      return respond(fd, 200, "application/json", list);
+    }
+
+    const Frame *found = nullptr;
+    long long series = 0, image = 0;
+    if (rest == "/monitor" || rest == "/monitor/") {
+      found = buffer_.empty() ? nullptr : &buffer_.back();
+    } else if (std::sscanf(rest.c_str(), "/%lld/%lld", &series, &image) == 2) {
+      for (const Frame &frame : buffer_) {
+        if (frame.series == series && frame.image == image) {
+          found = &frame;
+        }
+      }
+    }
+    if (!found) {
+      lock.unlock();
+      return respond(fd, 404, "text/plain", "");
+    }
+    Frame frame = *found;
+    lock.unlock();
+    return sendFrame(fd, frame);
+  }
+
+  bool route(int fd, const std::string &method, const std::string &path,
+             const std::string &body) {
+    if (path.compare(0, 25, "/monitor/api/1.8.0/images") == 0 &&
+        method == "GET") {
+      return serveImages(fd, path);
+    }
+    if (path.find("/config/x_pixels_in_detector") != std::string::npos ||
+        path.find("/config/y_pixels_in_detector") != std::string::npos) {
+      uint32_t pixels =
+          path.find("/config/x_") != std::string::npos ? width_ : height_;
+      return respond(fd, 200, "application/json",
+                     "{\"value\": " + std::to_string(pixels) + "}");
+    }
+    if (path.find("/config/") != std::string::npos) {
+      if (method == "PUT" &&
+          path.find("/config/buffer_size") != std::string::npos) {
+        size_t colon = body.find(':');
+        if (colon != std::string::npos) {
+          std::lock_guard<std::mutex> lock(mutex_);
+          bufferSize_ = std::max(1, std::atoi(body.c_str() + colon + 1));
+        }
+      }
+      return respond(fd, 200, "application/json", "[]");
+    }
+    if (path.find("/status/state") != std::string::npos) {
+      return respond(fd, 200, "application/json",
+                     publishing_ ? "{\"value\": \"acquire\"}"
+                                 : "{\"value\": \"idle\"}");
+    }
+    return respond(fd, 404, "text/plain", "");
+  }
+
+  void handleConnection(int fd) {
+    std::string input;
+    char chunk[4096];
+    while (running_) {
+      size_t headerEnd = input.find("\r\n\r\n");
+      if (headerEnd == std::string::npos) {
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0) {
+          break;
+        }
+        input.append(chunk, n);
+        continue;
+      }
+      std::string head = input.substr(0, headerEnd);
+      size_t contentLength = 0;
+      size_t field = head.find("Content-Length:");
+      if (field == std::string::npos) {
+        field = head.find("content-length:");
+      }
+      if (field != std::string::npos) {
+        contentLength = std::strtoul(head.c_str() + field + 15, nullptr, 10);
+      }
+      while (input.size() < headerEnd + 4 + contentLength) {
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0) {
+          return;
+        }
+        input.append(chunk, n);
+      }
+      std::string body = input.substr(headerEnd + 4, contentLength);
+      input.erase(0, headerEnd + 4 + contentLength);
+
+      size_t space = head.find(' ');
+      size_t pathEnd = head.find(' ', space + 1);
+      std::string method = head.substr(0, space);
+      std::string path = head.substr(space + 1, pathEnd - space - 1);
+      int64_t cpuStart = threadCpuNs();
+      bool open = route(fd, method, path, body);
+      serveCpuNs_ += threadCpuNs() - cpuStart;
+      if (!open) {
+        break;
+      }
+    }
+  }
+
+  void acceptLoop() {
+    while (running_) {
+      int fd = accept(listener_, nullptr, nullptr);
+      if (fd < 0) {
+        continue;
+      }
+      int flag = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+      std::lock_guard<std::mutex> lock(connectionsMutex_);
+      connections_.push_back(fd);
+      handlers_.emplace_back([this, fd] {
+        handleConnection(fd);
+        shutdown(fd, SHUT_RDWR);
+      });
+    }
+  }
+
+public:
+  // tiffFiles are served round-robin instead of a synthetic frame; they are
+  // re-encoded uncompressed so the frame number can be stamped in
+  MockEigerServer(int port, double rate, uint32_t width, uint32_t height,
+                  const std::vector<std::string> &tiffFiles = {})
+      : port_(port), rate_(rate), width_(width), height_(height),
+        listener_(-1), running_(false),
+        publishing_(false), bufferSize_(8), nextCursor_(0),
+        publishedCount_(0), bytesServed_(0), serveCpuNs_(0) {
+    std::vector<uint32_t> pixels = syntheticPixels(width, height);
+    templateTiff_ = TiffEncoder::encode(width, height, pixels.data());
+    for (const std::string &path : tiffFiles) {
+      std::string data = readFile(path);
+      TiffImage image;
+      if (!TiffMemoryReader::decode(reinterpret_cast<const uint8_t *>(data.data()),
+                                    data.size(), image)) {
+        throw std::runtime_error("Unable to decode " + path);
+      }
+      recorded_.push_back(
+          TiffEncoder::encode(image.width, image.height, image.pixels));
+      width_ = image.width;
+      height_ = image.height;
+    }
+  }
+
+  ~MockEigerServer() { stop(); }
+
+  void start() {
+    listener_ = socket(AF_INET, SOCK_STREAM, 0);
+    int flag = 1;
+    setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+    struct sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port_);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener_, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(listener_, 16) != 0) {
+      close(listener_);
+      throw std::runtime_error("Unable to listen on port " +
+                               std::to_string(port_));
+    }
+    running_ = true;
+    acceptor_ = std::thread(&MockEigerServer::acceptLoop, this);
+    publisher_ = std::thread(&MockEigerServer::publishLoop, this);
+  }
+
+  // Frames are only published between startAcquisition and stopAcquisition
+  void startAcquisition() { publishing_ = true; }
+  void stopAcquisition() { publishing_ = false; }
+
+  void stop() {
+    if (!running_) {
+      return;
+    }
+    running_ = false;
+    publishing_ = false;
+    published_.notify_all();
+    shutdown(listener_, SHUT_RDWR);
+    close(listener_);
+    acceptor_.join();
+    publisher_.join();
+    {
+      std::lock_guard<std::mutex> lock(connectionsMutex_);
+      for (int fd : connections_) {
+        shutdown(fd, SHUT_RDWR);
+      }
+    }
+    for (std::thread &handler : handlers_) {
+      handler.join();
+    }
+    for (int fd : connections_) {
+      close(fd);
+    }
+  }
+
+  // When the given frame number was first sent to a client
+  bool servedAt(uint32_t frameNumber, Clock::time_point &when) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = firstServed_.find(frameNumber);
+    if (it == firstServed_.end()) {
+      return false;
+    }
+    when = it->second;
+    return true;
+  }
+
+  size_t published() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return publishedCount_;
+  }
+
+  size_t served() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return firstServed_.size();
+  }
+
+  size_t bytesServed() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytesServed_;
+  }
+
+  // CPU time spent answering requests, to tell the mock's share of the
+  // process CPU from the receiver's
+  double cpuSeconds() const { return serveCpuNs_ / 1e9; }
+};
+
+#endif
@@ -0,0 +1,213 @@
+#ifndef MOCK_STREAM_PUBLISHER_H
+#define MOCK_STREAM_PUBLISHER_H
+
+#include "BitshuffleEncoder.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zmq.h>
+
+// Pushes frames like the detector's ZeroMQ stream interface (API 1.x): a
+// dheader-1.0 with the detector config when the acquisition starts, then per
+// frame dimage-1.0, dimage_d-1.0, the bitshuffle-LZ4 blob and dconfig-1.0,
+// and a dseries_end-1.0 at the end. The first pixel holds the frame number
+// as for MockEigerServer; only the block holding it is compressed again per
+// frame, so the publisher keeps up with large frames.
+class MockStreamPublisher {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+private:
+  int port_;
+  double rate_;
+  uint32_t width_;
+  uint32_t height_;
+  size_t elemSize_;
+  std::vector<uint8_t> pixels_;
+  bitshuffle::EncodedFrame encoded_;
+
+  void *context_;
+  void *socket_;
+  std::atomic<bool> running_;
+  std::atomic<bool> publishing_;
+  std::thread publisher_;
+
+  std::mutex mutex_;
+  std::map<int64_t, Clock::time_point> sent_;
+  size_t publishedCount_;
+  size_t bytesSent_;
+
+  std::string typeName() const {
+    return elemSize_ == 4 ? "uint32" : elemSize_ == 2 ? "uint16" : "uint8";
+  }
+
+  // Sends the parts as one multipart message; false if nobody took it in time
+  bool send(const std::vector<std::string> &parts) {
+    for (size_t i = 0; i < parts.size(); ++i) {
+      int flags = i + 1 < parts.size() ? ZMQ_SNDMORE : 0;
+      if (zmq_send(socket_, parts[i].data(), parts[i].size(), flags) < 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void stamp(uint32_t frameNumber) {
+    // Narrow frames keep the number below their gap value
+    uint32_t value = elemSize_ == 4 ? frameNumber
+                                    : frameNumber % ((1u << (8 * elemSize_)) - 1);
+    std::memcpy(pixels_.data(), &value, elemSize_);
+    size_t block = encoded_.blockOf(0);
+    if (block < encoded_.blocks.size()) {
+      encoded_.encodeBlock(pixels_.data(), block);
+    } else {
+      encoded_.leftover.assign(reinterpret_cast<const char *>(pixels_.data()),
+                               encoded_.leftover.size());
+    }
+  }
+
+  void publishLoop() {
+    auto period = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(1.0 / rate_));
+    auto next = Clock::now();
+    uint32_t frameNumber = 1;
+    bool headerSent = false;
+    while (running_) {
+      std::this_thread::sleep_until(next);
+      next += period;
+      if (!publishing_) {
+        continue;
+      }
+      if (!headerSent) {
+        headerSent = send({"{\"htype\":\"dheader-1.0\",\"series\":1,"
+                           "\"header_detail\":\"basic\"}",
+                           "{\"x_pixel_size\":7.5e-05,\"y_pixel_size\":7.5e-05,"
+                           "\"x_pixels_in_detector\":" + std::to_string(width_) +
+                               ",\"y_pixels_in_detector\":" +
+                               std::to_string(height_) + "}"});
+      }
+      stamp(frameNumber);
+      std::string blob = encoded_.payload();
+      std::vector<std::string> parts = {
+          "{\"htype\":\"dimage-1.0\",\"series\":1,\"frame\":" +
+              std::to_string(frameNumber) + ",\"hash\":\"\"}",
+          "{\"htype\":\"dimage_d-1.0\",\"shape\":[" + std::to_string(width_) +
+              "," + std::to_string(height_) + "],\"type\":\"" + typeName() +
+              "\",\"encoding\":\"bs" + std::to_string(8 * elemSize_) +
+              "-lz4<\",\"size\":" + std::to_string(blob.size()) + "}",
+          blob,
+          "{\"htype\":\"dconfig-1.0\",\"start_time\":0,\"stop_time\":0,"
+          "\"real_time\":0}"};
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++publishedCount_;
+      }
+      auto sent = Clock::now();
+      if (send(parts)) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        sent_[frameNumber] = sent;
+        bytesSent_ += blob.size();
+      }
+      ++frameNumber;
+    }
+    if (headerSent) {
+      send({"{\"htype\":\"dseries_end-1.0\",\"series\":1}"});
+    }
+  }
+
+public:
+  // elemSize is 4, 2 or 1 for uint32, uint16 or uint8 frames. pixels holds
+  // width * height counts and is narrowed, counts above the type's gap value
+  // are clamped below it.
+  MockStreamPublisher(int port, double rate, uint32_t width, uint32_t height,
+                      const std::vector<uint32_t> &pixels, size_t elemSize = 4)
+      : port_(port), rate_(rate), width_(width), height_(height),
+        elemSize_(elemSize), context_(zmq_ctx_new()), socket_(nullptr),
+        running_(false), publishing_(false), publishedCount_(0), bytesSent_(0) {
+    if (elemSize_ != 1 && elemSize_ != 2 && elemSize_ != 4) {
+      throw std::runtime_error("Unsupported stream element size");
+    }
+    pixels_.resize(pixels.size() * elemSize_);
+    uint32_t limit = elemSize_ == 4 ? 0xFFFFFFFE : (1u << (8 * elemSize_)) - 2;
+    for (size_t i = 0; i < pixels.size(); ++i) {
+      uint32_t value = std::min(pixels[i], limit);
+      std::memcpy(&pixels_[i * elemSize_], &value, elemSize_);
+    }
+    encoded_ = bitshuffle::encodeBitshuffleLz4(pixels_.data(), pixels_.size(),
+                                               elemSize_);
+  }
+
+  ~MockStreamPublisher() {
+    stop();
+    zmq_ctx_term(context_);
+  }
+
+  void start() {
+    socket_ = zmq_socket(context_, ZMQ_PUSH);
+    // Like the detector, frames wait for a receiver rather than being lost,
+    // but not beyond a second so stopping never hangs
+    int timeoutMs = 1000;
+    zmq_setsockopt(socket_, ZMQ_SNDTIMEO, &timeoutMs, sizeof(timeoutMs));
+    int linger = 0;
+    zmq_setsockopt(socket_, ZMQ_LINGER, &linger, sizeof(linger));
+    std::string endpoint = "tcp://127.0.0.1:" + std::to_string(port_);
+    if (zmq_bind(socket_, endpoint.c_str()) != 0) {
+      zmq_close(socket_);
+      socket_ = nullptr;
+      throw std::runtime_error("Unable to bind " + endpoint);
+    }
+    running_ = true;
+    publisher_ = std::thread(&MockStreamPublisher::publishLoop, this);
+  }
+
+  // Frames are only pushed between startAcquisition and stopAcquisition
+  void startAcquisition() { publishing_ = true; }
+  void stopAcquisition() { publishing_ = false; }
+
+  void stop() {
+    if (!running_) {
+      return;
+    }
+    running_ = false;
+    publishing_ = false;
+    publisher_.join();
+    zmq_close(socket_);
+    socket_ = nullptr;
+  }
+
+  // When the given frame number was pushed
+  bool servedAt(uint32_t frameNumber, Clock::time_point &when) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = sent_.find(frameNumber);
+    if (it == sent_.end()) {
+      return false;
+    }
+    when = it->second;
+    return true;
+  }
+
+  size_t published() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return publishedCount_;
+  }
+
+  size_t served() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return sent_.size();
+  }
+
+  size_t bytesServed() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytesSent_;
+  }
+};
+
+#endif
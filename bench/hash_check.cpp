@@ -0,0 +1,99 @@
+//Compile:
+//g++ bench/hash_check.cpp -o hash_check -O2
+
+//Checks that the frame content hash sees where bytes are, not only which bytes there are: frames
+//with stripes, lanes or blocks moved, or a single bit flipped, must hash apart from the original,
+//and FrameChangeDetector must take such a frame as new. Exits non-zero on the first collision.
+#include "../FrameChangeDetector.h"
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+int failures = 0;
+
+void check(bool ok, const std::string &what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+std::vector<uint8_t> randomBytes(size_t size, uint32_t seed) {
+    std::vector<uint8_t> bytes(size);
+    std::mt19937 random(seed);
+    for (uint8_t &byte : bytes) {
+        byte = static_cast<uint8_t>(random());
+    }
+    return bytes;
+}
+
+uint64_t hashOf(const std::vector<uint8_t> &bytes) {
+    return hashFrame(bytes.data(), bytes.size());
+}
+
+// Swaps the n bytes at a and b
+std::vector<uint8_t> swapped(std::vector<uint8_t> bytes, size_t a, size_t b, size_t n) {
+    std::swap_ranges(bytes.begin() + a, bytes.begin() + a + n, bytes.begin() + b);
+    return bytes;
+}
+
+void checkMoved(const std::vector<uint8_t> &original, size_t a, size_t b, size_t n,
+                const char *what) {
+    char where[64];
+    std::snprintf(where, sizeof(where), " %zu and %zu", a, b);
+    check(hashOf(swapped(original, a, b, n)) != hashOf(original), std::string(what) + where);
+}
+
+void checkDetector(const std::vector<uint8_t> &original) {
+    FrameChangeDetector changes;
+    FrameBuffer frame(original.size());
+    frame.append(original.data(), original.size());
+    check(changes.changed(frame), "first frame is new");
+    changes.accept(frame);
+    check(!changes.changed(frame), "same frame is a duplicate");
+
+    std::vector<uint8_t> moved = swapped(original, 0, 64, 64);
+    FrameBuffer other(moved.size());
+    other.append(moved.data(), moved.size());
+    check(changes.changed(other), "frame with two stripes swapped is new");
+}
+
+int main() {
+    const size_t stripe = 64, block = 16 * stripe;
+    for (uint32_t seed = 1; seed <= 4; ++seed) {
+        std::vector<uint8_t> original = randomBytes(64 * 1024 + 13, seed);
+        for (size_t s = 1; s < 16; ++s) {
+            checkMoved(original, 0, s * stripe, stripe, "stripes in a block");
+        }
+        checkMoved(original, 3 * stripe, 7 * stripe, stripe, "stripes in a block");
+        checkMoved(original, 0, block, stripe, "stripes of two blocks");
+        checkMoved(original, 0, block + 5 * stripe, stripe, "stripes of two blocks");
+        checkMoved(original, 0, block, block, "blocks");
+        checkMoved(original, 2 * block, 5 * block, block, "blocks");
+        checkMoved(original, 0, 8, 8, "lanes of a stripe");
+        checkMoved(original, 64 * 1024 - stripe, 64 * 1024, 13, "tail and last stripe");
+        for (size_t at : {size_t(0), size_t(1000), original.size() - 1}) {
+            std::vector<uint8_t> flipped = original;
+            flipped[at] ^= 1;
+            check(hashOf(flipped) != hashOf(original), "bit flipped at " + std::to_string(at));
+        }
+        checkDetector(original);
+    }
+
+    // A sparse detector frame: one count moved to another pixel
+    std::vector<uint8_t> sparse(4148 * 16 * sizeof(uint32_t), 0);
+    sparse[100 * sizeof(uint32_t)] = 7;
+    std::vector<uint8_t> moved(sparse.size(), 0);
+    moved[(100 + 16) * sizeof(uint32_t)] = 7;
+    check(hashOf(moved) != hashOf(sparse), "count moved by one stripe");
+
+    if (failures) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All frame hash checks passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,174 @@
+//Compile:
+//g++ bench/shm_latency.cpp -o shm_latency -O2 -pthread -lrt
+
+//Latency of the shared memory frame ring: a publisher process writes frames at a fixed rate and
+//a forked reader maps the ring, waits for each frame and reads it in place and as a copy.
+//With --attach, only the reader runs, against the ring of a running yamone (--shm).
+#include "../SharedFramePublisher.h"
+#include "../SharedFrameReader.h"
+#include "../Stats.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+struct LatencyOptions {
+    std::string name = "/yamone_shm_latency";
+    uint32_t width = 4148;
+    uint32_t height = 4362;
+    uint32_t slots = 4;
+    double rate = 10.0;
+    double seconds = 5.0;
+    bool attach = false;
+    int pollUs = 50;
+};
+
+void usage() {
+    std::cerr << "Usage: shm_latency [--size WxH] [--slots n] [--rate Hz] [--seconds s] "
+                 "[--poll us] [--attach /name]"
+              << std::endl;
+    std::exit(1);
+}
+
+LatencyOptions parseOptions(int argc, char *argv[]) {
+    LatencyOptions options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--size" && hasValue) {
+            if (std::sscanf(argv[++i], "%ux%u", &options.width, &options.height) != 2) {
+                usage();
+            }
+        } else if (arg == "--slots" && hasValue) {
+            options.slots = static_cast<uint32_t>(std::atoi(argv[++i]));
+        } else if (arg == "--rate" && hasValue) {
+            options.rate = std::atof(argv[++i]);
+        } else if (arg == "--seconds" && hasValue) {
+            options.seconds = std::atof(argv[++i]);
+        } else if (arg == "--poll" && hasValue) {
+            options.pollUs = std::atoi(argv[++i]);
+        } else if (arg == "--attach" && hasValue) {
+            options.name = argv[++i];
+            options.attach = true;
+        } else {
+            usage();
+        }
+    }
+    if (options.rate <= 0 || options.seconds <= 0 || options.slots == 0) {
+        usage();
+    }
+    return options;
+}
+
+void printLatency(const char *what, const LatencyHistogram &histogram) {
+    std::cout << "  " << what << ": p50 " << histogram.quantileNs(0.5) / 1e3 << " us, p99 "
+              << histogram.quantileNs(0.99) / 1e3 << " us, max " << histogram.maxNs() / 1e3
+              << " us" << std::endl;
+}
+
+volatile uint64_t checksum;
+
+// Follows the ring until it closes or nothing arrives for a second
+int runReader(const LatencyOptions &options) {
+    SharedFrameReader reader(options.name);
+    LatencyHistogram seen, read, copied;
+    size_t frames = 0, missed = 0, torn = 0, wrong = 0;
+    uint64_t last = reader.latestFrame();
+    SharedFrameReader::View view;
+    std::vector<uint32_t> copy;
+    shmframes::FrameInfo info;
+    while (reader.waitNewer(last, std::chrono::seconds(1),
+                            std::chrono::microseconds(options.pollUs))) {
+        if (!reader.latest(view)) {
+            ++torn;
+            last = reader.latestFrame();
+            continue;
+        }
+        int64_t now = shmframes::nowNs();
+        seen.record(static_cast<uint64_t>(now - view.info.publishedNs));
+        missed += view.info.frame - last - 1;
+        last = view.info.frame;
+        ++frames;
+
+        // Touch every pixel in place, as an analysis would
+        size_t count = static_cast<size_t>(view.info.width) * view.info.height;
+        uint64_t sum = 0;
+        for (size_t i = 0; i < count; ++i) {
+            sum += view.pixels[i];
+        }
+        if (!reader.valid(view)) {
+            ++torn;
+            continue;
+        }
+        read.record(static_cast<uint64_t>(shmframes::nowNs() - view.info.publishedNs));
+        if (!options.attach && view.pixels[0] != view.info.frame) {
+            ++wrong;
+        }
+        if (reader.copyLatest(copy, info)) {
+            copied.record(static_cast<uint64_t>(shmframes::nowNs() - info.publishedNs));
+        }
+        checksum = sum;
+    }
+
+    std::cout << "Reader of " << options.name << ": " << frames << " frames, missed " << missed
+              << ", torn " << torn << ", wrong " << wrong << std::endl;
+    printLatency("published -> seen", seen);
+    printLatency("published -> read in place", read);
+    printLatency("published -> copied", copied);
+    return wrong == 0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+    LatencyOptions options = parseOptions(argc, argv);
+    if (options.attach) {
+        return runReader(options);
+    }
+
+    size_t count = static_cast<size_t>(options.width) * options.height;
+    SharedFramePublisher publisher(options.name, options.slots, count);
+    pid_t child = fork();
+    if (child < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (child == 0) {
+        // _exit, so the child's copy of the publisher does not unlink the ring
+        _exit(runReader(options));
+    }
+
+    // Frame n carries n in its first pixel so the reader can check what it got
+    std::vector<uint32_t> pixels(count, 1);
+    pixels[1] = 0xFFFFFFFF;
+    shmframes::FrameInfo info = shmframes::FrameInfo();
+    info.width = options.width;
+    info.height = options.height;
+    info.pixelSizeX = info.pixelSizeY = 0.075;
+    LatencyHistogram publishTime;
+    auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(1.0 / options.rate));
+    size_t frames = static_cast<size_t>(options.rate * options.seconds);
+    auto next = std::chrono::steady_clock::now() + std::chrono::milliseconds(200);
+    for (size_t frame = 1; frame <= frames; ++frame) {
+        std::this_thread::sleep_until(next);
+        next += interval;
+        pixels[0] = static_cast<uint32_t>(frame);
+        info.imageId = static_cast<int64_t>(frame);
+        auto start = std::chrono::steady_clock::now();
+        publisher.publish(pixels.data(), info);
+        publishTime.record(std::chrono::steady_clock::now() - start);
+    }
+    std::cout << "Published " << frames << " frames of " << options.width << "x"
+              << options.height << " at " << options.rate << " Hz into " << options.slots
+              << " slots" << std::endl;
+    printLatency("publish (copy into the ring)", publishTime);
+    // Let the reader see the last frame before the ring is closed
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    int status = 0;
+    waitpid(child, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -0,0 +1,135 @@
+//Compile:
+//g++ bench/stream_check.cpp -o stream_check -O2 -pthread -llz4
+
+//Round trip of the stream payload decoders: frames are encoded as the detector does, plain LZ4
+//and bitshuffle-LZ4 for 8, 16 and 32-bit elements, decoded with and without the thread pool and
+//compared. Corrupt payloads must be rejected, also when a pool thread hits them. Exits non-zero
+//on the first mismatch.
+#include "../BitshuffleLz4.h"
+#include "../ThreadPool.h"
+#include "BitshuffleEncoder.h"
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+int failures = 0;
+
+void check(bool ok, const std::string &what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+// Sparse counts with runs of gap pixels, like a detector frame
+std::vector<uint8_t> frame(size_t elems, size_t elemSize, uint32_t seed) {
+    std::vector<uint8_t> bytes(elems * elemSize, 0);
+    std::mt19937 random(seed);
+    for (size_t i = 0; i < elems / 20 + 1; ++i) {
+        size_t at = random() % elems;
+        uint32_t value = random();
+        std::memcpy(&bytes[at * elemSize], &value, elemSize);
+    }
+    for (size_t i = elems / 3; i < elems / 3 + elems / 50; ++i) {
+        std::memset(&bytes[i * elemSize], 0xFF, elemSize);
+    }
+    return bytes;
+}
+
+std::string describe(const char *encoding, size_t elems, size_t elemSize) {
+    return std::string(encoding) + " " + std::to_string(elems) + " x " +
+           std::to_string(8 * elemSize) + "-bit";
+}
+
+void checkLz4(size_t elems, size_t elemSize) {
+    std::vector<uint8_t> original = frame(elems, elemSize, 1);
+    std::string encoded = bitshuffle::encodeLz4(original.data(), original.size());
+    std::vector<uint8_t> decoded(original.size(), 0xAA);
+    bitshuffle::decodeLz4(reinterpret_cast<const uint8_t *>(encoded.data()), encoded.size(),
+                          decoded.data(), decoded.size());
+    check(decoded == original, describe("lz4", elems, elemSize));
+
+    // One byte short of the frame is corrupt too
+    bool rejected = false;
+    try {
+        bitshuffle::decodeLz4(reinterpret_cast<const uint8_t *>(encoded.data()), encoded.size(),
+                              decoded.data(), decoded.size() - 1);
+    } catch (const std::runtime_error &) {
+        rejected = true;
+    }
+    check(rejected, describe("lz4 short output", elems, elemSize));
+}
+
+void checkBitshuffle(size_t elems, size_t elemSize, ThreadPool &pool) {
+    std::vector<uint8_t> original = frame(elems, elemSize, 2);
+    std::string payload =
+        bitshuffle::encodeBitshuffleLz4(original.data(), original.size(), elemSize).payload();
+    const uint8_t *src = reinterpret_cast<const uint8_t *>(payload.data());
+    for (ThreadPool *threads : {static_cast<ThreadPool *>(nullptr), &pool}) {
+        std::vector<uint8_t> decoded(original.size(), 0xAA);
+        bitshuffle::decodeBitshuffleLz4(src, payload.size(), decoded.data(), decoded.size(),
+                                        elemSize, threads);
+        check(decoded == original,
+              describe(threads ? "bitshuffle-lz4 pooled" : "bitshuffle-lz4", elems, elemSize));
+    }
+}
+
+// A corrupt block deep in the frame throws from a pool thread; the error has to reach the
+// caller and leave the pool usable
+void checkCorrupt(ThreadPool &pool) {
+    size_t elems = 1 << 20;
+    std::vector<uint8_t> original = frame(elems, 4, 3);
+    std::string payload =
+        bitshuffle::encodeBitshuffleLz4(original.data(), original.size(), 4).payload();
+    std::string corrupt = payload;
+    for (size_t i = corrupt.size() * 3 / 4; i < corrupt.size() * 3 / 4 + 64; ++i) {
+        corrupt[i] = static_cast<char>(0xFF);
+    }
+    std::vector<uint8_t> decoded(original.size());
+    for (int round = 0; round < 2; ++round) {
+        bool rejected = false;
+        try {
+            bitshuffle::decodeBitshuffleLz4(reinterpret_cast<const uint8_t *>(corrupt.data()),
+                                            corrupt.size(), decoded.data(), decoded.size(), 4,
+                                            &pool);
+        } catch (const std::runtime_error &) {
+            rejected = true;
+        }
+        check(rejected, "corrupt bitshuffle-lz4 rejected");
+        bitshuffle::decodeBitshuffleLz4(reinterpret_cast<const uint8_t *>(payload.data()),
+                                        payload.size(), decoded.data(), decoded.size(), 4, &pool);
+        check(decoded == original, "bitshuffle-lz4 after a corrupt frame");
+    }
+
+    bool rejected = false;
+    try {
+        bitshuffle::decodeBitshuffleLz4(reinterpret_cast<const uint8_t *>(payload.data()),
+                                        payload.size() / 2, decoded.data(), decoded.size(), 4,
+                                        &pool);
+    } catch (const std::runtime_error &) {
+        rejected = true;
+    }
+    check(rejected, "truncated bitshuffle-lz4 rejected");
+}
+
+int main() {
+    ThreadPool pool(4);
+    // Whole blocks, a short last block, and elements left over after it
+    const size_t sizes[] = {5, 8, 1000, 2048, 4096 + 13, 1024 * 1024 + 7, 4148 * 4362};
+    for (size_t elemSize : {1, 2, 4}) {
+        for (size_t elems : sizes) {
+            checkLz4(elems, elemSize);
+            checkBitshuffle(elems, elemSize, pool);
+        }
+    }
+    checkCorrupt(pool);
+    if (failures) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All stream payload checks passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,205 @@
+//Compile:
+//g++ bench/tiff_decode.cpp -o tiff_decode -O2 -pthread -ltiff
+
+//Per-frame decode time of a monitor TIFF, the way yamone used to decode it and from memory with
+//TiffMemoryReader. The old way wrote the body to a temp file, opened it with TIFFOpen and read it
+//strip by strip into an array. The synthetic frame is stored like the monitor serves it,
+//uncompressed in one strip, which TiffMemoryReader reads in place; --deflate stores it in
+//compressed strips instead, so libtiff decodes it from the buffer. Recorded TIFFs given as
+//arguments are timed instead of the synthetic frame.
+#include "../TiffMemoryReader.h"
+#include "MockEigerServer.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+struct DecodeOptions {
+    uint32_t width = 4148;
+    uint32_t height = 4362;
+    int frames = 20;
+    bool deflate = false;
+    std::vector<std::string> tiffFiles;
+};
+
+void usage() {
+    std::cerr << "Usage: tiff_decode [--size WxH] [--frames n] [--deflate] [recorded.tif ...]"
+              << std::endl;
+    std::exit(1);
+}
+
+DecodeOptions parseOptions(int argc, char *argv[]) {
+    DecodeOptions options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--size" && hasValue) {
+            if (std::sscanf(argv[++i], "%ux%u", &options.width, &options.height) != 2) {
+                usage();
+            }
+        } else if (arg == "--frames" && hasValue) {
+            options.frames = std::atoi(argv[++i]);
+        } else if (arg == "--deflate") {
+            options.deflate = true;
+        } else if (arg.compare(0, 2, "--") == 0) {
+            usage();
+        } else {
+            options.tiffFiles.push_back(arg);
+        }
+    }
+    if (options.frames <= 0) {
+        usage();
+    }
+    return options;
+}
+
+std::string readFile(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        std::cerr << "Unable to read " << path << std::endl;
+        std::exit(1);
+    }
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+// Deflate compressed uint32 TIFF in strips of 64 rows, written through libtiff
+std::string deflateTiff(uint32_t width, uint32_t height, const std::vector<uint32_t> &pixels) {
+    const char *path = "/tmp/yamone_tiff_decode_deflate.tiff";
+    TIFF *tif = TIFFOpen(path, "w");
+    if (!tif) {
+        std::cerr << "Unable to write " << path << std::endl;
+        std::exit(1);
+    }
+    const uint32_t rowsPerStrip = 64;
+    TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, width);
+    TIFFSetField(tif, TIFFTAG_IMAGELENGTH, height);
+    TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 32);
+    TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
+    TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_UINT);
+    TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+    TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, rowsPerStrip);
+    TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_ADOBE_DEFLATE);
+    for (uint32_t row = 0; row < height; row += rowsPerStrip) {
+        uint32_t rows = std::min(rowsPerStrip, height - row);
+        TIFFWriteEncodedStrip(tif, row / rowsPerStrip,
+                              const_cast<uint32_t *>(pixels.data()) + size_t(row) * width,
+                              size_t(rows) * width * sizeof(uint32_t));
+    }
+    TIFFClose(tif);
+    std::string data = readFile(path);
+    std::remove(path);
+    return data;
+}
+
+// saveImage before the in-memory reader, up to the decoded pixels
+bool decodeThroughFile(const std::string &body, std::vector<uint32_t> &imageArray) {
+    std::string tempFilename = "/tmp/temp_image.tiff";
+    std::ofstream tempFile(tempFilename, std::ios::binary);
+    tempFile.write(body.data(), body.size());
+    tempFile.close();
+
+    TIFF *tif = TIFFOpen(tempFilename.c_str(), "r");
+    if (!tif) {
+        return false;
+    }
+    uint32_t width = 0, height = 0;
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+    tmsize_t stripSize = TIFFStripSize(tif);
+    uint32_t numStrips = TIFFNumberOfStrips(tif);
+    imageArray.assign(size_t(width) * height, 0);
+    uint8_t *buf = static_cast<uint8_t *>(_TIFFmalloc(stripSize));
+    uint8_t *dst = reinterpret_cast<uint8_t *>(imageArray.data());
+    size_t remaining = imageArray.size() * sizeof(uint32_t);
+    for (uint32_t strip = 0; strip < numStrips; ++strip) {
+        tmsize_t n = TIFFReadEncodedStrip(tif, strip, buf, stripSize);
+        if (n == -1) {
+            _TIFFfree(buf);
+            TIFFClose(tif);
+            return false;
+        }
+        size_t bytes = std::min(static_cast<size_t>(n), remaining);
+        std::memcpy(dst, buf, bytes);
+        dst += bytes;
+        remaining -= bytes;
+    }
+    _TIFFfree(buf);
+    TIFFClose(tif);
+    return true;
+}
+
+double percentile(const std::vector<double> &sorted, double p) {
+    size_t index = static_cast<size_t>(p / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+void printTimes(const char *what, std::vector<double> times) {
+    std::sort(times.begin(), times.end());
+    std::cout << "  " << what << ": p50 " << percentile(times, 50) << " ms, p99 "
+              << percentile(times, 99) << " ms" << std::endl;
+}
+
+volatile uint64_t checksum;
+
+int main(int argc, char *argv[]) {
+    DecodeOptions options = parseOptions(argc, argv);
+    std::vector<std::string> bodies;
+    for (const std::string &path : options.tiffFiles) {
+        bodies.push_back(readFile(path));
+    }
+    if (bodies.empty()) {
+        std::vector<uint32_t> pixels =
+            MockEigerServer::syntheticPixels(options.width, options.height);
+        bodies.push_back(options.deflate
+                             ? deflateTiff(options.width, options.height, pixels)
+                             : TiffEncoder::encode(options.width, options.height, pixels.data()));
+    }
+
+    typedef std::chrono::steady_clock Clock;
+    std::vector<double> throughFile, inMemory;
+    std::vector<uint32_t> imageArray;
+    TiffImage image;
+    bool zeroCopy = false;
+    for (int frame = 0; frame < options.frames; ++frame) {
+        const std::string &body = bodies[frame % bodies.size()];
+        const uint8_t *data = reinterpret_cast<const uint8_t *>(body.data());
+
+        auto start = Clock::now();
+        if (!decodeThroughFile(body, imageArray)) {
+            std::cerr << "Temp file decode failed" << std::endl;
+            return 1;
+        }
+        throughFile.push_back(
+            std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+
+        start = Clock::now();
+        if (!TiffMemoryReader::decode(data, body.size(), image)) {
+            std::cerr << "In-memory decode failed" << std::endl;
+            return 1;
+        }
+        inMemory.push_back(std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+        zeroCopy = image.zeroCopy;
+
+        // Both must see the same pixels
+        if (image.pixelCount() != imageArray.size() ||
+            !std::equal(imageArray.begin(), imageArray.end(), image.pixels)) {
+            std::cerr << "Decoded pixels differ" << std::endl;
+            return 1;
+        }
+        checksum = checksum + image.pixels[image.pixelCount() / 2];
+    }
+    std::remove("/tmp/temp_image.tiff");
+
+    std::cout << "Decode of " << image.width << "x" << image.height << " "
+              << (options.tiffFiles.empty() ? options.deflate ? "deflate" : "uncompressed"
+                                            : "recorded")
+              << " TIFF, " << options.frames << " frames" << std::endl;
+    printTimes("temp file + TIFFOpen", throughFile);
+    printTimes(zeroCopy ? "in memory, zero copy" : "in memory", inMemory);
+    return 0;
+}
@@ -0,0 +1,312 @@
+//Compile:
+//g++ bench/yamone_bench.cpp -o yamone_bench -O2 -pthread -ltiff -ltango -lcurl -lzmq -llz4 -lomniORB4 -lomnithread -lCOS4 -lomniDynamic4 -lomniCodeSets4 -I/usr/include/tango
+
+//End-to-end benchmark without a detector or ADXV: a mock Eiger serves frames at a fixed rate,
+//MonitorReceiver fetches and writes them, and a fake ADXV records when each load_image arrives.
+#include "../MonitorReceiver.h"
+#include "FakeAdxv.h"
+#include "FakeMetadataSource.h"
+#include "MockEigerServer.h"
+#include "MockStreamPublisher.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <set>
+#include <string>
+#include <sys/resource.h>
+#include <thread>
+#include <vector>
+
+struct BenchOptions {
+    double rate = 10.0;
+    uint32_t width = 4148;
+    uint32_t height = 4362;
+    double seconds = 10.0;
+    // The receiver keeps polling the stopped detector this long afterwards
+    double idleSeconds = 0.0;
+    std::string mode = "next";
+    int port = 18080;
+    int adxvPort = 18100;
+    int adxvIntervalMs = 0;
+    // ADXV starts accepting connections this long after the receiver
+    int adxvDelayMs = 0;
+    int metadataDelayUs = 0;
+    std::string statsFile;
+    bool adaptiveDepth = true;
+    uint32_t previewBin = 0;
+    size_t radialBins = 0;
+    size_t sumFrames = 0;
+    std::string sharedMemoryName;
+    std::string captureFile;
+    std::string replayFile;
+    bool replayFast = false;
+    // Element size of --mode stream frames
+    size_t streamBytes = 4;
+    std::vector<std::string> tiffFiles;
+};
+
+void usage() {
+    std::cerr << "Usage: yamone_bench [--rate Hz] [--size WxH] [--seconds s] [--idle s] "
+                 "[--mode next|monitor|catch-up|stream] [--stream-bits 8|16|32] [--adxv-interval ms] [--adxv-delay ms] "
+                 "[--metadata-delay us] [--port p] [--adxv-port p] [--stats-file path] "
+                 "[--32-bit] [--preview 2|4] [--radial-bins n] [--sum n] [--shm /name] [--capture file] "
+                 "[--replay file [--replay-fast]] [recorded.tif ...]"
+              << std::endl;
+    std::exit(1);
+}
+
+BenchOptions parseOptions(int argc, char *argv[]) {
+    BenchOptions options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--rate" && hasValue) {
+            options.rate = std::atof(argv[++i]);
+        } else if (arg == "--size" && hasValue) {
+            if (std::sscanf(argv[++i], "%ux%u", &options.width, &options.height) != 2) {
+                usage();
+            }
+        } else if (arg == "--seconds" && hasValue) {
+            options.seconds = std::atof(argv[++i]);
+        } else if (arg == "--idle" && hasValue) {
+            options.idleSeconds = std::atof(argv[++i]);
+        } else if (arg == "--mode" && hasValue) {
+            options.mode = argv[++i];
+        } else if (arg == "--stream-bits" && hasValue) {
+            options.streamBytes = static_cast<size_t>(std::atoi(argv[++i])) / 8;
+        } else if (arg == "--adxv-interval" && hasValue) {
+            options.adxvIntervalMs = std::atoi(argv[++i]);
+        } else if (arg == "--adxv-delay" && hasValue) {
+            options.adxvDelayMs = std::atoi(argv[++i]);
+        } else if (arg == "--metadata-delay" && hasValue) {
+            options.metadataDelayUs = std::atoi(argv[++i]);
+        } else if (arg == "--port" && hasValue) {
+            options.port = std::atoi(argv[++i]);
+        } else if (arg == "--adxv-port" && hasValue) {
+            options.adxvPort = std::atoi(argv[++i]);
+        } else if (arg == "--stats-file" && hasValue) {
+            options.statsFile = argv[++i];
+        } else if (arg == "--32-bit") {
+            options.adaptiveDepth = false;
+        } else if (arg == "--preview" && hasValue) {
+            options.previewBin = static_cast<uint32_t>(std::atoi(argv[++i]));
+        } else if (arg == "--capture" && hasValue) {
+            options.captureFile = argv[++i];
+        } else if (arg == "--replay" && hasValue) {
+            options.replayFile = argv[++i];
+        } else if (arg == "--replay-fast") {
+            options.replayFast = true;
+        } else if (arg == "--shm" && hasValue) {
+            options.sharedMemoryName = argv[++i];
+        } else if (arg == "--sum" && hasValue) {
+            options.sumFrames = static_cast<size_t>(std::atoi(argv[++i]));
+        } else if (arg == "--radial-bins" && hasValue) {
+            options.radialBins = static_cast<size_t>(std::atoi(argv[++i]));
+        } else if (arg.compare(0, 2, "--") == 0) {
+            usage();
+        } else {
+            options.tiffFiles.push_back(arg);
+        }
+    }
+    if (options.rate <= 0 || options.seconds <= 0 || options.idleSeconds < 0 ||
+        (options.mode != "next" && options.mode != "monitor" && options.mode != "catch-up" &&
+         options.mode != "stream") ||
+        (options.streamBytes != 1 && options.streamBytes != 2 && options.streamBytes != 4)) {
+        usage();
+    }
+    return options;
+}
+
+double percentile(const std::vector<double> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    size_t index = static_cast<size_t>(p / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+DetectorConfig benchConfig(const BenchOptions &options) {
+    DetectorConfig config;
+    config.ip = "127.0.0.1";
+    config.port = options.port;
+    config.name = "bench";
+    config.imageFilename = "/tmp/yamone_bench";
+    config.beamCenterFile = "/tmp/.yamone_bench_beam_center";
+    config.adxvPort = options.adxvPort;
+    config.adxvMinInterval = std::chrono::milliseconds(options.adxvIntervalMs);
+    config.pollMode = options.mode == "monitor" ? PollMode::Adaptive : PollMode::LongPoll;
+    config.catchUp = options.mode == "catch-up";
+    config.stream = options.mode == "stream";
+    config.streamPort = options.port + 1;
+    config.statsFile = options.statsFile;
+    config.adaptiveDepth = options.adaptiveDepth;
+    config.previewBin = options.previewBin;
+    config.previewFilename = "/tmp/yamone_bench_preview";
+    config.frameStatsFile = "/tmp/.yamone_bench_frame_stats";
+    config.radialBins = options.radialBins;
+    config.sumFrames = options.sumFrames;
+    config.sumFilename = "/tmp/yamone_bench_sum";
+    config.sharedMemoryName = options.sharedMemoryName;
+    config.radialProfileFile = "/tmp/.yamone_bench_radial_profile";
+    config.captureFile = options.captureFile;
+    return config;
+}
+
+// Feeds a capture through the receiver instead of the mock server; the
+// replayer and the pipeline statistics report the throughput
+int replay(const BenchOptions &options) {
+    FakeAdxv adxv(options.adxvPort);
+    adxv.start();
+    DetectorConfig config = benchConfig(options);
+    config.replayFile = options.replayFile;
+    config.replayFast = options.replayFast;
+    {
+        MonitorReceiver receiver(config);
+        receiver.run();
+    }
+    adxv.stop();
+    std::cout << "  load_image requests " << adxv.loads().size() << std::endl;
+    return 0;
+}
+
+double processCpuSeconds() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+struct IdleLoad {
+    double megabytesPerSecond = 0;
+    double receiverCpuPercent = 0;
+    double serverCpuPercent = 0;
+};
+
+// Bandwidth and CPU while the receiver polls the stopped detector, which
+// still serves its last frame. The CPU the mock spent answering is counted
+// apart from the rest of the process, the receiver.
+IdleLoad measureIdle(const BenchOptions &options, MockEigerServer &server) {
+    size_t bytes = server.bytesServed();
+    double cpu = processCpuSeconds(), serverCpu = server.cpuSeconds();
+    std::this_thread::sleep_for(std::chrono::duration<double>(options.idleSeconds));
+    IdleLoad idle;
+    idle.megabytesPerSecond = (server.bytesServed() - bytes) / options.idleSeconds / 1e6;
+    idle.serverCpuPercent = 100.0 * (server.cpuSeconds() - serverCpu) / options.idleSeconds;
+    idle.receiverCpuPercent =
+        100.0 * (processCpuSeconds() - cpu) / options.idleSeconds - idle.serverCpuPercent;
+    return idle;
+}
+
+// Matches the frames the fake ADXV loaded with when the source sent them;
+// bytesServed is what the source sent during the acquisition
+template <typename Source>
+void report(const BenchOptions &options, Source &source, size_t bytesServed, FakeAdxv &adxv,
+            MockEigerServer::Clock::time_point acquisitionStart) {
+    std::vector<double> latencies;
+    std::set<uint32_t> displayed;
+    for (const FakeAdxv::Load &load : adxv.loads()) {
+        MockEigerServer::Clock::time_point served;
+        if (!displayed.insert(load.frameNumber).second ||
+            !source.servedAt(load.frameNumber, served)) {
+            continue;
+        }
+        latencies.push_back(
+            std::chrono::duration<double, std::milli>(load.received - served).count());
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    size_t published = source.published();
+    std::cout << "\nBenchmark " << options.width << "x" << options.height << " at "
+              << options.rate << " Hz for " << options.seconds << " s, mode " << options.mode
+              << "\n  published " << published << ", served " << source.served() << " ("
+              << bytesServed / options.seconds / 1e6 << " MB/s), displayed "
+              << displayed.size() << " (" << displayed.size() / options.seconds
+              << " frames/s), dropped " << published - std::min(published, displayed.size())
+              << "\n  latency served -> load_image: p50 " << percentile(latencies, 50)
+              << " ms, p99 " << percentile(latencies, 99) << " ms, max "
+              << (latencies.empty() ? 0.0 : latencies.back()) << " ms" << std::endl;
+    if (!adxv.loads().empty()) {
+        std::cout << "  first load_image "
+                  << std::chrono::duration<double, std::milli>(adxv.loads().front().received -
+                                                               acquisitionStart)
+                         .count()
+                  << " ms after the acquisition started" << std::endl;
+    }
+    if (adxv.unreadable()) {
+        std::cout << "  " << adxv.unreadable() << " load_image requests named unreadable files"
+                  << std::endl;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    BenchOptions options = parseOptions(argc, argv);
+    if (!options.replayFile.empty()) {
+        return replay(options);
+    }
+
+    MockEigerServer server(options.port, options.rate, options.width, options.height,
+                           options.tiffFiles);
+    FakeAdxv adxv(options.adxvPort);
+    server.start();
+    // The mock server still answers the receiver's config requests
+    std::unique_ptr<MockStreamPublisher> stream;
+    if (options.mode == "stream") {
+        stream.reset(new MockStreamPublisher(
+            options.port + 1, options.rate, options.width, options.height,
+            MockEigerServer::syntheticPixels(options.width, options.height), options.streamBytes));
+        stream->start();
+    }
+    if (options.adxvDelayMs == 0) {
+        adxv.start();
+    }
+
+    DetectorConfig config = benchConfig(options);
+    MonitorReceiver receiver(config, std::unique_ptr<MetadataSource>(new FakeMetadataSource(
+                                         std::chrono::microseconds(options.metadataDelayUs))));
+    std::thread receiving([&receiver] { receiver.run(); });
+    if (options.adxvDelayMs > 0) {
+        // ADXV still starting up while the receiver warms up
+        std::this_thread::sleep_for(std::chrono::milliseconds(options.adxvDelayMs));
+        adxv.start();
+    }
+
+    // Let the receiver connect before the first frame is published
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    auto acquisitionStart = MockEigerServer::Clock::now();
+    if (stream) {
+        stream->startAcquisition();
+    } else {
+        server.startAcquisition();
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(options.seconds));
+    server.stopAcquisition();
+    if (stream) {
+        stream->stopAcquisition();
+    }
+    // Frames still in the pipeline are counted if they arrive within a second
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    size_t bytesServed = stream ? stream->bytesServed() : server.bytesServed();
+    IdleLoad idle;
+    if (options.idleSeconds > 0) {
+        idle = measureIdle(options, server);
+    }
+    receiver.stop();
+    receiving.join();
+    adxv.stop();
+
+    if (stream) {
+        report(options, *stream, bytesServed, adxv, acquisitionStart);
+        stream->stop();
+    } else {
+        report(options, server, bytesServed, adxv, acquisitionStart);
+    }
+    if (options.idleSeconds > 0) {
+        std::cout << "  idle for " << options.idleSeconds << " s: " << idle.megabytesPerSecond
+                  << " MB/s served, receiver CPU " << idle.receiverCpuPercent
+                  << "% (mock server " << idle.serverCpuPercent << "%)" << std::endl;
+    }
+    server.stop();
+    return 0;
+}
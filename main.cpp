@@ -1,21 +1,27 @@
 //Compile:
 //sudo apt-get install libtiff-dev
-//g++ main.cpp -o yamone -ltiff -ltango -lcurl -lomniORB4 -g -lomnithread -lCOS4 -lomniDynamic4 -lomniCodeSets4 -I/usr/include/tango
+//g++ main.cpp -o yamone -pthread -ltiff -ltango -lcurl -lzmq -llz4 -lomniORB4 -g -lomnithread -lCOS4 -lomniDynamic4 -lomniCodeSets4 -I/usr/include/tango
 
 //Eiger interface returns tif file as uint32. Read the result with libtiff, strip the heaser and resave it under /tmp/eiger_monitor
 //to make sure that the pixels are interpreted correctly.
-#include "EigerMonitorClient.h"
+#include "MonitorReceiver.h"
+#include "MultiMonitorLoop.h"
 #include <algorithm>
 #include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <cstdlib> // For setenv
 #include <cstring>
+#include <ctime>
+#include <fcntl.h>
 #include <fstream>
 #include <iostream>
 #include <iterator>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <signal.h>
+#include <spawn.h>
 #include <sstream>
 #include <stdexcept>
 #include <string>
@@ -26,321 +32,252 @@
 #include <vector>
 #include <tiffio.h>
 
-// Custom TIFF error handler to suppress warnings
-void tiffErrorHandler(const char* module, const char* fmt, va_list ap) {
-    // Do nothing, suppress warnings
+// Starts ADXV listening on port in a session of its own, output to /dev/null,
+// so it keeps running after yamone exits
+bool launchAdxv(int port) {
+    std::string portArg = std::to_string(port);
+    char *args[] = {const_cast<char *>("/opt/xray/bin/adxv"), const_cast<char *>("-socket"),
+                    const_cast<char *>(portArg.c_str()), const_cast<char *>("-rings"), nullptr};
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSID);
+    pid_t pid;
+    int error = posix_spawn(&pid, args[0], &actions, &attributes, args, environ);
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+    if (error != 0) {
+        std::cerr << "Unable to start " << args[0] << ": " << std::strerror(error) << std::endl;
+        return false;
+    }
+    return true;
 }
 
-class MonitorReceiver {
-private:
-    std::string ip_;
-    int port_;
-    std::string name_;
-    std::string imageFilename_;
-    std::vector<uint32_t> previousData_;
-    std::string beamCenterFile_;
-    std::pair<double, double> imageDimensions_;
-    double bcX_;
-    double bcY_;
-    double dDistance_;
-    double incidentEnergy_;
-    double incidentWavelength_;
-    double pixX_;
-    double pixY_;
-    EigerMonitorClient client_;
-
-public:
-    MonitorReceiver(const std::string &ip, int port = 80, const std::string &name = "")
-        : ip_(ip), port_(port),
-          name_(name.empty() ? "EIGER_" + ip + "_" + std::to_string(port) : name),
-          imageFilename_("/tmp/eiger_monitor"),
-          beamCenterFile_("/tmp/.adxv_beam_center"), imageDimensions_(4148, 4362),
-          client_(ip, port) {
-        // Initialize other attributes
-        TIFFSetWarningHandler(tiffErrorHandler); // Set custom TIFF error handler
+// Parses host[:port][@tango/device] as given on the command line
+DetectorConfig parseDetector(const std::string &arg) {
+    DetectorConfig config;
+    std::string address = arg;
+    size_t at = arg.find('@');
+    if (at != std::string::npos) {
+        config.tangoDevice = arg.substr(at + 1);
+        address = arg.substr(0, at);
     }
-
-    ~MonitorReceiver() {
-        // Destructor
+    size_t colon = address.find(':');
+    config.ip = address.substr(0, colon);
+    if (colon != std::string::npos) {
+        config.port = std::stoi(address.substr(colon + 1));
     }
+    return config;
+}
 
-    bool saveImage(const std::vector<uint8_t> &imageData) {
-        // Create a temporary file to write the incoming data
-        std::string tempFilename = "/tmp/temp_image.tiff";
-        std::ofstream tempFile(tempFilename, std::ios::binary);
-        tempFile.write(reinterpret_cast<const char*>(imageData.data()), imageData.size());
-        tempFile.close();
-
-        // Open the temporary file with libtiff to read the header information
-        TIFF* tif = TIFFOpen(tempFilename.c_str(), "r");
-        if (!tif) {
-            std::cerr << "Error: Unable to open TIFF file" << std::endl;
-            return false;
-        }
-
-        // Read the image dimensions
-        uint32_t width = 0, height = 0;
-        TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
-        TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
-        imageDimensions_ = {width, height};
-
-        // Read the pixel size
-        double pixelSizeX = 0.0, pixelSizeY = 0.0;
-        TIFFGetField(tif, TIFFTAG_XRESOLUTION, &pixelSizeX);
-        TIFFGetField(tif, TIFFTAG_YRESOLUTION, &pixelSizeY);
-        pixX_ = pixelSizeX;
-        pixY_ = pixelSizeY;
-
-        // Calculate the number of strips
-        uint32_t stripSize = TIFFStripSize(tif);
-        uint32_t numStrips = TIFFNumberOfStrips(tif);
-
-        // Read the image data from the strips
-        std::vector<uint32_t> imageArray(width * height);
-        uint8_t* buf = (uint8_t*)_TIFFmalloc(stripSize);
-
-        for (uint32_t strip = 0; strip < numStrips; ++strip) {
-            uint32_t offset = strip * stripSize;
-            if (TIFFReadEncodedStrip(tif, strip, buf, stripSize) == -1) {
-                std::cerr << "Error: Failed to read strip " << strip << std::endl;
-                _TIFFfree(buf);
-                TIFFClose(tif);
-                return false;
+int main(int argc, char *argv[]) {
+    std::vector<DetectorConfig> detectors;
+    bool catchUp = false;
+    bool stream = false;
+    std::string statsDir;
+    bool adaptiveDepth = true;
+    std::string cbfDirectory;
+    uint32_t previewBin = 0;
+    BinMode previewMode = BinMode::Sum;
+    bool adxvPreview = false;
+    FrameStatsLevels frameStatsLevels;
+    bool frameStats = true;
+    size_t radialBins = 0;
+    RadialUnit radialUnit = RadialUnit::Q;
+    size_t sumFrames = 0;
+    bool adxvSum = false;
+    std::string sharedMemoryName;
+    PixelRect roi;
+    bool roiAroundBeam = false;
+    std::string captureFile;
+    std::string replayFile;
+    bool replayFast = false;
+    std::chrono::milliseconds adxvReadyTimeout = DetectorConfig().adxvReadyTimeout;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--catch-up") {
+            catchUp = true;
+        } else if (arg == "--stream") {
+            stream = true;
+        } else if (arg == "--stats-dir" && i + 1 < argc) {
+            statsDir = argv[++i];
+        } else if (arg == "--32-bit") {
+            adaptiveDepth = false;
+        } else if (arg == "--cbf-dir" && i + 1 < argc) {
+            cbfDirectory = argv[++i];
+        } else if (arg == "--preview" && i + 1 < argc) {
+            // sum2, sum4, max2 or max4
+            std::string preview = argv[++i];
+            previewMode = preview.compare(0, 3, "max") == 0 ? BinMode::Max : BinMode::Sum;
+            previewBin = static_cast<uint32_t>(std::atoi(preview.c_str() + 3));
+            if ((preview.compare(0, 3, "sum") != 0 && preview.compare(0, 3, "max") != 0) ||
+                (previewBin != 2 && previewBin != 4)) {
+                std::cerr << "Unknown preview " << preview << ", expected sum2, sum4, max2 or max4"
+                          << std::endl;
+                previewBin = 0;
             }
-
-            // Copy the strip data to the image array
-            std::memcpy(reinterpret_cast<uint8_t*>(&imageArray[0]) + offset, buf, stripSize);
-        }
-
-        _TIFFfree(buf);
-        TIFFClose(tif);
-
-        // Compare new image data with previous data
-        if (previousData_.empty() ||
-            !std::equal(previousData_.begin(), previousData_.end(), imageArray.begin())) {
-
-            try {
-                double bcX = 0.0, bcY = 0.0, dDistance = 0.0, incidentEnergy = 0.0,
-                       incidentWavelength = 0.0;
-
-                Tango::DeviceProxy device("<Put Tango adress of the detector interface here>");
-
-                // Read attributes
-                Tango::DeviceAttribute att_reply;
-
-                att_reply = device.read_attribute("BeamCenterX");
-                att_reply >> bcX;
-
-                att_reply = device.read_attribute("BeamCenterY");
-                att_reply >> bcY;
-
-                att_reply = device.read_attribute("DetectorDistance");
-                att_reply >> dDistance;
-
-                att_reply = device.read_attribute("IncidentEnergy");
-                att_reply >> incidentEnergy;
-
-                incidentWavelength = 12400.0 / incidentEnergy; // Convert energy to wavelength (assuming energy is in eV)
-
-                // Write the beam center file
-                writeBeamCenterFile(bcX, bcY);
-
-                // Construct the header
-                std::string header = R"({
-                    HEADER_BYTES=512;
-                    DIM=2;
-                    BYTE_ORDER=little_endian;
-                    TYPE=unsigned_int;
-                    SIZE1=)" + std::to_string(width) +
-                                   R"(;
-                    SIZE2=)" + std::to_string(height) +
-                                   R"(;
-                    PIXEL_SIZE=)" + std::to_string(pixelSizeX) +
-                                   R"(;
-                    BEAM_CENTER_X=)" + std::to_string(bcX * pixelSizeX) +
-                                   R"(;
-                    BEAM_CENTER_Y=)" + std::to_string(bcY * pixelSizeY) +
-                                   R"(;
-                    DISTANCE=)" + std::to_string(dDistance * 1000) +
-                                   R"(;
-                    WAVELENGTH=)" + std::to_string(incidentWavelength) +
-                                   R"(;
-                })";
-
-                // Write the image data along with the header to a file
-                std::ofstream file(imageFilename_, std::ios::binary);
-                // Ensure header is 512 bytes
-                file << header;
-                std::string padding(512 - header.size(), ' ');
-                file << padding;
-
-                file.write(reinterpret_cast<const char *>(imageArray.data()), imageArray.size() * sizeof(uint32_t));
-                file.close();
-            } catch (Tango::DevFailed &e) {
-                Tango::Except::print_exception(e);
-                return false;
+        } else if (arg == "--adxv-preview") {
+            adxvPreview = true;
+        } else if (arg == "--hot-level" && i + 1 < argc) {
+            frameStatsLevels.hot = static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else if (arg == "--saturation-level" && i + 1 < argc) {
+            frameStatsLevels.saturation = static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else if (arg == "--no-frame-stats") {
+            frameStats = false;
+        } else if (arg == "--sum" && i + 1 < argc) {
+            sumFrames = static_cast<size_t>(std::stoul(argv[++i]));
+        } else if (arg == "--shm" && i + 1 < argc) {
+            sharedMemoryName = argv[++i];
+            if (sharedMemoryName.empty() || sharedMemoryName[0] != '/') {
+                sharedMemoryName = "/" + sharedMemoryName;
+            }
+        } else if (arg == "--roi" && i + 1 < argc) {
+            // X,Y,WIDTH,HEIGHT in detector pixels
+            if (std::sscanf(argv[++i], "%u,%u,%u,%u", &roi.x, &roi.y, &roi.width, &roi.height) != 4) {
+                std::cerr << "Unknown ROI " << argv[i] << ", expected X,Y,WIDTH,HEIGHT" << std::endl;
+                roi = PixelRect();
+            }
+            roiAroundBeam = false;
+        } else if (arg == "--roi-beam" && i + 1 < argc) {
+            // WIDTHxHEIGHT around the beam center
+            roi = PixelRect();
+            if (std::sscanf(argv[++i], "%ux%u", &roi.width, &roi.height) != 2) {
+                std::cerr << "Unknown ROI size " << argv[i] << ", expected WIDTHxHEIGHT"
+                          << std::endl;
+                roi = PixelRect();
+            }
+            roiAroundBeam = true;
+        } else if (arg == "--capture" && i + 1 < argc) {
+            captureFile = argv[++i];
+        } else if (arg == "--replay" && i + 1 < argc) {
+            replayFile = argv[++i];
+        } else if (arg == "--replay-fast") {
+            replayFast = true;
+        } else if (arg == "--adxv-wait" && i + 1 < argc) {
+            // ms to wait for ADXV at startup, 0 not to wait
+            adxvReadyTimeout = std::chrono::milliseconds(std::stol(argv[++i]));
+        } else if (arg == "--adxv-sum") {
+            adxvSum = true;
+        } else if (arg == "--radial-bins" && i + 1 < argc) {
+            radialBins = static_cast<size_t>(std::stoul(argv[++i]));
+        } else if (arg == "--radial-unit" && i + 1 < argc) {
+            // q in 1/A or 2theta in degrees
+            std::string unit = argv[++i];
+            if (unit == "2theta") {
+                radialUnit = RadialUnit::TwoTheta;
+            } else if (unit != "q") {
+                std::cerr << "Unknown radial unit " << unit << ", expected q or 2theta"
+                          << std::endl;
             }
-
-            // Update previous data
-            previousData_ = imageArray;
-            return true;
         } else {
-            // Image data has not changed
-            return false;
+            detectors.push_back(parseDetector(arg));
         }
     }
-
-    void writeBeamCenterFile(double beamX, double beamY) {
-        std::ofstream file(beamCenterFile_);
-        if (file.is_open()) {
-            file << beamX << " " << beamY << " " << imageDimensions_.first << " "
-                 << imageDimensions_.second;
-            file.close();
-        } else {
-            throw std::runtime_error("Unable to open beam center file for writing.");
-        }
+    if (detectors.empty()) {
+        detectors.push_back(parseDetector("<Set detector IP adress here>"));
     }
-
-    void enableMonitor() {
-        // Logging
-        std::cout << "Enabling monitor on " << ip_ << std::endl;
-
-        try {
-            // Call the setMonitorConfig method of the client
-            client_.setMonitorConfig("mode", "enabled");
-            std::cerr << "Monitor on " << ip_ << ":" << port_ << " enabled" << std::endl;
-        } catch (const std::exception &e) {
-            // Error handling
-            std::cerr << "Error enabling monitor on " << ip_ << ": " << e.what() << std::endl;
-            // You can handle the error as needed, such as throwing an exception
-            throw;
+    if (catchUp && detectors.size() > 1) {
+        std::cerr << "--catch-up is only supported with a single detector" << std::endl;
+        catchUp = false;
+    }
+    if (!replayFile.empty() && detectors.size() > 1) {
+        std::cerr << "--replay feeds a single receiver, the other detectors are ignored"
+                  << std::endl;
+        detectors.resize(1);
+    }
+    if (stream && detectors.size() > 1) {
+        std::cerr << "--stream is only supported with a single detector" << std::endl;
+        stream = false;
+    }
+    for (DetectorConfig &detector : detectors) {
+        detector.catchUp = catchUp && !stream;
+        detector.stream = stream;
+        detector.adaptiveDepth = adaptiveDepth;
+        detector.cbfDirectory = cbfDirectory;
+        detector.previewBin = previewBin;
+        detector.previewMode = previewMode;
+        detector.adxvPreview = adxvPreview;
+        detector.frameStatsLevels = frameStatsLevels;
+        if (!frameStats) {
+            detector.frameStatsFile.clear();
+        }
+        detector.radialBins = radialBins;
+        detector.radialUnit = radialUnit;
+        detector.sumFrames = sumFrames;
+        detector.adxvSum = adxvSum;
+        detector.sharedMemoryName = sharedMemoryName;
+        detector.roi = roi;
+        detector.roiAroundBeam = roiAroundBeam;
+        detector.replayFile = replayFile;
+        detector.replayFast = replayFast;
+        detector.adxvReadyTimeout = adxvReadyTimeout;
+        if (!captureFile.empty()) {
+            detector.captureFile = captureFile;
         }
     }
 
-    std::vector<uint8_t> receive() {
-        // Logging
-        // std::cerr << "Monitor receiver " << name_ << " polling " << ip_ << ":" << port_ << std::endl;
-
-        try {
-            // Call the monitorImages method of the client
-            std::string frame = client_.monitorImages("monitor");
-
-            // Convert the string to a vector of uint8_t
-            std::vector<uint8_t> imageData(frame.begin(), frame.end());
-
-            return imageData;
-        } catch (const std::exception &e) {
-            // Error handling
-            std::cerr << "Monitor " << name_ << " error: " << e.what() << std::endl;
-            // You can handle the error as needed, such as throwing an exception
-            throw;
+    // Every detector beyond the first gets its own files and ADXV socket
+    for (size_t i = 1; i < detectors.size(); ++i) {
+        std::string suffix = "_" + std::to_string(i);
+        detectors[i].imageFilename += suffix;
+        detectors[i].beamCenterFile += suffix;
+        detectors[i].previewFilename += suffix;
+        detectors[i].sumFilename += suffix;
+        if (!detectors[i].captureFile.empty()) {
+            detectors[i].captureFile += suffix;
         }
+        if (!detectors[i].sharedMemoryName.empty()) {
+            detectors[i].sharedMemoryName += suffix;
+        }
+        if (!detectors[i].frameStatsFile.empty()) {
+            detectors[i].frameStatsFile += suffix;
+        }
+        detectors[i].radialProfileFile += suffix;
+        detectors[i].adxvPort += static_cast<int>(i);
     }
-
-    std::vector<uint8_t> processFrames(const std::vector<uint8_t> &frame) {
-        return frame;
+    if (!statsDir.empty()) {
+        for (size_t i = 0; i < detectors.size(); ++i) {
+            detectors[i].statsFile = statsDir + "/yamone_" + std::to_string(i) + ".prom";
+        }
     }
 
-    void showImageInADXV() {
-
-        try {
-            // ADXV connection details
-            std::string adxvHost = "127.0.0.1";
-            int adxvPort = 8100;
-
-            // Create a socket
-            int adxvSocket = socket(AF_INET, SOCK_STREAM, 0);
-            if (adxvSocket < 0) {
-                throw std::runtime_error("Failed to create socket");
-            }
-
-            // Server address structure
-            struct sockaddr_in serverAddr;
-            serverAddr.sin_family = AF_INET;
-            serverAddr.sin_port = htons(adxvPort);
-            inet_pton(AF_INET, adxvHost.c_str(), &serverAddr.sin_addr);
-
-            // Connect to the server
-            if (connect(adxvSocket, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0) {
-                close(adxvSocket);
-                throw std::runtime_error("Failed to connect to ADXV server");
-            }
-
-            // Prepare the message to send
-            std::string message = "load_image " + imageFilename_ + "\n";
-
-            // Send the message
-            ssize_t bytesSent = send(adxvSocket, message.c_str(), message.length(), 0);
-            if (bytesSent < 0) {
-                close(adxvSocket);
-                throw std::runtime_error("Failed to send notification to ADXV");
-            } else if (bytesSent != static_cast<ssize_t>(message.length())) {
-                close(adxvSocket);
-                throw std::runtime_error("Incomplete message sent to ADXV");
-            }
-
-            // Close the socket
-            close(adxvSocket);
-        } catch (const std::exception &e) {
-            // Error handling
-            std::cerr << "Error in ADXV notification: " << e.what() << std::endl;
-            // You can handle the error as needed, such as throwing an exception
-            throw;
+    // An ADXV is started for every socket nobody answers on yet; the receivers
+    // wait for it to come up while they warm up
+    for (const DetectorConfig &detector : detectors) {
+        if (AdxvSession::listening(detector.adxvHost, detector.adxvPort)) {
+            std::cout << "ADXV is already running on port " << detector.adxvPort << "." << std::endl;
+        } else {
+            launchAdxv(detector.adxvPort);
         }
     }
 
-    void run() {
-        // TODO: Check why it is going to the segfault.
-        // enableMonitor();
-        while (true) {
-            try {
-                auto frame = receive();
-                if (!frame.empty()) {
-                    auto data = processFrames(frame);
-                    if (saveImage(data)) {
-                        std::cout << "Image received from " << name_ << " and saved as "
-                                  << imageFilename_ << std::endl;
-                        showImageInADXV();
-                    }
-                }
-            } catch (const std::exception &e) {
-                std::cerr << "Error in monitor " << name_ << ": " << e.what() << std::endl;
-            }
-        }
+    if (detectors.size() == 1) {
+        MonitorReceiver monitorReceiver(detectors.front());
+        monitorReceiver.run();
+        return 0;
     }
-};
 
-bool isProcessRunning(const std::string &processName) {
-    FILE *pipe = popen(("pgrep -x " + processName).c_str(), "r");
-    if (!pipe) {
-        throw std::runtime_error("popen() failed!");
+    // Several detectors share one curl_multi loop for all monitor requests
+    std::vector<std::unique_ptr<MonitorReceiver>> receivers;
+    MultiMonitorLoop loop;
+    for (const DetectorConfig &detector : detectors) {
+        receivers.emplace_back(new MonitorReceiver(detector));
     }
-    char buffer[128];
-    std::string result = "";
-    while (!feof(pipe)) {
-        if (fgets(buffer, 128, pipe) != nullptr) {
-            result += buffer;
-        }
+    std::vector<std::thread> warmUps;
+    for (auto &receiver : receivers) {
+        warmUps.emplace_back(&MonitorReceiver::warmUp, receiver.get());
     }
-    pclose(pipe);
-    return !result.empty();
-}
-
-int main(int argc, char *argv[]) {
-    std::string adxvProcessName = "adxv";
-
-    if (!isProcessRunning(adxvProcessName)) {
-        // Start ADXV in a disconnected way with output redirected to /dev/null
-        std::system("/opt/xray/bin/adxv -socket -rings > /dev/null 2>&1 &");
-    } else {
-        std::cout << "ADXV is already running." << std::endl;
+    for (auto &warmUp : warmUps) {
+        warmUp.join();
     }
-
-    // // Wait for ADXV to start (adjust the sleep duration as needed)
-    // std::this_thread::sleep_for(std::chrono::seconds(1)); // Wait for 5 seconds
-
-    MonitorReceiver monitorReceiver("<Set detector IP adress here>");
-    monitorReceiver.run();
+    for (auto &receiver : receivers) {
+        receiver->start();
+        loop.addDetector(receiver->client(), *receiver, &receiver->scheduler());
+    }
+    loop.run();
 
     return 0;
 }